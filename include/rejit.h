@@ -17,6 +17,7 @@
 #ifndef REJIT_H_
 #define REJIT_H_
 
+#include <stdint.h>
 #include <string>
 #include <vector>
 
@@ -36,18 +37,26 @@ namespace rejit {
 //  will have both begin and end pointing at the end of string marker.
 //  - When matching 'abc' in string "0abc1", the first (and only) match
 //  will have begin pointing at 'a' and end pointing at '1'.
-//
-// TODO: Consider using offsets rather than pointers in the Match structure.
 struct Match {
   const char* begin;
   const char* end;
 };
 
+// Same as Match, but using offsets from the start of the text. This halves the
+// memory used to hold the matches, and the matches remain valid for copies of
+// the text. Only texts of up to kMaxCompactTextSize characters can be matched
+// this way.
+struct CompactMatch {
+  uint32_t begin;
+  uint32_t end;
+};
+const size_t kMaxCompactTextSize = UINT32_MAX;
+
 // High level helpers.
 // These are convenient helpers that abstract the use of the Regej class below.
-// Rejit currently does not yet have a cache for compiled regular expressions,
-// so using the Regej class methods will be more efficient than calling these
-// multiple times.
+// The compiled regular expressions are kept in a bounded process-wide cache (see
+// below), so calling these repeatedly with the same regexp does not recompile
+// it. The helpers can safely be called from multiple threads.
 // TODO(rames): Add table with examples.
 
 // Returns true iff the regexp matches the whole text.
@@ -66,6 +75,16 @@ size_t MatchAll(const char* regexp, const string& text,
                 std::vector<struct Match>* matches);
 size_t MatchAll(const char* regexp, const char* text, size_t text_size,
                 std::vector<struct Match>* matches);
+// Same as above, but write the matches to the array of 'capacity' matches
+// provided, without allocating any memory. If there are more than 'capacity'
+// matches, only the first 'capacity' matches are written.
+// Returns the number of matches written.
+size_t MatchAll(const char* regexp, const char* text, size_t text_size,
+                struct Match* matches, size_t capacity);
+// Same as above, but fill a vector of compact matches. Nothing is matched if the
+// text is longer than kMaxCompactTextSize.
+size_t MatchAll(const char* regexp, const char* text, size_t text_size,
+                std::vector<struct CompactMatch>* matches);
 // Count the number of left-most longest matches in the text.
 size_t MatchAllCount(const char* regexp, const string& text);
 size_t MatchAllCount(const char* regexp, const char* text, size_t text_size);
@@ -78,6 +97,44 @@ void Replace(vector<Match>* to_replace, string& text, const string& with);
 bool ReplaceFirst(const char* regexp, string& text, const string& with);
 size_t ReplaceAll(const char* regexp, string& text, const string& with);
 
+// Line helpers, for grep-like tools. Lines are separated by '\n', which is not
+// part of the lines. See also RegejLines below.
+// Returns the lines spanned by the match: the begin of the match is moved back
+// to the start of its line, and the end forward to the end of its line.
+Match EnclosingLines(const char* text, size_t text_size, Match match);
+// Count the '\n' characters in the text. The number (starting at 0) of the line
+// containing the character at offset n is the count for the first n characters.
+size_t CountNewlines(const char* text, size_t text_size);
+
+// Cache of compiled regular expressions used by the high level helpers above.
+// Regexps are cached per match type. When the cache is full, the least recently
+// used regexp is evicted.
+struct CacheStats {
+  size_t hits;
+  size_t misses;
+  size_t evictions;
+  // Number of compiled regexps currently cached.
+  size_t size;
+  size_t capacity;
+};
+CacheStats GetCacheStats();
+// Set the maximum number of compiled regexps kept in the cache. Extra entries
+// are evicted. A capacity of 0 disables the cache.
+void SetCacheCapacity(size_t capacity);
+// Empty the cache and reset its statistics.
+void ClearCache();
+
+// Generated code is allocated in large executable regions shared by all the
+// compiled regexps.
+struct CodeArenaStats {
+  // Bytes of executable memory mapped.
+  size_t committed;
+  // Bytes used by live code.
+  size_t used;
+  size_t regions;
+};
+CodeArenaStats GetCodeArenaStats();
+
 // Types of matches. 
 // Ordered by matching 'difficulty'.
 enum MatchType {
@@ -85,31 +142,80 @@ enum MatchType {
   kMatchAnywhere,
   kMatchFirst,
   kMatchAll,
+  // Same matches as kMatchAll, but the generated code only counts them.
+  kMatchCount,
+  // Used by RegejSet. Records which regexps of a set match anywhere in the
+  // text.
+  kMatchSet,
   kNMatchTypes
 };
+// Mask of the match types compiled by Regej::CompileAll. Bit n is set for
+// match type n.
+const unsigned kRegejMatchTypes = (1 << kMatchSet) - 1;
 namespace internal  {
 // Internal structure used to track compilation information.
 // A forward declaration is required here to reference it from class Regej.
 class RegexpInfo;
+class CodeBlock;
+class SubmatchResolver;
 }
 
 // Error status returned by rejit.
-// Upon error, the rejit_status_string is updated with an error message.
+// Upon error, the rejit_status_string of the calling thread is updated with an
+// error message.
 enum Status {
   RejitSuccess = 0,
   // Parser errors must have negative codes.
   ParserError = -1
 };
-extern char* const rejit_status_string;
+extern thread_local char rejit_status_string[];
+
+// Options modifying how a Regej matches, combined in a mask.
+enum RegejOption {
+  kNoOptions = 0,
+  // Match letters regardless of their case. Only ASCII letters are folded.
+  kIgnoreCase = 1 << 0
+};
+
+// Memory used by the compiled code while matching, notably to track the states
+// of the regexp. The code leaves it ready for the next match, so reusing a
+// context avoids preparing that memory on every call. This matters when
+// matching many short texts, like lines of a log.
+// The Regej functions taking no context use a context private to the calling
+// thread. A context can be used with any Regej, but only by one thread at a
+// time.
+class MatchContext {
+ public:
+  MatchContext() : clean_size_(0) {}
+
+ private:
+  // Returns a frame for the code, with the part the code expects zeroed. See
+  // internal::CodeBlock::frame_size().
+  char* GetFrame(const internal::CodeBlock* code);
+
+  // The frames are placed at the end of the buffer, so that they all start
+  // with the part kept zeroed.
+  std::vector<uint64_t> buffer_;
+  // Size of the end of the buffer known to be zeroed, except for the state
+  // initialized by the code itself.
+  size_t clean_size_;
+
+  friend class Regej;
+  friend class RegejSet;
+};
 
+// A Regej can be used by multiple threads at the same time. The code for each
+// match type is compiled by the first thread needing it, while the others wait.
+// Use CompileAll to compile it all beforehand.
 class Regej {
  public:
-  explicit Regej(const char* regexp);
-  explicit Regej(const string& regexp);
+  explicit Regej(const char* regexp, unsigned options = kNoOptions);
+  explicit Regej(const string& regexp, unsigned options = kNoOptions);
   ~Regej();
 
   // Error codes used to indicate the status of the Regej.
   Status status() const { return status_; }
+  unsigned options() const { return options_; }
 
   // See related global functions above for details about the following
   // functions.
@@ -121,20 +227,244 @@ class Regej {
   bool MatchFirst(const char* text, size_t text_size, Match* match);
   size_t MatchAll(const string& text, std::vector<struct Match>* matches);
   size_t MatchAll(const char* text, size_t text_size, std::vector<struct Match>* matches);
+  size_t MatchAll(const char* text, size_t text_size,
+                  struct Match* matches, size_t capacity);
+  size_t MatchAll(const char* text, size_t text_size,
+                  std::vector<struct CompactMatch>* matches);
   size_t MatchAllCount(const string& text);
   size_t MatchAllCount(const char* text, size_t text_size);
 
+  // Same as above, using the context provided. See MatchContext.
+  bool MatchFull(const char* text, size_t text_size, MatchContext* context);
+  bool MatchAnywhere(const char* text, size_t text_size,
+                     MatchContext* context);
+  bool MatchFirst(const char* text, size_t text_size, Match* match,
+                  MatchContext* context);
+  size_t MatchAllCount(const char* text, size_t text_size,
+                       MatchContext* context);
+
+  // Batch matching. This is equivalent to calling MatchAnywhere for each line
+  // of the text, but the text is scanned in one pass: the matches are found
+  // with a RegejLines, and the lines between them are skipped. Lines are
+  // separated by '\n', and a '\n' at the end of the text does not start a new
+  // line. 'matched' receives one flag per line. Returns the number of lines
+  // matching.
+  size_t MatchAnywhereLines(const char* text, size_t text_size,
+                            std::vector<bool>* matched);
+
+  // Same as MatchFirst and MatchAll, but also locate the groups (the
+  // sub-expressions in parenthesis) in the matches. For each match, 'groups'
+  // receives the match followed by one entry per group, in the order of their
+  // left parenthesis. Groups not part of the match have NULL begin and end.
+  // The matches are the same as without groups. Within a match, the groups are
+  // assigned as by a backtracking matcher: alternatives are preferred in order
+  // and repetitions are greedy. For example '(a|ab)(c|bcd)' matches "abcd"
+  // with groups "a" and "bcd". The groups cannot be located for very large
+  // regexps, like '(abcdefgh){1,9000}': the matches are then still returned,
+  // with all their groups unset.
+  bool MatchFirst(const string& text, std::vector<struct Match>* groups);
+  bool MatchFirst(const char* text, size_t text_size,
+                  std::vector<struct Match>* groups);
+  size_t MatchAll(const string& text,
+                  std::vector<std::vector<struct Match> >* groups);
+  size_t MatchAll(const char* text, size_t text_size,
+                  std::vector<std::vector<struct Match> >* groups);
+
+  // Same as the MatchAll and MatchAllCount functions above, but the text is
+  // split in chunks scanned concurrently by up to 'n_threads' threads. The
+  // matches found are the same as when scanning sequentially.
+  // The text can only be split if the regexp cannot match a newline (the chunks
+  // then end with a newline), or if its matches have a bounded length and it
+  // does not use '^'. Otherwise, or if the text is too small to benefit from
+  // multiple threads, the text is scanned sequentially.
+  size_t MatchAll(const char* text, size_t text_size,
+                  std::vector<struct Match>* matches, unsigned n_threads);
+  size_t MatchAllCount(const char* text, size_t text_size, unsigned n_threads);
+
   // This is equivalent to MatchFirst/MatchAll followed by Replace.
   bool ReplaceFirst(string& text, const string& with);
   size_t ReplaceAll(string& text, const string& with);
 
   bool Compile(MatchType match_type);
+  // Compile the code for all the match types in the mask 'match_types' (bit n
+  // for match type n). The regexp is only analysed once for all of them.
+  // Match types already compiled are skipped.
+  // Returns false if the code for any of them could not be compiled.
+  bool CompileAll(unsigned match_types = kRegejMatchTypes);
+
+  // Append to 'snapshot' the code compiled so far, so that another Regej for
+  // the same regexp can load it instead of compiling it again. Typically used
+  // after CompileAll.
+  // Returns false if the code cannot be saved (as when code for debugging is
+  // emitted).
+  bool Serialize(string* snapshot);
+  // Load a snapshot created by Serialize. It is rejected if it was created for
+  // another regexp or other options, by another version of rejit, or for a cpu
+  // with different features. Match types already compiled are kept.
+  // Returns false if the snapshot is rejected.
+  bool Deserialize(const string& snapshot);
+  bool Deserialize(const char* snapshot, size_t snapshot_size);
 
  private:
+  bool IsCompiled(MatchType match_type) const;
+  // Compile the code for the match type if it is not available yet.
+  bool EnsureCompiled(MatchType match_type);
+  // The following functions must be called with the compilation lock held.
+  bool GenerateCode(MatchType match_type);
+  internal::CodeBlock* GetCode(MatchType match_type) const;
+  void SetCode(MatchType match_type, internal::CodeBlock* code);
+  // Make the match types compiled visible to other threads.
+  void PublishCompiled();
+  internal::SubmatchResolver* GetSubmatchResolver();
+
   char const * const regexp_;
+  const unsigned options_;
   // This refers to internal compilation information.
   internal::RegexpInfo* rinfo_;
   Status status_;
+
+  friend class RegejLines;
+  friend class RegejStream;
+};
+
+
+// A match of a regexp from a RegejSet.
+struct SetMatch {
+  // Index of the regexp in the set.
+  size_t index;
+  Match match;
+};
+
+// Matches a set of regexps against a text in a single pass.
+// The regexps are compiled together into one state ring, where each regexp uses
+// a disjoint range of states, with a single fast-forward stage common to all
+// regexps.
+class RegejSet {
+ public:
+  explicit RegejSet(const vector<string>& regexps);
+  ~RegejSet();
+
+  // Upon error, rejit_status_string holds the parser error for the first
+  // invalid regexp, including its text.
+  Status status() const { return status_; }
+  size_t size() const { return regexps_.size(); }
+
+  // Fill the vector with the indexes, in increasing order, of the regexps that
+  // match somewhere in the text.
+  // Returns true if at least one regexp matches.
+  bool Match(const string& text, std::vector<size_t>* matched);
+  bool Match(const char* text, size_t text_size, std::vector<size_t>* matched);
+  // Fill the vector with all left-most longest matches of each regexp of the
+  // set, ordered by regexp index. Only the regexps found to match by the single
+  // pass above are scanned again to locate their matches.
+  // Returns the size of the vector for convenience.
+  size_t MatchAll(const string& text, std::vector<struct SetMatch>* matches);
+  size_t MatchAll(const char* text, size_t text_size,
+                  std::vector<struct SetMatch>* matches);
+
+  bool Compile();
+
+ private:
+  vector<string> regexps_;
+  // Used to locate the matches of the individual regexps. They are only
+  // compiled when needed.
+  vector<Regej*> regejs_;
+  internal::RegexpInfo* rinfo_;
+  Status status_;
+  // Flags set by the generated code for the regexps that match.
+  vector<char> matched_;
+};
+
+
+// A match in a stream. The limits are offsets from the start of the stream,
+// with the same conventions as for the Match structure.
+struct StreamMatch {
+  size_t begin;
+  size_t end;
+};
+
+// Finds all left-most longest matches of a regexp in a text provided in
+// successive chunks, for example read from a pipe or from a file too big to be
+// loaded in memory. Matches spanning chunk boundaries are reported.
+// A match is only reported once the text that follows cannot modify it. So the
+// text that can still be part of a match is kept by the stream. This is bounded
+// by:
+//  - the line length, if the regexp cannot match a newline character.
+//  - the maximum length of a match, if the regexp does not use '^'.
+// Otherwise the whole text is kept, and the matches are only reported when
+// the end of the stream is reached.
+class RegejStream {
+ public:
+  // The Regej must outlive the stream.
+  explicit RegejStream(Regej* re);
+
+  // Scan the next chunk of the stream, and append the matches that are known
+  // at this point to the vector.
+  // Returns the number of matches appended.
+  size_t Feed(const char* chunk, size_t chunk_size,
+              std::vector<struct StreamMatch>* matches);
+  // Signal the end of the stream, and append the remaining matches to the
+  // vector. The stream is then reset.
+  // Returns the number of matches appended.
+  size_t Finish(std::vector<struct StreamMatch>* matches);
+  // Discard the current stream, and prepare to scan a new one.
+  void Reset();
+
+  // Number of characters of the stream currently kept.
+  size_t buffered_size() const { return pending_.size(); }
+
+ private:
+  // Append the matches found in the pending text, that start before 'limit'.
+  // 'limit' is an offset from the start of the stream.
+  size_t ReportMatches(size_t limit, std::vector<struct StreamMatch>* matches);
+
+  Regej* re_;
+  unsigned max_match_length_;
+  // Matches never include a newline character.
+  bool split_on_newlines_;
+  // The text does not need to be kept from the start of a line.
+  bool split_anywhere_;
+
+  // The text not scanned yet, or that may still be part of a match.
+  string pending_;
+  // Offset from the start of the stream of the pending text.
+  size_t pending_offset_;
+  // Offset of the end of the last match reported.
+  size_t last_match_end_;
+  bool matched_;
+  std::vector<struct Match> chunk_matches_;
+};
+
+
+// Iterates over the lines of a text in which a regexp matches, as defined for
+// Regej::MatchAnywhereLines. If the regexp cannot match a newline, the text is
+// scanned with MatchFirst, so the lines without a match are skipped by the
+// fast-forward mechanisms and cost nothing more. Line numbers are only computed
+// when requested, by counting the newlines skipped since the last request.
+// An iterator must only be used by one thread at a time.
+class RegejLines {
+ public:
+  // The Regej and the text must outlive the iterator.
+  RegejLines(Regej* re, const char* text, size_t text_size);
+
+  // Move to the next line matching, and set 'line' to its limits.
+  // Returns false when there are no more lines matching.
+  bool Next(Match* line);
+  // Number (starting at 0) of the last line returned by Next.
+  size_t line_number();
+
+ private:
+  Regej* re_;
+  const char* text_end_;
+  // Start of the text left to scan.
+  const char* position_;
+  // Start of the last line returned.
+  const char* line_;
+  // Matches never include a newline character.
+  bool split_on_newlines_;
+  // Number of newlines before 'counted_'.
+  size_t n_newlines_;
+  const char* counted_;
 };
 
 }  // namespace rejit
@@ -236,7 +236,15 @@ static struct argp argp = {options, parse_opt, args_doc, doc};
 
 // Declared global to be easily accessed via ftw's callback.
 rejit::Regej *re;
-rejit::Regej re_sol("^");
+
+
+void print_text(const char* text, size_t size) {
+#ifdef REJIT_TARGET_PLATFORM_MACOS
+  printf("%.*s", (int)size, text);
+#else
+  cout.write(text, size);
+#endif
+}
 
 
 void print_head(const char* filename, unsigned line, char separator=':') {
@@ -248,7 +256,6 @@ void print_head(const char* filename, unsigned line, char separator=':') {
 #endif
   }
   if (arguments.print_line_number) {
-    // Index starts at 0, but line numbering at 1.
 #ifdef REJIT_TARGET_PLATFORM_MACOS
     printf("%d%c", line, separator);
 #else
@@ -258,6 +265,42 @@ void print_head(const char* filename, unsigned line, char separator=':') {
 }
 
 
+// Print the line starting at 'sol', and return the start of the next line.
+const char* print_line(const char* filename, unsigned line_number,
+                       const char* sol, const char* text_end) {
+  rejit::Match empty = {sol, sol};
+  rejit::Match line = rejit::EnclosingLines(sol, text_end - sol, empty);
+  print_head(filename, line_number, '-');
+  print_text(line.begin, line.end - line.begin);
+  print_text("\n", 1);
+  return line.end + 1;
+}
+
+
+// Line numbers are computed by counting the newlines from the last position
+// numbered, so that the files are only scanned for newlines when line numbers
+// are printed.
+struct LineCounter {
+  // Number of newlines before 'counted'.
+  const char* counted;
+  unsigned n_newlines;
+
+  // Returns the number (starting at 1) of the line containing 'position'.
+  unsigned line_number(const char* position) {
+    if (!arguments.print_line_number) {
+      return 0;
+    }
+    if (position >= counted) {
+      n_newlines += rejit::CountNewlines(counted, position - counted);
+    } else {
+      n_newlines -= rejit::CountNewlines(position, counted - position);
+    }
+    counted = position;
+    return n_newlines + 1;
+  }
+};
+
+
 int process_file(const char* filename) {
   int rc = 0;
 
@@ -288,113 +331,75 @@ int process_file(const char* filename) {
   re->MatchAll(file_content, file_size, &matches);
 
   if (matches.size()) {
-    // TODO: When not printing line numbers it may be faster to look for sos and
-    // eos only for each match.
-    vector<rejit::Match> new_lines;
-    re_sol.MatchAll(file_content, file_size, &new_lines);
-    // Append a match for the end of the file to be able to correctly print the
-    // last line.
-    new_lines.push_back({file_content + file_size, file_content + file_size});
-
-    vector<rejit::Match>::iterator it_lines = new_lines.begin();
+    const char* text_end = file_content + file_size;
+    LineCounter counter = {file_content, 0};
+
     vector<rejit::Match>::iterator it_matches = matches.begin();
     output_mutex.lock();
-    while (it_lines < new_lines.end() && it_matches < matches.end()) {
-      // Accesses at the limits of the vectors look a bit dangerous but should
-      // be guaranteed because the matches are strictly included between the
-      // first and last elements of new_lines (respectively start of the first
-      // line and end of the last line).
-
-      // Find the sol before the next match.
-      while(it_lines->begin <= it_matches->begin &&
-            it_lines < new_lines.end()) {
-        ++it_lines;
+    while (it_matches < matches.end()) {
+      // The lines spanned by the match. A '\n' ending the file does not start a
+      // new line.
+      if (it_matches->begin == text_end && text_end[-1] == '\n') {
+        break;
       }
-      --it_lines;
+      rejit::Match lines =
+        rejit::EnclosingLines(file_content, file_size, *it_matches);
+      unsigned line_number = counter.line_number(lines.begin);
 
       if (arguments.context_before) {
         // Print the 'context_before'.
-#ifdef REJIT_TARGET_PLATFORM_MACOS
-        printf("--\n");
-#else
-        cout << "--\n";
-#endif
-        vector<rejit::Match>::iterator it;
-        for(it = max(it_lines - arguments.context_before, new_lines.begin());
-            it < it_lines;
-            it++) {
-          print_head(filename, (int)(1 + (it - new_lines.begin())), '-');
-#ifdef REJIT_TARGET_PLATFORM_MACOS
-          printf("%.*s", (int)((it + 1)->begin - it->begin), it->begin);
-#else
-          cout.write(it->begin, (int)((it + 1)->begin - it->begin));
-#endif
+        print_text("--\n", 3);
+        const char* sol = lines.begin;
+        unsigned n_before = 0;
+        while (n_before < arguments.context_before && sol > file_content) {
+          rejit::Match previous = {sol - 1, sol - 1};
+          sol = rejit::EnclosingLines(file_content, file_size, previous).begin;
+          n_before++;
+        }
+        for (; n_before > 0; n_before--) {
+          sol = print_line(filename, line_number - n_before, sol, text_end);
         }
       }
 
       // Print the filename and line number.
-      print_head(filename, (int)(1 + (it_lines - new_lines.begin())));
+      print_head(filename, line_number);
 #define START_RED "\x1B[31m"
 #define END_COLOR "\x1B[0m"
-      // Now print all matches starting on this line.
-      const char *start = it_lines->begin;
-      if (start == new_lines.back().begin) {
-        ++it_matches;
-        continue;
-      }
-      while (it_matches < matches.end() &&
-             it_matches->begin < (it_lines + 1)->begin) {
-#ifdef REJIT_TARGET_PLATFORM_MACOS
-        printf(arguments.color_output ? "%.*s" START_RED "%.*s" END_COLOR : "%.*s%.*s" ,
-               (int)(it_matches->begin - start), start,
-               (int)(it_matches->end - it_matches->begin), it_matches->begin);
-#else
-        cout.write(start, (int)(it_matches->begin - start));
-        cout.write(it_matches->begin, (int)(it_matches->end - it_matches->begin));
-#endif
+      // Now print all matches starting on these lines. They may extend the
+      // lines to print.
+      const char *start = lines.begin;
+      while (it_matches < matches.end() && it_matches->begin <= lines.end) {
+        lines.end = max(lines.end, rejit::EnclosingLines(file_content, file_size,
+                                                         *it_matches).end);
+        print_text(start, it_matches->begin - start);
+        if (arguments.color_output) {
+          print_text(START_RED, sizeof(START_RED) - 1);
+        }
+        print_text(it_matches->begin, it_matches->end - it_matches->begin);
+        if (arguments.color_output) {
+          print_text(END_COLOR, sizeof(END_COLOR) - 1);
+        }
         start = it_matches->end;
         ++it_matches;
       }
-      // And print the rest of the line for the last match.
-      vector<rejit::Match>::iterator it_end_lines = it_lines;
-      while (it_end_lines->begin < (it_matches - 1)->end) {
-        ++it_end_lines;
+      // And print the rest of the line for the last match, unless the match
+      // included the newline.
+      if (start <= lines.end) {
+        print_text(start, lines.end - start);
+        print_text("\n", 1);
       }
-#ifdef REJIT_TARGET_PLATFORM_MACOS
-      printf("%.*s",
-             (int)((it_end_lines)->end - (it_matches - 1)->end),
-             (it_matches - 1)->end);
-#else
-      cout.write((it_matches - 1)->end, (int)((it_end_lines)->end - (it_matches - 1)->end));
-#endif
 
       if (arguments.context_after) {
         // Print the 'context_after'.
-        vector<rejit::Match>::iterator it;
-        for(it = it_end_lines;
-            it < min(it_end_lines + arguments.context_after, new_lines.end() - 1);
-            it++) {
-          print_head(filename, (int)(1 + (it - new_lines.begin())), '-');
-#ifdef REJIT_TARGET_PLATFORM_MACOS
-          printf("%.*s", (int)((it + 1)->begin - it->begin), it->begin);
-#else
-          cout.write(it->begin, (int)((it + 1)->begin - it->begin));
-#endif
+        const char* sol = lines.end + 1;
+        unsigned after_number = counter.line_number(lines.end) + 1;
+        for (unsigned i = 0; i < arguments.context_after && sol < text_end; i++) {
+          sol = print_line(filename, after_number + i, sol, text_end);
         }
-#ifdef REJIT_TARGET_PLATFORM_MACOS
-        if (it == new_lines.end() - 1) {
-          printf("\n");
-        }
-        printf("--\n");
-#else
-        if (it == new_lines.end() - 1) {
-          cout << "\n";
-        }
-        cout << "--\n";
-#endif
+        print_text("--\n", 3);
       }
     }
-  output_mutex.unlock();
+    output_mutex.unlock();
   }
 
   munmap(file_content, file_size);
@@ -508,7 +513,6 @@ int main(int argc, char *argv[]) {
   rejit::Regej re_(arguments.regexp);
   re_.Compile(rejit::kMatchAll);
   re = &re_;
-  re_sol.Compile(rejit::kMatchAll);
 
   if (arguments.jobs > 0) {
     // Initialize structures for multithreaded processing.
@@ -83,7 +83,7 @@ AssemblerBase::AssemblerBase(size_t min_buffer_size, size_t max_buffer_size,
                              unsigned max_instr_size,
                              void* buffer, int buffer_size) :
     min_buffer_size_(min_buffer_size), max_buffer_size_(max_buffer_size),
-    max_instr_size_(max_instr_size)
+    max_instr_size_(max_instr_size), relocatable_(true)
 {
   if (buffer == NULL) {
     // Do our own buffer management.
@@ -117,25 +117,15 @@ AssemblerBase::~AssemblerBase() {
 }
 
 
-// TODO(ajr): Clean and check memory type (writable?).
-VirtualMemory* AssemblerBase::GetCode() {
-  VirtualMemory* vmem = new VirtualMemory(pc_offset());
-  if (!vmem->IsReserved()) {
-    FATAL("VirtualMemory has not been reserved.");
-    delete vmem;
-    return NULL;
+// The code is copied to the shared code arena. It is freed when the returned
+// block is deleted.
+CodeBlock* AssemblerBase::GetCode() {
+  CodeBlock* code = CodeArena::Instance()->Allocate(buffer_, pc_offset());
+  if (code == NULL) {
+    FATAL("Could not allocate executable memory.");
   }
-  if (!vmem->Commit(vmem->address(), pc_offset(), true/*executable*/)) {
-    FATAL("VirtualMemory has not been committed.");
-    delete vmem;
-    return NULL;
-  }
-
-  memcpy(vmem->address(), buffer_, pc_offset());
-
-  // TODO(rames): Clean up how the code is returned. Returning virtual memory
-  // is not very intuitive!
-  return vmem;
+  code->set_relocation_info(external_references_, relocatable_);
+  return code;
 }
 
 
@@ -178,7 +178,7 @@ class AssemblerBase {
   ~AssemblerBase();
 
   // Code buffer management --------------------------------
-  VirtualMemory* GetCode();
+  CodeBlock* GetCode();
 
   void GrowBuffer(bool force = false);
 
@@ -208,6 +208,16 @@ class AssemblerBase {
   void UseRelocatedData(RelocatedData *data);
   void UseRelocatedValue(RelocatedValue reloc);
 
+  // Absolute addresses ------------------------------------
+  // The generated code is position independent, except for the addresses of
+  // the C++ functions it calls. They are recorded so that the code can be fixed
+  // up when loaded from a snapshot.
+  void RecordExternalReference(int offset) {
+    external_references_.push_back(offset);
+  }
+  // Called when emitting other absolute addresses.
+  void set_not_relocatable() { relocatable_ = false; }
+
 
  protected:
   // Architecture specific values.
@@ -232,6 +242,9 @@ class AssemblerBase {
   map<RelocatedData*, int> reloc_data_location_;
   // The relocated values and the locations (offsets) at which they are used.
   map<RelocatedValue, int> reloc_values_usage_location_;
+
+  vector<int> external_references_;
+  bool relocatable_;
 };
 
 } }  // namespace rejit::internal
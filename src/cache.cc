@@ -0,0 +1,130 @@
+// Copyright (C) 2013 Alexandre Rames <alexandre@coreperf.com>
+// rejit is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "cache.h"
+
+namespace rejit {
+namespace internal {
+
+// Regej does not copy the regexp string it is constructed with, so keep the
+// string alive alongside it.
+struct CachedRegej {
+  explicit CachedRegej(const string& regexp_string)
+    : regexp(regexp_string), re(regexp) {}
+
+  const string regexp;
+  Regej re;
+};
+
+
+bool RegejCache::Key::operator<(const Key& other) const {
+  if (match_type != other.match_type) {
+    return match_type < other.match_type;
+  }
+  if (syntax != other.syntax) {
+    return syntax < other.syntax;
+  }
+  return regexp < other.regexp;
+}
+
+
+RegejCache::RegejCache(size_t capacity)
+  : capacity_(capacity), hits_(0), misses_(0), evictions_(0) {}
+
+
+shared_ptr<Regej> RegejCache::Get(const char* regexp, Syntax syntax,
+                                  MatchType match_type) {
+  // The Regej class only parses ERE for now.
+  ASSERT(syntax == ERE);
+  Key key(regexp, syntax, match_type);
+
+  {
+    lock_guard<mutex> lock(mutex_);
+    map<Key, EntryList::iterator>::iterator it = index_.find(key);
+    if (it != index_.end()) {
+      ++hits_;
+      entries_.splice(entries_.begin(), entries_, it->second);
+      return it->second->second;
+    }
+    ++misses_;
+  }
+
+  shared_ptr<CachedRegej> cached = make_shared<CachedRegej>(key.regexp);
+  shared_ptr<Regej> re(cached, &cached->re);
+  if (!re->Compile(match_type)) {
+    return re;
+  }
+
+  lock_guard<mutex> lock(mutex_);
+  if (capacity_ == 0) {
+    return re;
+  }
+  map<Key, EntryList::iterator>::iterator it = index_.find(key);
+  if (it != index_.end()) {
+    // Another thread compiled the same regexp in the meantime. Keep the entry
+    // already cached.
+    entries_.splice(entries_.begin(), entries_, it->second);
+    return it->second->second;
+  }
+  entries_.push_front(Entry(key, re));
+  index_.insert(make_pair(key, entries_.begin()));
+  EvictExtraEntries();
+  return re;
+}
+
+
+CacheStats RegejCache::stats() {
+  lock_guard<mutex> lock(mutex_);
+  CacheStats stats;
+  stats.hits = hits_;
+  stats.misses = misses_;
+  stats.evictions = evictions_;
+  stats.size = entries_.size();
+  stats.capacity = capacity_;
+  return stats;
+}
+
+
+void RegejCache::set_capacity(size_t capacity) {
+  lock_guard<mutex> lock(mutex_);
+  capacity_ = capacity;
+  EvictExtraEntries();
+}
+
+
+void RegejCache::Clear() {
+  lock_guard<mutex> lock(mutex_);
+  index_.clear();
+  entries_.clear();
+  hits_ = 0;
+  misses_ = 0;
+  evictions_ = 0;
+}
+
+
+void RegejCache::EvictExtraEntries() {
+  while (entries_.size() > capacity_) {
+    index_.erase(entries_.back().first);
+    entries_.pop_back();
+    ++evictions_;
+  }
+}
+
+
+RegejCache* RegejCache::Instance() {
+  static RegejCache cache(kDefaultRegejCacheCapacity);
+  return &cache;
+}
+
+} }  // namespace rejit::internal
@@ -0,0 +1,92 @@
+// Copyright (C) 2013 Alexandre Rames <alexandre@coreperf.com>
+// rejit is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef REJIT_CACHE_H_
+#define REJIT_CACHE_H_
+
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "globals.h"
+#include "parser.h"
+
+namespace rejit {
+namespace internal {
+
+// Number of compiled regexps kept by default in the cache used by the high
+// level helpers.
+const size_t kDefaultRegejCacheCapacity = 64;
+
+// A bounded cache of compiled regular expressions, shared by all threads.
+// Entries are keyed by the regexp string, its syntax, and the match type they
+// were compiled for. When the cache is full the least recently used entry is
+// evicted.
+// Compilation happens outside of the lock, so a slow compilation does not block
+// other threads looking up the cache. Cached regexps are handed out as shared
+// pointers: an entry evicted while another thread is still matching with it
+// stays alive until that thread is done.
+class RegejCache {
+ public:
+  explicit RegejCache(size_t capacity);
+
+  // Returns a Regej compiled for the given match type. This never returns
+  // NULL. If the regexp is invalid the returned object has an error status and
+  // is not cached.
+  shared_ptr<Regej> Get(const char* regexp, Syntax syntax,
+                        MatchType match_type);
+
+  CacheStats stats();
+  // Reducing the capacity evicts the least recently used entries as necessary.
+  // A capacity of 0 disables caching.
+  void set_capacity(size_t capacity);
+  // Drops all entries and resets the statistics.
+  void Clear();
+
+  // The process-wide cache used by the high level helpers.
+  static RegejCache* Instance();
+
+ private:
+  struct Key {
+    Key(const char* regexp, Syntax syntax, MatchType match_type)
+      : regexp(regexp), syntax(syntax), match_type(match_type) {}
+    bool operator<(const Key& other) const;
+
+    string regexp;
+    Syntax syntax;
+    MatchType match_type;
+  };
+  typedef pair<Key, shared_ptr<Regej> > Entry;
+  // Most recently used entries first.
+  typedef list<Entry> EntryList;
+
+  // Must be called with the lock held.
+  void EvictExtraEntries();
+
+  mutex mutex_;
+  size_t capacity_;
+  EntryList entries_;
+  map<Key, EntryList::iterator> index_;
+  size_t hits_;
+  size_t misses_;
+  size_t evictions_;
+
+  DISALLOW_COPY_AND_ASSIGN(RegejCache);
+};
+
+} }  // namespace rejit::internal
+
+#endif  // REJIT_CACHE_H_
@@ -0,0 +1,172 @@
+// Copyright (C) 2013 Alexandre Rames <alexandre@coreperf.com>
+// rejit is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "code-arena.h"
+
+#include <string.h>
+
+#include "utils.h"
+
+namespace rejit {
+namespace internal {
+
+CodeBlock::~CodeBlock() {
+  arena_->Free(this);
+}
+
+
+CodeArena::~CodeArena() {
+  for (Chunk* chunk : chunks_) {
+    delete chunk;
+  }
+}
+
+
+intptr_t CodeArena::AllocateIn(Chunk* chunk, size_t size) {
+  map<size_t, size_t>::iterator it;
+  for (it = chunk->free_blocks.begin(); it != chunk->free_blocks.end(); ++it) {
+    if (it->second >= size) {
+      size_t offset = it->first;
+      size_t remaining = it->second - size;
+      chunk->free_blocks.erase(it);
+      if (remaining) {
+        chunk->free_blocks[offset + size] = remaining;
+      }
+      return offset;
+    }
+  }
+  if (chunk->top + size <= chunk->memory.size()) {
+    size_t offset = chunk->top;
+    chunk->top += size;
+    return offset;
+  }
+  return -1;
+}
+
+
+CodeBlock* CodeArena::Allocate(const void* code, size_t code_size) {
+  size_t size = RoundUp(code_size, kCodeAlignment);
+  lock_guard<mutex> lock(mutex_);
+
+  Chunk* chunk = NULL;
+  intptr_t offset = -1;
+  if (size <= kCodeArenaChunkSize / 2) {
+    for (Chunk* c : chunks_) {
+      offset = AllocateIn(c, size);
+      if (offset >= 0) {
+        chunk = c;
+        break;
+      }
+    }
+  }
+  if (chunk == NULL) {
+    chunk = new Chunk(max(size, kCodeArenaChunkSize));
+    if (!chunk->memory.IsReserved()) {
+      delete chunk;
+      return NULL;
+    }
+    chunks_.push_back(chunk);
+    committed_ += chunk->memory.size();
+    offset = AllocateIn(chunk, size);
+    ASSERT(offset == 0);
+  }
+
+  chunk->used += size;
+  used_ += size;
+  char* writable = reinterpret_cast<char*>(chunk->memory.writable_address());
+  char* executable = reinterpret_cast<char*>(chunk->memory.address());
+  memcpy(writable + offset, code, code_size);
+  return new CodeBlock(this, executable + offset, size);
+}
+
+
+void CodeArena::Free(CodeBlock* block) {
+  lock_guard<mutex> lock(mutex_);
+  char* address = reinterpret_cast<char*>(block->address());
+  size_t index;
+  for (index = 0; index < chunks_.size(); index++) {
+    char* base = reinterpret_cast<char*>(chunks_[index]->memory.address());
+    if (base <= address && address < base + chunks_[index]->memory.size()) {
+      break;
+    }
+  }
+  ASSERT(index < chunks_.size());
+  Chunk* chunk = chunks_[index];
+  chunk->used -= block->size();
+  used_ -= block->size();
+  if (chunk->used == 0) {
+    // Keep one regular region around to avoid mapping and unmapping memory
+    // when a single regexp is repeatedly compiled and destroyed.
+    if (chunks_.size() > 1 || chunk->memory.size() > kCodeArenaChunkSize) {
+      ReleaseChunk(index);
+    } else {
+      chunk->top = 0;
+      chunk->free_blocks.clear();
+    }
+    return;
+  }
+
+  size_t offset = address - reinterpret_cast<char*>(chunk->memory.address());
+  size_t size = block->size();
+  map<size_t, size_t>& free_blocks = chunk->free_blocks;
+  // Coalesce with the following free block.
+  map<size_t, size_t>::iterator next = free_blocks.find(offset + size);
+  if (next != free_blocks.end()) {
+    size += next->second;
+    free_blocks.erase(next);
+  }
+  // Coalesce with the preceding free block.
+  map<size_t, size_t>::iterator prev = free_blocks.lower_bound(offset);
+  if (prev != free_blocks.begin()) {
+    --prev;
+    if (prev->first + prev->second == offset) {
+      offset = prev->first;
+      size += prev->second;
+      free_blocks.erase(prev);
+    }
+  }
+  if (offset + size == chunk->top) {
+    chunk->top = offset;
+  } else {
+    free_blocks[offset] = size;
+  }
+}
+
+
+void CodeArena::ReleaseChunk(size_t index) {
+  Chunk* chunk = chunks_[index];
+  committed_ -= chunk->memory.size();
+  chunks_.erase(chunks_.begin() + index);
+  delete chunk;
+}
+
+
+CodeArenaStats CodeArena::stats() {
+  lock_guard<mutex> lock(mutex_);
+  CodeArenaStats stats;
+  stats.committed = committed_;
+  stats.used = used_;
+  stats.regions = chunks_.size();
+  return stats;
+}
+
+
+CodeArena* CodeArena::Instance() {
+  // Never destroyed, so that regexps destroyed at exit can still free their
+  // code.
+  static CodeArena* arena = new CodeArena();
+  return arena;
+}
+
+} }  // namespace rejit::internal
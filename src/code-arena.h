@@ -0,0 +1,137 @@
+// Copyright (C) 2013 Alexandre Rames <alexandre@coreperf.com>
+// rejit is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef REJIT_CODE_ARENA_H_
+#define REJIT_CODE_ARENA_H_
+
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "globals.h"
+#include "platform.h"
+
+namespace rejit {
+namespace internal {
+
+// Size of the executable regions code is allocated from. Functions bigger than
+// half a region get a region of their own.
+const size_t kCodeArenaChunkSize = 256 * KB;
+// Generated code refers to the data emitted after it with alignments relative
+// to the start of the code, so functions must start at the maximum alignment.
+const size_t kCodeAlignment = 64;
+
+class CodeArena;
+
+// Executable code allocated in the code arena. The code is freed when the
+// block is deleted.
+class CodeBlock {
+ public:
+  ~CodeBlock();
+
+  void* address() const { return address_; }
+  size_t size() const { return size_; }
+
+  // Offsets in the code of the 64-bit addresses of the C++ functions it calls.
+  const vector<int>& external_references() const {
+    return external_references_;
+  }
+  // False if the code embeds other absolute addresses. It can then not be
+  // used by another process.
+  bool relocatable() const { return relocatable_; }
+  void set_relocation_info(const vector<int>& external_references,
+                           bool relocatable) {
+    external_references_ = external_references;
+    relocatable_ = relocatable;
+  }
+  // Size of the frame the code must be given when called, and size of the
+  // upper part of the frame that must be zeroed. The code leaves that part
+  // zeroed when it returns. See Codegen::Generate.
+  size_t frame_size() const { return frame_size_; }
+  size_t frame_clean_size() const { return frame_clean_size_; }
+  void set_frame_size(size_t frame_size, size_t frame_clean_size) {
+    frame_size_ = frame_size;
+    frame_clean_size_ = frame_clean_size;
+  }
+
+ private:
+  CodeBlock(CodeArena* arena, void* address, size_t size)
+    : arena_(arena), address_(address), size_(size), relocatable_(true),
+      frame_size_(0), frame_clean_size_(0) {}
+
+  CodeArena* arena_;
+  void* address_;
+  size_t size_;
+  vector<int> external_references_;
+  bool relocatable_;
+  size_t frame_size_;
+  size_t frame_clean_size_;
+
+  friend class CodeArena;
+  DISALLOW_COPY_AND_ASSIGN(CodeBlock);
+};
+
+
+// Executable memory shared by all the compiled regexps.
+// Functions are allocated in large regions instead of each being given its own
+// pages. Regions are mapped with separate writable and executable views when
+// the platform allows it (see CodeMemory), so code is never written through an
+// executable mapping.
+// Each region allocates by bumping its top, and reuses freed space with a
+// first-fit free list. Adjacent free blocks are coalesced, a free block at the
+// top of a region lowers the top, and regions left empty are released.
+// Code is never moved, since the functions handed out may be running.
+class CodeArena {
+ public:
+  CodeArena() : committed_(0), used_(0) {}
+  ~CodeArena();
+
+  // Copies the code to executable memory. Returns NULL if no memory could be
+  // allocated.
+  CodeBlock* Allocate(const void* code, size_t size);
+
+  CodeArenaStats stats();
+
+  // The process-wide arena used for generated code.
+  static CodeArena* Instance();
+
+ private:
+  struct Chunk {
+    explicit Chunk(size_t size) : memory(size), top(0), used(0) {}
+
+    CodeMemory memory;
+    // Allocations happen below `top`, or in the free blocks.
+    size_t top;
+    size_t used;
+    // Free blocks below `top`, indexed by offset.
+    map<size_t, size_t> free_blocks;
+  };
+
+  // Returns the offset of the allocation, or -1 if the chunk is too full.
+  static intptr_t AllocateIn(Chunk* chunk, size_t size);
+  void Free(CodeBlock* block);
+  void ReleaseChunk(size_t index);
+
+  mutex mutex_;
+  vector<Chunk*> chunks_;
+  size_t committed_;
+  size_t used_;
+
+  friend class CodeBlock;
+  DISALLOW_COPY_AND_ASSIGN(CodeArena);
+};
+
+} }  // namespace rejit::internal
+
+#endif  // REJIT_CODE_ARENA_H_
@@ -33,7 +33,13 @@ static void print_match(Match m) {
 }
 
 
-static void MatchAllAppend(vector<Match>* matches, Match new_match, bool filter) {
+static void print_match(CompactMatch match) {
+  printf("[%u, %u)", match.begin, match.end);
+}
+
+
+template <class M>
+static void MatchAllAppend(vector<M>* matches, M new_match, bool filter) {
   // The matches in the vector must be disjoint and in increasing order.
   // This also assumes that no matches finishing after the new match have been
   // registered already.
@@ -45,7 +51,7 @@ static void MatchAllAppend(vector<Match>* matches, Match new_match, bool filter)
   }
 
   if (filter && matches->size()) {
-    vector<Match>::iterator it;
+    typename vector<M>::iterator it;
     for (it = matches->end() - 1;
          it >= matches->begin() && (*it).begin >= new_match.begin;
          --it) {}
@@ -86,6 +92,45 @@ void MatchAllAppendFilter(vector<Match>* matches, Match new_match) {
 }
 
 
+static CompactMatch ToCompactMatch(const char* text, Match match) {
+  CompactMatch compact = {static_cast<uint32_t>(match.begin - text),
+                          static_cast<uint32_t>(match.end - text)};
+  return compact;
+}
+
+
+void MatchAllFlush(MatchBuffer* buffer) {
+  if (!buffer->flushable() || buffer->cursor == buffer->base) {
+    return;
+  }
+  if (buffer->compact_matches != NULL) {
+    vector<CompactMatch>* matches = buffer->compact_matches;
+    MatchAllAppend(matches, ToCompactMatch(buffer->text, *buffer->base), true);
+    for (Match* match = buffer->base + 1; match < buffer->cursor; ++match) {
+      if (FLAG_trace_match_all) {
+        MatchAllAppend(matches, ToCompactMatch(buffer->text, *match), false);
+      } else {
+        matches->push_back(ToCompactMatch(buffer->text, *match));
+      }
+    }
+    buffer->cursor = buffer->base;
+    return;
+  }
+  // The generated code has already filtered the buffered matches against each
+  // other. Only the first one can render previously flushed matches invalid.
+  MatchAllAppendFilter(buffer->matches, *buffer->base);
+  if (FLAG_trace_match_all) {
+    for (Match* match = buffer->base + 1; match < buffer->cursor; ++match) {
+      MatchAllAppendRaw(buffer->matches, *match);
+    }
+  } else {
+    buffer->matches->insert(buffer->matches->end(),
+                            buffer->base + 1, buffer->cursor);
+  }
+  buffer->cursor = buffer->base;
+}
+
+
 // RegexpIndexer ---------------------------------------------------------------
 
 void RegexpIndexer::Index(Regexp* root) {
@@ -95,6 +140,22 @@ void RegexpIndexer::Index(Regexp* root) {
 }
 
 
+void RegexpIndexer::IndexSet(Alternation* set) {
+  vector<int>* exit_states = rinfo_->set_exit_states();
+  exit_states->clear();
+  vector<Regexp*>::iterator it;
+  for (it = set->sub_regexps()->begin(); it < set->sub_regexps()->end(); it++) {
+    entry_state_ = 0;
+    IndexSub(*it);
+    exit_states->push_back((*it)->exit_state());
+  }
+  set->SetEntryState(0);
+  rinfo_->set_entry_state(0);
+  // There is no single exit state. See Codegen::CheckSetMatches.
+  rinfo_->set_exit_state(-1);
+}
+
+
 void RegexpIndexer::IndexSub(Regexp* root, int entry, int exit) {
   Visit(root);
   root->SetEntryState(entry);
@@ -192,6 +253,11 @@ void RegexpLister::VisitRepetition(Repetition* repetition) {
     return;
   }
 
+  if (FLAG_use_rep_counters && CanCountRepetition(repetition)) {
+    ListCountedRepetition(repetition);
+    return;
+  }
+
   vector<Regexp*>* tracing = NULL;
   if (FLAG_trace_repetitions) {
     tracing = new vector<Regexp*>;
@@ -324,6 +390,84 @@ void RegexpLister::VisitRepetition(Repetition* repetition) {
 }
 
 
+bool RegexpLister::CanCountRepetition(Repetition* repetition) const {
+  Regexp* base = repetition->sub_regexp();
+  if (!repetition->IsLimited() ||
+      !(base->IsPeriod() || base->IsBracket() ||
+        (base->IsMultipleChar() &&
+         base->AsMultipleChar()->chars_length() == 1))) {
+    return false;
+  }
+  unsigned n_optional =
+    repetition->max_rep() - max(1u, repetition->min_rep());
+  return n_optional >= kMinCountedRepetitions &&
+    n_counted_queue_entries_ + CountedQueueCapacity(n_optional) <=
+      kMaxCountedQueueEntries;
+}
+
+
+void RegexpLister::ListCountedRepetition(Repetition* repetition) {
+  // For x{m,n} with m >= 1 we aim to produce:
+  //                                 ________eps________
+  // epsilons                       |                   |
+  //                                |                   v
+  // inside:    O--x-->O ... O--x-->O--x{1,n-m}-------->O
+  //            |____ m times x ____|    (counted)
+  //
+  // x{0,n} is handled as x{1,n} with an extra epsilon bypassing it.
+  //
+  // The base regexp may have been selected for fast-forwarding, so it must be
+  // the first of the mandatory repetitions.
+  Regexp* base = repetition->sub_regexp();
+  unsigned min_rep = repetition->min_rep();
+  unsigned n_mandatory = max(1u, min_rep);
+  unsigned n_optional = repetition->max_rep() - n_mandatory;
+
+  Regexp* inside = base;
+  if (n_mandatory > 1) {
+    Concatenation *concat = new Concatenation();
+    concat->Append(base);
+    for (unsigned i = 1; i < n_mandatory; i++) {
+      Regexp *repeated = base->DeepCopy();
+      rinfo()->extra_allocated()->push_back(repeated);
+      concat->Append(repeated);
+    }
+    inside = concat;
+  }
+  RegexpIndexer indexer(rinfo(),
+                        repetition->entry_state(),
+                        rinfo()->last_state());
+  indexer.IndexSub(inside, repetition->entry_state());
+  Visit(inside);
+
+  Repetition* counted = new Repetition(base->DeepCopy(), 1, n_optional);
+  counted->SetEntryState(inside->exit_state());
+  counted->SetExitState(repetition->exit_state());
+  rinfo()->extra_allocated()->push_back(counted);
+  rinfo()->re_counted_list()->push_back(counted);
+  n_counted_queue_entries_ += CountedQueueCapacity(n_optional);
+
+  Epsilon* eps_exit = new Epsilon(inside->exit_state(),
+                                  repetition->exit_state());
+  ListNew(eps_exit);
+  Epsilon* eps_bypass = NULL;
+  if (min_rep == 0) {
+    eps_bypass =
+      new Epsilon(repetition->entry_state(), repetition->exit_state());
+    ListNew(eps_bypass);
+  }
+
+  if (FLAG_trace_repetitions) {
+    cout << "Repetion ----------" << endl;
+    cout << *inside << endl;
+    cout << *counted << endl;
+    cout << *eps_exit << endl;
+    if (eps_bypass) cout << *eps_bypass << endl;
+    cout << "---------- End of repetition" << endl;
+  }
+}
+
+
 void FF_finder::FindFFElements() {
   if (Visit(rinfo_->regexp())) {
     if (FLAG_use_ff_reduce) {
@@ -435,6 +579,11 @@ void FF_finder::ff_alternation_reduce(size_t *start, size_t *end) {
 
   // Create a new mc for the substring.
   MultipleChar *substring_mc = new MultipleChar(longest_substring);
+  for (Regexp *re : mcs) {
+    if (re->AsMultipleChar()->fold()) {
+      substring_mc->set_fold(true);
+    }
+  }
   int last_state = rinfo_->last_state();
   int substring_entry_state = last_state + 1;
   int substring_exit_state = last_state + 2;
@@ -487,6 +636,7 @@ void FF_finder::ff_alternation_reduce(size_t *start, size_t *end) {
     if (substring_offset != 0) {
       MultipleChar *linking_mc_in = new MultipleChar(mc->chars(),
                                                      substring_offset);
+      linking_mc_in->set_fold(mc->fold());
       linking_mc_in->SetEntryState(mc->entry_state());
       linking_mc_in->SetExitState(substring_entry_state);
       rinfo_->extra_allocated()->push_back(linking_mc_in);
@@ -499,9 +649,12 @@ void FF_finder::ff_alternation_reduce(size_t *start, size_t *end) {
       re_in = epsilon;
     }
 
-    if (substring_offset + longest_substring.length() != mc_string.length()) {
+    unsigned out_offset = substring_offset + longest_substring.length();
+    if (out_offset != mc_string.length()) {
       MultipleChar *linking_mc_out =
-        new MultipleChar(mc->chars() + substring_offset + longest_substring.length());
+        new MultipleChar(mc->chars() + out_offset,
+                         mc->chars_length() - out_offset);
+      linking_mc_out->set_fold(mc->fold());
       linking_mc_out->SetEntryState(substring_exit_state);
       linking_mc_out->SetExitState(mc->exit_state());
       rinfo_->extra_allocated()->push_back(linking_mc_out);
@@ -559,7 +712,7 @@ int FF_finder::ff_reduce_cmp(size_t *i1, size_t *i2) {
 
 // Codegen ---------------------------------------------------------------------
 
-static void dump_code(RegexpInfo *rinfo, VirtualMemory *vmem) {
+static void dump_code(RegexpInfo *rinfo, CodeBlock *code) {
   static unsigned index = 1;
   char *dump_name;
   ofstream dump_file;
@@ -573,13 +726,13 @@ static void dump_code(RegexpInfo *rinfo, VirtualMemory *vmem) {
 
   sprintf(dump_name, "dump.%d", n_digits);
   dump_file.open(dump_name, ofstream::binary);
-  dump_file.write((char*)vmem->address(), vmem->size());
+  dump_file.write((char*)code->address(), code->size());
   dump_file.close();
 
   sprintf(dump_name, "dump.info.%d", n_digits);
   dump_file.open(dump_name);
   dump_file << "Regexp: " << rinfo->regexp() << endl;
-  dump_file << "Base address: 0x" << hex << (uint64_t)vmem->address() << endl;
+  dump_file << "Base address: 0x" << hex << (uint64_t)code->address() << endl;
   dump_file.close();
 
   free(dump_name);
@@ -588,29 +741,105 @@ static void dump_code(RegexpInfo *rinfo, VirtualMemory *vmem) {
 }
 
 
-VirtualMemory* Codegen::Compile(RegexpInfo* rinfo, MatchType match_type) {
-  rinfo_ = rinfo;
-  match_type_ = match_type;
+void Codegen::ComputeBackwardStates() {
+  backward_states_.assign(rinfo_->last_state() + 1, false);
+  for (Regexp* re : *rinfo_->ff_list()) {
+    backward_states_[re->entry_state()] = true;
+  }
+  // Propagate from the exit state to the entry state of the regexps until a
+  // fixed point is reached.
+  bool changed;
+  do {
+    changed = false;
+    for (Regexp* re : *rinfo_->re_matching_list()) {
+      if (backward_states_[re->exit_state()] &&
+          !backward_states_[re->entry_state()]) {
+        backward_states_[re->entry_state()] = true;
+        changed = true;
+      }
+    }
+    for (Regexp* re : *rinfo_->re_control_list()) {
+      if (backward_states_[re->exit_state()] &&
+          !backward_states_[re->entry_state()]) {
+        backward_states_[re->entry_state()] = true;
+        changed = true;
+      }
+    }
+    for (Regexp* re : *rinfo_->re_counted_list()) {
+      if (backward_states_[re->exit_state()] &&
+          !backward_states_[re->entry_state()]) {
+        backward_states_[re->entry_state()] = true;
+        changed = true;
+      }
+    }
+  } while (changed);
+}
+
+
+void AnalyseRegexp(RegexpInfo* rinfo, bool is_set) {
+  if (rinfo->analysed()) {
+    return;
+  }
 
-  Regexp* root = rinfo_->regexp();
-  RegexpIndexer indexer(rinfo_);
-  indexer.Index(root);
+  Regexp* root = rinfo->regexp();
+  RegexpIndexer indexer(rinfo);
+  if (is_set) {
+    indexer.IndexSet(root->AsAlternation());
+  } else {
+    indexer.Index(root);
+  }
   if (FLAG_print_re_tree) {
     cout << "Regexp tree --------------------------------{{{" << endl;
     Indent(cout) << *root << endl;
     cout << "}}}------------------------- End of regexp tree" << endl;
   }
 
-  RegexpLister lister(rinfo_);
+  RegexpLister lister(rinfo);
   lister.Visit(root);
 
   FF_finder fff(rinfo);
   fff.FindFFElements();
 
+  vector<Regexp*>* re_control_list =
+      reinterpret_cast<vector<Regexp*>*>(rinfo->re_control_list());
+  rinfo->set_re_control_list_top_sorted(SortTopoligcal(re_control_list));
+
+  rinfo->set_analysed(true);
+}
+
+
+CodeBlock* Codegen::Compile(RegexpInfo* rinfo, MatchType match_type) {
+  rinfo_ = rinfo;
+  match_type_ = match_type;
+
+  AnalyseRegexp(rinfo_, match_type_ == kMatchSet);
+  ComputeBackwardStates();
+
+  if (match_type_ == kMatchCount &&
+      (!FLAG_use_fast_forward || rinfo_->ff_list()->empty())) {
+    // Without fast-forwarding a match can be superseded by a longer match
+    // starting earlier, and previously registered matches need to be deleted
+    // (see MatchAllAppendFilter). The count kept by kMatchCount code cannot
+    // track that, so the caller must use kMatchAll code instead.
+    rinfo_ = NULL;
+    return NULL;
+  }
+
   int n_states = rinfo->last_state() + 1;
 
+  // kMatchFull, kMatchAnywhere, and kMatchSet code only needs to know what
+  // states are active, not where their matches started.
+  packed_states_ = FLAG_use_packed_states &&
+    (match_type_ == kMatchFull || match_type_ == kMatchAnywhere ||
+     match_type_ == kMatchSet);
+
   // Align size with cache line size?
-  state_ring_time_size_ = kPointerSize * n_states;
+  if (packed_states_) {
+    state_ring_time_size_ =
+      kPointerSize * ((n_states + kBitsPerPointer - 1) / kBitsPerPointer);
+  } else {
+    state_ring_time_size_ = kPointerSize * n_states;
+  }
 
   state_ring_times_ = 1 + min(rinfo_->regexp_max_length(), kMaxNodeLength);
 
@@ -625,15 +854,32 @@ VirtualMemory* Codegen::Compile(RegexpInfo* rinfo, MatchType match_type) {
   time_summary_size_ = kPointerSize * ((state_ring_times_ / kBitsPerPointer) +
     ((state_ring_times_ % kBitsPerPointer) != 0));
   
+  counted_queues_offsets_.clear();
+  counted_queues_capacities_.clear();
+  counted_queues_size_ = 0;
+  for (Repetition* counted : *rinfo_->re_counted_list()) {
+    // With packed states all entries have the same match source, so only the
+    // latest entry is kept.
+    unsigned capacity =
+      packed_states_ ? 1 : CountedQueueCapacity(counted->max_rep());
+    counted_queues_offsets_.push_back(counted_queues_size_);
+    counted_queues_capacities_.push_back(capacity);
+    counted_queues_size_ += capacity * kCountedEntrySize;
+  }
+  counted_headers_size_ =
+    2 * kPointerSize * rinfo_->re_counted_list()->size();
+
   ring_base_ = Operand(rbp, StateRingBaseOffsetFromFrame());
 
   if (FLAG_print_state_ring_info) {
     cout << "State ring info ----------------------------{{{" << endl;
     cout << "n_states : " << n_states << endl;
+    cout << "packed_states_ : " << packed_states_ << endl;
     cout << "state_ring_time_size_ : " << state_ring_time_size_ << endl;
     cout << "state_ring_times_ : " << state_ring_times_ << endl;
     cout << "state_ring_size_ : " << state_ring_size_ << endl;
     cout << "time_summary_size_ : " << time_summary_size_ << endl;
+    cout << "counted_queues_size_ : " << counted_queues_size_ << endl;
     cout << "}}}--------------------- End of state ring info" << endl;
   }
 
@@ -641,18 +887,15 @@ VirtualMemory* Codegen::Compile(RegexpInfo* rinfo, MatchType match_type) {
     rinfo->print_re_list();
   }
 
-  vector<Regexp*>* re_control_list =
-      reinterpret_cast<vector<Regexp*>*>(rinfo->re_control_list());
-  rinfo->set_re_control_list_top_sorted(SortTopoligcal(re_control_list));
-
   Generate();
 
   rinfo_ = NULL;
-  VirtualMemory* vmem = masm_->GetCode();
+  CodeBlock* code = masm_->GetCode();
+  code->set_frame_size(frame_size_, frame_clean_size_);
   if (FLAG_dump_code) {
-    dump_code(rinfo, vmem);
+    dump_code(rinfo, code);
   }
-  return vmem;
+  return code;
 }
 
 
@@ -26,6 +26,9 @@ void MatchAllAppendRaw(vector<Match>* matches, Match new_match);
 // Push a match and delete any previously registered matches rendered invalid by
 // the new match.
 void MatchAllAppendFilter(vector<Match>* matches, Match new_match);
+// Move the matches from the buffer to its associated vector. If the buffer has
+// no associated vector, it is left untouched.
+void MatchAllFlush(MatchBuffer* buffer);
 
 
 // A simple regexp visitor, which walks the tree and assigns entry and ouput
@@ -38,6 +41,9 @@ class RegexpIndexer : public RealRegexpVisitor<void> {
     : rinfo_(rinfo), entry_state_(entry_state), last_state_(last_state) {}
 
   void Index(Regexp* regexp);
+  // Index the alternation of the regexps of a set. The regexps share the same
+  // entry state, but each has its own exit state.
+  void IndexSet(Alternation* set);
   // By default index from 0 and create the output state.
   // If specified force the entry and/or output states.
   void IndexSub(Regexp* regexp, int entry_state = 0, int output_state = -1);
@@ -74,7 +80,7 @@ class RegexpIndexer : public RealRegexpVisitor<void> {
 class RegexpLister : public RealRegexpVisitor<void> {
  public:
   explicit RegexpLister(RegexpInfo* rinfo) :
-    rinfo_(rinfo) {}
+    rinfo_(rinfo), n_counted_queue_entries_(0) {}
 
   void List(Regexp* re) {
     if (re->IsControlRegexp()) {
@@ -104,11 +110,20 @@ class RegexpLister : public RealRegexpVisitor<void> {
   // Epsilon transitions are generated explicitly.
   inline virtual void VisitEpsilon(Epsilon* epsilon) { UNREACHABLE(); }
 
+  // Returns true if the optional repetitions of the repetition can be counted
+  // instead of expanded. See ListCountedRepetition().
+  bool CanCountRepetition(Repetition* repetition) const;
+  // The mandatory repetitions are expanded as usual, and the optional ones are
+  // matched by a counted repetition from 1 to max_rep - min_rep times.
+  void ListCountedRepetition(Repetition* repetition);
+
 
   RegexpInfo* rinfo() const { return rinfo_; }
 
  private:
   RegexpInfo* rinfo_;
+  // Total capacity of the queues of the counted repetitions listed.
+  unsigned n_counted_queue_entries_;
 
   DISALLOW_COPY_AND_ASSIGN(RegexpLister);
 };
@@ -163,11 +178,21 @@ class FF_finder : public RealRegexpVisitor<bool> {
 };
 
 
+// Index and list the regexps, and find the fast-forward elements. This does
+// not depend on the match type, so it is only done once for each RegexpInfo.
+// Sets of regexps are indexed with RegexpIndexer::IndexSet.
+void AnalyseRegexp(RegexpInfo* rinfo, bool is_set);
+
+
 class Codegen : public PhysicalRegexpVisitor<void> {
  public:
   Codegen();
 
-  VirtualMemory* Compile(RegexpInfo* rinfo, MatchType match_type);
+  CodeBlock* Compile(RegexpInfo* rinfo, MatchType match_type);
+
+  // The CPU features the generated code may use. Code generated for different
+  // features must not be mixed.
+  static uint64_t CpuFeaturesFingerprint();
 
   // Code generation.
   void Generate();
@@ -185,7 +210,14 @@ class Codegen : public PhysicalRegexpVisitor<void> {
   void HandleControlRegexps();
 
   void CheckMatch(Direction direction, Label* limit);
+  // Flag the regexps of the set whose exit state is set.
+  void CheckSetMatches();
+  // Resume fast-forwarding after the ff_position, or jump to 'done' if the end
+  // of the string was reached.
+  void FastForwardAfterSetMatching(Label* done);
   void RegisterMatch();
+  // Write the match [rsi, rdx) to the match buffer pointed to by rdi.
+  void BufferMatch();
 
   void set_direction(Direction dir);
 
@@ -196,6 +228,9 @@ class Codegen : public PhysicalRegexpVisitor<void> {
   }
 
   void GenerateTransitions(Direction direction);
+  // Compute the states that matching backward from the fast-forward elements
+  // can reach.
+  void ComputeBackwardStates();
 
 #define DECLARE_REGEXP_VISITORS(RegexpType) \
   virtual void Visit##RegexpType(RegexpType* r);
@@ -208,6 +243,8 @@ class Codegen : public PhysicalRegexpVisitor<void> {
 
   void TestState(int time, int state_index);
   void SetState(int target_time, int target_index, int current_index);
+  // Set target state with the match source in the register.
+  void SetState(int target_time, int target_index, Register match_source);
   // Set target state with the current string_pointer as the match source.
   void SetStateForce(int target_time, int target_index);
   void SetStateForce(int target_time, Register target_index);
@@ -217,6 +254,16 @@ class Codegen : public PhysicalRegexpVisitor<void> {
 
   void DirectionSetOutputFromEntry(int time, Regexp* regexp);
 
+  // Offset of a state in a time of the state ring.
+  int StateOffset(int state_index) const {
+    return packed_states_ ? state_index / kBitsPerByte
+                          : state_index * kPointerSize;
+  }
+  // The bit of a packed state in the byte at its offset.
+  static int StateBit(int state_index) {
+    return 1 << (state_index % kBitsPerByte);
+  }
+
   // Only use if certain that the access will not overflow the ring_state.
   // Typically with time == 0.
   Operand StateOperand(int time, int state_index);
@@ -226,9 +273,23 @@ class Codegen : public PhysicalRegexpVisitor<void> {
 
 
   void ClearTime(int time);
+  // Only the times flagged in the time summary are cleared, so the cost
+  // depends on the number of times in use rather than on the size of the ring.
   void ClearAllTimes();
   void ClearStates(Register begin, Register end = no_reg);
 
+  // Counted repetitions (see RegexpInfo::re_counted_list()) keep a queue of the
+  // positions where they were entered, with the associated match sources.
+  void GenerateCountedRepetition(int index);
+  Operand CountedQueueHead(int index);
+  Operand CountedQueueTail(int index);
+  // Compute in 'offset' the offset in its queue of the entry 'entry_index'.
+  void ComputeCountedEntryOffset(Register offset, int index,
+                                 Register entry_index);
+  Operand CountedEntry(int index, Register offset, int field_offset);
+  int CountedHeadersOffsetFromFrame();
+  int CountedQueuesOffsetFromFrame();
+
   int TimeSummaryBaseOffsetFromFrame();
   Operand TimeSummaryOperand(int time);
   Operand TimeSummary(int offset);
@@ -240,11 +301,20 @@ class Codegen : public PhysicalRegexpVisitor<void> {
   MacroAssembler *masm() const { return masm_; }
   RegexpInfo *rinfo() const { return rinfo_; }
   MatchType match_type() const { return match_type_; }
+  // kMatchCount looks for the same matches as kMatchAll, but only counts them.
+  bool LooksForAllMatches() const {
+    return match_type_ == kMatchAll || match_type_ == kMatchCount;
+  }
   Direction direction() const { return direction_; }
   int state_ring_time_size() const { return state_ring_time_size_; }
   int state_ring_times() const { return state_ring_times_; }
   int state_ring_size() const { return state_ring_size_; }
   int time_summary_size() const { return time_summary_size_; }
+  int counted_headers_size() const { return counted_headers_size_; }
+  int counted_queues_size() const { return counted_queues_size_; }
+  int frame_size() const { return frame_size_; }
+  int frame_clean_size() const { return frame_clean_size_; }
+  bool packed_states() const { return packed_states_; }
 
  private:
   MacroAssembler *masm_;
@@ -259,8 +329,29 @@ class Codegen : public PhysicalRegexpVisitor<void> {
   // The total size (in bytes) of the ring state.
   int state_ring_size_;
   int time_summary_size_;
+  // The heads and tails of the queues of the counted repetitions are cleared
+  // with the state ring. The queues themselves do not need to be.
+  int counted_headers_size_;
+  int counted_queues_size_;
+  // Indexed like the counted repetitions. The capacities are powers of 2.
+  vector<int> counted_queues_offsets_;
+  vector<unsigned> counted_queues_capacities_;
+  // The size of the frame holding the state ring and the other data above, and
+  // the size of its upper part that must be clean when the code is called. Set
+  // by Generate.
+  int frame_size_;
+  int frame_clean_size_;
+  // When set, the state ring holds one bit per state instead of the position
+  // where the match entering the state started. This is enough for match types
+  // that do not report the matches found.
+  bool packed_states_;
   Operand ring_base_;
 
+  // Indexed by state. Matching backward starts from the entry states of the
+  // fast-forward elements, so it only needs the transitions of the part of the
+  // regexp before them.
+  vector<bool> backward_states_;
+
   Label *fast_forward_;
   Label *unwind_and_return_;
 };
@@ -327,6 +418,17 @@ class FastForwardGen : public PhysicalRegexpVisitor<void> {
   }
 
  private:
+  // Scan the string for potential matches of the MultipleChars using AVX2.
+  // Jumps to `found` with string_pointer on a potential match, or to
+  // `fallback` when the string left to process is too short for the SIMD loop.
+  void MultipleCharsAVX2(vector<MultipleChar*>* mcs,
+                         Label* found, Label* fallback,
+                         Register fixed_chars = no_reg);
+  // Scan the string for a character matching the bracket using SSSE3 or AVX2.
+  // Jumps to `found` with string_pointer on the matching character, or to
+  // `fallback` when the string left to process is too short for the SIMD loop.
+  void BracketSIMD(Bracket* bracket, Label* found, Label* fallback);
+
   Codegen* codegen_;
   MacroAssembler* masm_;
   vector<Regexp*>* ff_list_;
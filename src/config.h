@@ -33,4 +33,13 @@
 //  \<, \>
 #define ENABLE_COMMON_ESCAPED_PATTERNS
 
+// The maximum number of characters of a regexp node, like a string of
+// characters. Longer strings are split into multiple nodes.
+// The state ring of the generated code has one more time than the longest node
+// of the regexp. It is not allocated on the stack, so this can safely be
+// raised.
+#ifndef MAX_NODE_LENGTH
+#define MAX_NODE_LENGTH 256
+#endif
+
 #endif
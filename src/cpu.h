@@ -57,9 +57,13 @@ namespace internal {
 // (We assign CPUID itself to one of the currently reserved bits --
 // feel free to change this if needed.)
 // On X86/X64, values below 32 are bits in EDX, values above 32 are bits in ECX.
+// The features reported by CPUID(7, 0) are also assigned to reserved bits.
 enum CpuFeature {
+  AVX512BW = 32 + 16,  // x86
+  AVX2 = 20,   // x86
   SSE4_2 = 32 + 20,  // x86
   SSE4_1 = 32 + 19,  // x86
+  SSSE3 = 32 + 9,    // x86
   SSE3 = 32 + 0,     // x86
   SSE2 = 26,   // x86
   CMOV = 15,   // x86
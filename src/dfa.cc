@@ -0,0 +1,444 @@
+// Copyright (C) 2013 Alexandre Rames <alexandre@coreperf.com>
+// rejit is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "dfa.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#include "codegen.h"
+
+namespace rejit {
+namespace internal {
+
+// ByteNFA ---------------------------------------------------------------------
+
+int ByteNFA::NewState() {
+  transitions_.push_back(vector<Transition>());
+  reverse_transitions_.push_back(vector<Transition>());
+  epsilons_.push_back(vector<int>());
+  reverse_epsilons_.push_back(vector<int>());
+  return n_states_++;
+}
+
+
+void ByteNFA::AddTransition(int from, int to, const uint8_t* char_set) {
+  // Identical sets of characters are shared.
+  int index;
+  vector<uint8_t> set(char_set, char_set + 32);
+  vector<vector<uint8_t> >::iterator it =
+    find(char_sets_.begin(), char_sets_.end(), set);
+  if (it != char_sets_.end()) {
+    index = it - char_sets_.begin();
+  } else {
+    index = char_sets_.size();
+    char_sets_.push_back(set);
+  }
+  Transition transition = {to, index};
+  transitions_[from].push_back(transition);
+  transition.target = from;
+  reverse_transitions_[to].push_back(transition);
+}
+
+
+void ByteNFA::AddEpsilon(int from, int to) {
+  epsilons_[from].push_back(to);
+  reverse_epsilons_[to].push_back(from);
+}
+
+
+bool ByteNFA::Build(RegexpInfo* rinfo) {
+  // The lists are shared with the generated code. Regexps added by the
+  // fast-forward reduction only add transitions to states that do not lead to
+  // a match.
+  AnalyseRegexp(rinfo, false);
+
+  bool supported = true;
+  for (ControlRegexp* re : *rinfo->re_control_list()) {
+    if (!re->IsEpsilon()) {
+      // Line anchors depend on the surrounding characters.
+      supported = false;
+    }
+  }
+  if (!rinfo->re_counted_list()->empty()) {
+    // Counted repetitions do not have states for each repetition.
+    supported = false;
+  }
+  int n_states = rinfo->last_state() + 1;
+  for (MatchingRegexp* re : *rinfo->re_matching_list()) {
+    if (re->IsMultipleChar()) {
+      n_states += re->AsMultipleChar()->chars_length() - 1;
+    }
+  }
+  if (!supported || n_states > kMaxDFANFAStates) {
+    return false;
+  }
+
+  for (int i = 0; i <= rinfo->last_state(); i++) {
+    NewState();
+  }
+  start_ = rinfo->entry_state();
+  accept_ = rinfo->exit_state();
+
+  uint8_t bitmap[32];
+  for (MatchingRegexp* re : *rinfo->re_matching_list()) {
+    if (re->IsMultipleChar()) {
+      MultipleChar* mc = re->AsMultipleChar();
+      int from = mc->entry_state();
+      for (unsigned i = 0; i < mc->chars_length(); i++) {
+        int to = (i == mc->chars_length() - 1) ? mc->exit_state() : NewState();
+        mc->ComputeBitmap(i, bitmap);
+        AddTransition(from, to, bitmap);
+        from = to;
+      }
+    } else if (re->IsPeriod()) {
+      // Match all characters exept '\n' and '\r'.
+      memset(bitmap, 0xff, 32);
+      bitmap['\n' / 8] &= ~(1 << ('\n' % 8));
+      bitmap['\r' / 8] &= ~(1 << ('\r' % 8));
+      AddTransition(re->entry_state(), re->exit_state(), bitmap);
+    } else {
+      ASSERT(re->IsBracket());
+      re->AsBracket()->ComputeBitmap(bitmap);
+      AddTransition(re->entry_state(), re->exit_state(), bitmap);
+    }
+  }
+  for (ControlRegexp* re : *rinfo->re_control_list()) {
+    AddEpsilon(re->entry_state(), re->exit_state());
+  }
+
+  ComputeByteClasses();
+  return true;
+}
+
+
+void ByteNFA::ComputeByteClasses() {
+  // Two bytes are in the same class if they belong to the same sets of
+  // characters.
+  map<vector<bool>, int> classes;
+  for (unsigned c = 0; c < 256; c++) {
+    vector<bool> signature(char_sets_.size());
+    for (unsigned i = 0; i < char_sets_.size(); i++) {
+      signature[i] = CharSetContains(i, c);
+    }
+    map<vector<bool>, int>::iterator it = classes.find(signature);
+    if (it == classes.end()) {
+      class_representatives_[n_classes_] = c;
+      it = classes.insert(make_pair(signature, n_classes_++)).first;
+    }
+    byte_classes_[c] = it->second;
+  }
+}
+
+
+// DFA -------------------------------------------------------------------------
+
+void DFA::Init() {
+  n_classes_ = nfa_->n_classes();
+  byte_classes_ = nfa_->byte_classes();
+  // Account for the key and index entry of each state.
+  max_states_ = max(static_cast<size_t>(16),
+                    kDFAMemoryBudget / (n_classes_ * sizeof(int) + 64));
+  Reset();
+}
+
+
+void DFA::Reset() {
+  keys_.clear();
+  index_.clear();
+  table_.clear();
+  start_states_[0] = start_states_[1] = -1;
+  n_resets_++;
+}
+
+
+int DFA::initial_nfa_state() const {
+  return reverse_ ? nfa_->accept() : nfa_->start();
+}
+
+
+int DFA::final_nfa_state() const {
+  return reverse_ ? nfa_->start() : nfa_->accept();
+}
+
+
+void DFA::AddClosure(int nfa_state, vector<int>* group, vector<bool>* seen) {
+  if ((*seen)[nfa_state]) {
+    return;
+  }
+  (*seen)[nfa_state] = true;
+  group->push_back(nfa_state);
+  for (int next : nfa_->epsilons(nfa_state, reverse_)) {
+    AddClosure(next, group, seen);
+  }
+}
+
+
+int DFA::Intern(Groups* groups, uint8_t flags, const char* position) {
+  vector<int> key;
+  for (vector<int>& group : *groups) {
+    sort(group.begin(), group.end());
+    key.insert(key.end(), group.begin(), group.end());
+    key.push_back(-1);
+  }
+  key.push_back(flags);
+
+  map<vector<int>, int>::iterator it = index_.find(key);
+  if (it != index_.end()) {
+    return it->second;
+  }
+
+  if (keys_.size() >= max_states_) {
+    // The cache is full. Give up if the previous flush was too recent.
+    if (last_reset_position_ != NULL &&
+        static_cast<size_t>(labs(position - last_reset_position_)) <
+        10 * max_states_) {
+      return kFailed;
+    }
+    Reset();
+    last_reset_position_ = position;
+  }
+
+  int state = (table_.size() << kFlagsBits) | flags;
+  keys_.push_back(key);
+  index_[key] = state;
+  table_.resize(table_.size() + n_classes_, -1);
+  return state;
+}
+
+
+int DFA::StartState(bool match_empty, const char* position) {
+  int& start = start_states_[match_empty];
+  if (start >= 0) {
+    return start;
+  }
+  Groups groups(1);
+  vector<bool> seen(nfa_->n_states(), false);
+  AddClosure(initial_nfa_state(), &groups[0], &seen);
+  uint8_t flags = 0;
+  if (match_empty && seen[final_nfa_state()]) {
+    flags = anchored_ ? kMatch : kMatch | kMatched;
+  }
+  // Interning can flush the cache, so only record the start state afterwards.
+  int state = Intern(&groups, flags, position);
+  if (state != kFailed) {
+    start_states_[match_empty] = state;
+  }
+  return state;
+}
+
+
+int DFA::ComputeNext(int state, uint8_t c, const char* position) {
+  // Copy the source state, as interning the next state can flush the cache.
+  int offset = state >> kFlagsBits;
+  vector<int> key = keys_[offset / n_classes_];
+  uint8_t source_flags = flags(state);
+  unsigned n_resets = n_resets_;
+
+  Groups groups;
+  vector<bool> seen(nfa_->n_states(), false);
+  vector<int> group;
+  for (unsigned i = 0; i < key.size() - 1; i++) {
+    if (key[i] == -1) {
+      if (!group.empty()) {
+        groups.push_back(group);
+        group.clear();
+      }
+      continue;
+    }
+    for (const ByteNFA::Transition& t : nfa_->transitions(key[i], reverse_)) {
+      if (nfa_->CharSetContains(t.char_set, c)) {
+        AddClosure(t.target, &group, &seen);
+      }
+    }
+  }
+  if (!anchored_ && !(source_flags & kMatched)) {
+    // Start a new match after this character.
+    AddClosure(initial_nfa_state(), &group, &seen);
+    if (!group.empty()) {
+      groups.push_back(group);
+    }
+  }
+
+  uint8_t next_flags = source_flags & kMatched;
+  int final_state = final_nfa_state();
+  if (seen[final_state]) {
+    // Matches starting later than the one found are not left-most.
+    for (unsigned i = 0; i < groups.size(); i++) {
+      if (find(groups[i].begin(), groups[i].end(), final_state) !=
+          groups[i].end()) {
+        groups.resize(i + 1);
+        break;
+      }
+    }
+    next_flags |= anchored_ ? kMatch : kMatch | kMatched;
+  }
+  if (groups.empty() && (anchored_ || (next_flags & kMatched))) {
+    next_flags |= kDead;
+  }
+
+  int next = Intern(&groups, next_flags, position);
+  if (next != kFailed && n_resets == n_resets_) {
+    table_[offset + byte_classes_[c]] = next;
+  }
+  return next;
+}
+
+
+// LazyDFA ---------------------------------------------------------------------
+
+LazyDFA* LazyDFA::New(RegexpInfo* rinfo) {
+  LazyDFA* dfa = new LazyDFA();
+  if (!dfa->nfa_.Build(rinfo)) {
+    delete dfa;
+    return NULL;
+  }
+  dfa->forward_.Init();
+  dfa->reverse_.Init();
+  return dfa;
+}
+
+
+LazyDFA::Result LazyDFA::SearchForward(const char* pos, const char* end,
+                                       bool match_empty, bool earliest,
+                                       const char** match_end) {
+  const char* last_match = NULL;
+  int state = forward_.StartState(match_empty, pos);
+  if (state == DFA::kFailed) return kFailed;
+  uint8_t flags = DFA::flags(state);
+  if (flags & DFA::kMatch) {
+    last_match = pos;
+  }
+  if (!(earliest && last_match)) {
+    for (const char* p = pos; p < end; p++) {
+      state = forward_.Next(state, *p, p);
+      if (state == DFA::kFailed) return kFailed;
+      flags = DFA::flags(state);
+      if (flags) {
+        if (flags & DFA::kMatch) {
+          last_match = p + 1;
+          if (earliest) break;
+        }
+        if (flags & DFA::kDead) break;
+      }
+    }
+  }
+  *match_end = last_match;
+  return last_match ? kMatch : kNoMatch;
+}
+
+
+LazyDFA::Result LazyDFA::SearchBackward(const char* pos,
+                                        const char* match_end,
+                                        const char** match_begin) {
+  const char* first_match = NULL;
+  int state = reverse_.StartState(true, match_end);
+  if (state == DFA::kFailed) return kFailed;
+  if (DFA::flags(state) & DFA::kMatch) {
+    first_match = match_end;
+  }
+  for (const char* p = match_end - 1; p >= pos; p--) {
+    state = reverse_.Next(state, *p, p);
+    if (state == DFA::kFailed) return kFailed;
+    uint8_t flags = DFA::flags(state);
+    if (flags & DFA::kMatch) {
+      first_match = p;
+    }
+    if (flags & DFA::kDead) break;
+  }
+  ASSERT(first_match != NULL);
+  *match_begin = first_match;
+  return kMatch;
+}
+
+
+LazyDFA::Result LazyDFA::FindMatch(const char* pos, const char* end,
+                                   bool match_empty, Match* match) {
+  Result result = SearchForward(pos, end, match_empty, false, &match->end);
+  if (result != kMatch) {
+    return result;
+  }
+  return SearchBackward(pos, match->end, &match->begin);
+}
+
+
+LazyDFA::Result LazyDFA::MatchAnywhere(const char* text, size_t text_size) {
+  unique_lock<mutex> lock(mutex_, try_to_lock);
+  if (!lock.owns_lock() || failed_) {
+    return kFailed;
+  }
+  forward_.BeginSearch();
+  const char* match_end;
+  Result result =
+    SearchForward(text, text + text_size, true, true, &match_end);
+  failed_ = result == kFailed;
+  return result;
+}
+
+
+LazyDFA::Result LazyDFA::MatchFirst(const char* text, size_t text_size,
+                                    Match* match) {
+  unique_lock<mutex> lock(mutex_, try_to_lock);
+  if (!lock.owns_lock() || failed_) {
+    return kFailed;
+  }
+  forward_.BeginSearch();
+  reverse_.BeginSearch();
+  Match found;
+  Result result = FindMatch(text, text + text_size, true, &found);
+  if (result == kMatch && match) {
+    *match = found;
+  }
+  failed_ = result == kFailed;
+  return result;
+}
+
+
+LazyDFA::Result LazyDFA::MatchAll(const char* text, size_t text_size,
+                                  MatchBuffer* buffer) {
+  unique_lock<mutex> lock(mutex_, try_to_lock);
+  if (!lock.owns_lock() || failed_) {
+    return kFailed;
+  }
+  forward_.BeginSearch();
+  reverse_.BeginSearch();
+  const char* end = text + text_size;
+  const char* pos = text;
+  // An empty match is not allowed where the previous match ended.
+  const char* previous_end = NULL;
+  while (pos <= end) {
+    Match match;
+    Result result = FindMatch(pos, end, pos != previous_end, &match);
+    if (result == kFailed) {
+      failed_ = true;
+      return kFailed;
+    }
+    if (result == kNoMatch) {
+      break;
+    }
+    if (buffer->cursor == buffer->limit) {
+      if (!buffer->flushable()) {
+        break;
+      }
+      MatchAllFlush(buffer);
+    }
+    *buffer->cursor++ = match;
+    pos = (match.begin == match.end) ? match.end + 1 : match.end;
+    previous_end = match.end;
+  }
+  return kMatch;
+}
+
+} }  // namespace rejit::internal
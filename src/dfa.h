@@ -0,0 +1,228 @@
+// Copyright (C) 2013 Alexandre Rames <alexandre@coreperf.com>
+// rejit is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef REJIT_DFA_H_
+#define REJIT_DFA_H_
+
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "globals.h"
+#include "regexp.h"
+
+namespace rejit {
+namespace internal {
+
+// Regexps with more NFA states than this do not use the DFA tier.
+const int kMaxDFANFAStates = 512;
+// Maximum size of the transition table of each DFA.
+const size_t kDFAMemoryBudget = 1 << 20;
+
+// Non-deterministic automaton consuming one byte per transition.
+// It is built from the states allocated by the RegexpIndexer. MultipleChars
+// use intermediate states between their characters.
+// Bytes that no transition distinguishes share the same byte class.
+class ByteNFA {
+ public:
+  ByteNFA() : n_states_(0), start_(-1), accept_(-1), n_classes_(0) {}
+
+  // Returns false if the regexp cannot be represented.
+  bool Build(RegexpInfo* rinfo);
+
+  struct Transition {
+    int target;
+    // Index of the bytes bitmap in char_sets_.
+    int char_set;
+  };
+
+  int n_states() const { return n_states_; }
+  int start() const { return start_; }
+  int accept() const { return accept_; }
+  int n_classes() const { return n_classes_; }
+  const uint8_t* byte_classes() const { return byte_classes_; }
+  // A byte of the given class.
+  uint8_t class_representative(int byte_class) const {
+    return class_representatives_[byte_class];
+  }
+  bool CharSetContains(int char_set, uint8_t c) const {
+    return char_sets_[char_set][c / 8] & (1 << (c % 8));
+  }
+  const vector<Transition>& transitions(int state, bool reverse) const {
+    return reverse ? reverse_transitions_[state] : transitions_[state];
+  }
+  const vector<int>& epsilons(int state, bool reverse) const {
+    return reverse ? reverse_epsilons_[state] : epsilons_[state];
+  }
+
+ private:
+  int NewState();
+  void AddTransition(int from, int to, const uint8_t* char_set);
+  void AddEpsilon(int from, int to);
+  void ComputeByteClasses();
+
+  int n_states_;
+  int start_;
+  int accept_;
+  vector<vector<Transition> > transitions_;
+  vector<vector<Transition> > reverse_transitions_;
+  vector<vector<int> > epsilons_;
+  vector<vector<int> > reverse_epsilons_;
+  // Bitmaps of 32 bytes.
+  vector<vector<uint8_t> > char_sets_;
+  int n_classes_;
+  uint8_t byte_classes_[256];
+  uint8_t class_representatives_[256];
+
+  DISALLOW_COPY_AND_ASSIGN(ByteNFA);
+};
+
+
+// A DFA built lazily from a ByteNFA, in the style of RE2.
+// Each DFA state is an ordered list of groups of NFA states. All the states of
+// a group were entered from the same start position, and groups are ordered by
+// start position. An NFA state is only kept in the earliest group reaching it.
+// This allows the left-most longest match to be tracked:
+//  - Unanchored DFAs start a new group at every position until a match is
+//    found. When a group matches, the later groups are dropped.
+//  - Anchored DFAs only have a single group.
+// States and transitions are computed on demand and cached in a bounded table.
+// When the table is full it is flushed. If this happens too often, the search
+// fails and the caller must fall back to the state ring code.
+class DFA {
+ public:
+  DFA(const ByteNFA* nfa, bool reverse, bool anchored)
+    : nfa_(nfa), reverse_(reverse), anchored_(anchored), n_classes_(0),
+      byte_classes_(NULL), max_states_(0), n_resets_(0),
+      last_reset_position_(NULL) {}
+
+  // Must be called once the NFA has been built.
+  void Init();
+
+  static const int kFailed = -1;
+
+  // States are referred to by the offset of their transitions in the table,
+  // shifted to hold the flags of the state in the low bits. So the next state
+  // and its flags are found with a single load.
+  static const int kFlagsBits = 3;
+  static const int kFlagsMask = (1 << kFlagsBits) - 1;
+
+  enum StateFlags {
+    kMatch = 1 << 0,
+    kDead = 1 << 1,
+    // No new groups are started.
+    kMatched = 1 << 2
+  };
+
+  // Must be called before searching, to reset the thrashing detection.
+  void BeginSearch() { last_reset_position_ = NULL; }
+
+  // The start state, or kFailed if the cache thrashes. When `match_empty` is
+  // false, an empty match at the start position is ignored.
+  int StartState(bool match_empty, const char* position);
+
+  // Returns the next state, or kFailed if the cache thrashes.
+  // `position` is the position of the byte in the text.
+  inline int Next(int state, uint8_t c, const char* position) {
+    int next = table_[(state >> kFlagsBits) + byte_classes_[c]];
+    return next >= 0 ? next : ComputeNext(state, c, position);
+  }
+
+  static inline uint8_t flags(int state) { return state & kFlagsMask; }
+
+ private:
+  typedef vector<vector<int> > Groups;
+
+  int ComputeNext(int state, uint8_t c, const char* position);
+  // The NFA state starting and ending the matches for this direction.
+  int initial_nfa_state() const;
+  int final_nfa_state() const;
+  void AddClosure(int nfa_state, vector<int>* group, vector<bool>* seen);
+  // Returns the state, or kFailed if the cache thrashes.
+  int Intern(Groups* groups, uint8_t flags, const char* position);
+  void Reset();
+
+  const ByteNFA* nfa_;
+  bool reverse_;
+  bool anchored_;
+  int n_classes_;
+  const uint8_t* byte_classes_;
+  size_t max_states_;
+
+  // The key of each state lists the NFA states of each group, with groups
+  // separated by -1, and is terminated by the flags.
+  vector<vector<int> > keys_;
+  map<vector<int>, int> index_;
+  // Next states indexed by state offset and byte class. -1 when not computed
+  // yet.
+  vector<int> table_;
+  int start_states_[2];
+  unsigned n_resets_;
+  const char* last_reset_position_;
+
+  DISALLOW_COPY_AND_ASSIGN(DFA);
+};
+
+
+// The DFA tier used for kMatchAnywhere, kMatchFirst, and kMatchAll.
+// Matches are located with a forward unanchored DFA giving the end of the
+// left-most longest match, and a reverse anchored DFA giving its start.
+// A LazyDFA can be shared by multiple threads, but only one of them uses it at
+// a time. The others are told to use the state ring code.
+class LazyDFA {
+ public:
+  // Returns NULL if the regexp is not suitable for the DFA tier.
+  static LazyDFA* New(RegexpInfo* rinfo);
+
+  enum Result {
+    // The DFA could not be used. The state ring code must be used instead.
+    kFailed = -1,
+    kNoMatch = 0,
+    kMatch = 1
+  };
+
+  Result MatchAnywhere(const char* text, size_t text_size);
+  Result MatchFirst(const char* text, size_t text_size, Match* match);
+  // Write the matches to the buffer, with the same semantics as kMatchAll code.
+  // Upon failure the matches may have been partially written.
+  Result MatchAll(const char* text, size_t text_size, MatchBuffer* buffer);
+
+ private:
+  LazyDFA()
+    : forward_(&nfa_, false, false), reverse_(&nfa_, true, true),
+      failed_(false) {}
+
+  // Find the end of the left-most longest match starting at or after `pos`.
+  // If `earliest` is set, stop at the first position where a match ends.
+  Result SearchForward(const char* pos, const char* end, bool match_empty,
+                       bool earliest, const char** match_end);
+  // Find the start of the left-most match ending at `match_end`.
+  Result SearchBackward(const char* pos, const char* match_end,
+                        const char** match_begin);
+  Result FindMatch(const char* pos, const char* end, bool match_empty,
+                   Match* match);
+
+  ByteNFA nfa_;
+  DFA forward_;
+  DFA reverse_;
+  mutex mutex_;
+  // Set when the cache thrashed. The DFA is not used any more.
+  bool failed_;
+
+  DISALLOW_COPY_AND_ASSIGN(LazyDFA);
+};
+
+} }  // namespace rejit::internal
+
+#endif  // REJIT_DFA_H_
@@ -48,6 +48,16 @@ M( use_fast_forward      , true    , true  )                                   \
 M( use_fast_forward_early, true    , true  )                                   \
 /* Use / trace reduction of fast-forward elements (substring extraction). */   \
 M( use_ff_reduce         , true    , true  )                                   \
+/* Use the AVX2 code paths when the cpu supports them. */                      \
+M( use_avx2              , true    , true  )                                   \
+/* Match with a lazily built DFA when the regexp allows it. */                 \
+M( use_dfa               , true    , true  )                                   \
+/* Match with a bit-parallel engine when the regexp has few positions. */     \
+M( use_shift_and         , true    , true  )                                   \
+/* Use a state ring with one bit per state when match sources are unused. */   \
+M( use_packed_states     , true    , true  )                                   \
+/* Match large bounded repetitions of single characters with counters. */      \
+M( use_rep_counters      , true    , true  )                                   \
 /* Use parser level optimizations. */                                          \
 M( use_parser_opt        , true    , true  )                                   \
 /* Dump generated code. */                                                     \
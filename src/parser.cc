@@ -370,7 +370,7 @@ int Parser::ParseCurlyBrackets(const char *left_curly_bracket) {
   Regexp *re = PopRegexp();
 
   if (FLAG_use_parser_opt &&
-      re->IsMultipleChar() && min > 1) {
+      re->IsMultipleChar() && min > 1 && !IsGroup(re)) {
     // Optimize a{min,max} to a^m a{0,max-min}
 
     Regexp *result = NULL;
@@ -400,6 +400,7 @@ int Parser::ParseCurlyBrackets(const char *left_curly_bracket) {
       if (mc_start->chars_length() + mc_base_len > kMaxNodeLength) {
         concat->Append(mc_start);
         mc_start = new MultipleChar();
+        mc_start->set_fold(mc->fold());
       }
       mc_start->chars_.insert(mc_start->chars_.end(),
                               mc_base_begin, mc_base_end);
@@ -458,6 +459,9 @@ int Parser::ParseBrackets(const char *left_bracket) {
       c++;
     }
   }
+  if (ignore_case_) {
+    bracket->FoldCase();
+  }
   regexp_info()->UpdateRegexpMaxLength(bracket);
   PushRegexp(bracket);
   return c - left_bracket;
@@ -466,13 +470,19 @@ int Parser::ParseBrackets(const char *left_bracket) {
 
 void Parser::PushChar(char c, bool append_to_mc_tos) {
   MultipleChar* mc;
+  bool fold = ignore_case_ && IsAsciiLetter(c);
+  if (fold) {
+    c = ToLowerAscii(c);
+  }
 
-  if (append_to_mc_tos && tos() && tos()->IsMultipleChar()) {
+  if (append_to_mc_tos && tos() && tos()->IsMultipleChar() &&
+      !IsGroup(tos())) {
     // Append the character to the MultipleCharacter regexp on the top of the
     // stack.
     mc = reinterpret_cast<MultipleChar*>(tos());
     if (!mc->IsFull()) {
       mc->PushChar(c);
+      mc->set_fold(mc->fold() || fold);
       regexp_info()->UpdateRegexpMaxLength(mc);
       return;
     }
@@ -480,6 +490,7 @@ void Parser::PushChar(char c, bool append_to_mc_tos) {
 
   // Create a new mc.
   mc = new MultipleChar(c);
+  mc->set_fold(fold);
   regexp_info()->UpdateRegexpMaxLength(mc);
   PushRegexp(mc);
 }
@@ -504,6 +515,10 @@ void Parser::PushPeriod() {
 
 void Parser::PushLeftParenthesis() {
   PushRegexp(new Regexp(kLeftParenthesis));
+  if (groups_) {
+    open_groups_.push_back(groups_->size());
+    groups_->push_back(NULL);
+  }
 }
 
 
@@ -528,6 +543,10 @@ void Parser::DoRightParenthesis() {
   ASSERT(tos()->type() == kLeftParenthesis);
   PopRegexp();
   PushRegexp(concat);
+  if (groups_) {
+    (*groups_)[open_groups_.back()] = concat;
+    open_groups_.pop_back();
+  }
 }
 
 
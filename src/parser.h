@@ -15,6 +15,8 @@
 #ifndef REJIT_PARSER_H_
 #define REJIT_PARSER_H_
 
+#include <algorithm>
+
 #include "regexp.h"
 
 namespace rejit {
@@ -31,7 +33,15 @@ enum Syntax {
 // Regular expression parser.
 class Parser {
  public:
-  Parser() {}
+  // When 'groups' is not NULL, the parser preserves the regexps matched by the
+  // groups (the sub-expressions in parenthesis) and records them in the order
+  // of their left parenthesis. The optimizations merging regexps across group
+  // boundaries are then disabled.
+  explicit Parser(vector<Regexp*>* groups = NULL)
+    : groups_(groups), ignore_case_(false) {}
+
+  // When set, letters are matched regardless of their case.
+  void set_ignore_case(bool ignore_case) { ignore_case_ = ignore_case; }
 
   // Top level function to parse a regular expression.
   inline Status Parse(Syntax syntax, RegexpInfo* rinfo, const char* regexp) {
@@ -40,6 +50,10 @@ class Parser {
     regexp_string_ = regexp;
     status_ = RejitSuccess;
     stack_.clear();
+    open_groups_.clear();
+    if (groups_) {
+      groups_->clear();
+    }
     switch(syntax) {
       case BRE:
         return ParseBRE(rinfo, regexp);
@@ -114,6 +128,11 @@ class Parser {
   // Helpers ---------------------------------------------------------
   uint32_t ParseIntegerAt(const char* pos, char** end);
 
+  bool IsGroup(Regexp* regexp) {
+    return groups_ &&
+      find(groups_->begin(), groups_->end(), regexp) != groups_->end();
+  }
+
   // Error signaling -------------------------------------------------
   Status ParseError(const char* pos, const char* format, ...);
 
@@ -142,6 +161,11 @@ class Parser {
   Syntax syntax_;
   Status status_;
   vector<Regexp*> stack_;
+  // See the constructor.
+  vector<Regexp*>* groups_;
+  // Indexes in groups_ of the groups not closed yet.
+  vector<size_t> open_groups_;
+  bool ignore_case_;
 };
 
 } }  // namespace rejit::internal
@@ -210,6 +210,41 @@ class VirtualMemory {
 };
 
 
+// Committed memory holding generated code.
+// When the platform allows it, the memory is mapped twice: code is written
+// through a writable mapping and executed from a separate read-only executable
+// mapping. Pages are then never writable and executable at the same time, and
+// code can be added next to code other threads are running. Otherwise both
+// addresses are the same and the memory is writable and executable.
+class CodeMemory {
+ public:
+  // Reserves and commits size bytes, rounded up to the page size.
+  explicit CodeMemory(size_t size);
+  ~CodeMemory();
+
+  bool IsReserved() { return address_ != NULL; }
+
+  // The address at which the code is executed.
+  void* address() {
+    ASSERT(IsReserved());
+    return address_;
+  }
+  // The address at which the code is written.
+  void* writable_address() {
+    ASSERT(IsReserved());
+    return writable_address_;
+  }
+  size_t size() { return size_; }
+
+ private:
+  void* address_;
+  void* writable_address_;
+  size_t size_;
+
+  DISALLOW_COPY_AND_ASSIGN(CodeMemory);
+};
+
+
 } }  // namespace rejit::internal
 
 #endif  // REJIT_PLATFORM_H_
@@ -36,6 +36,7 @@
 #include <time.h>
 
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <sys/socket.h>
 #include <sys/resource.h>
 #include <sys/time.h>
@@ -226,4 +227,51 @@ bool VirtualMemory::ReleaseRegion(void* base, size_t size) {
 }
 
 
+CodeMemory::CodeMemory(size_t size)
+    : address_(NULL), writable_address_(NULL), size_(0) {
+  size = RoundUp(size, OS::AllocateAlignment());
+#ifdef SYS_memfd_create
+  // Map an anonymous file twice.
+  const unsigned kMfdCloexec = 1;
+  int fd = syscall(SYS_memfd_create, "rejit-code", kMfdCloexec);
+  if (fd >= 0) {
+    if (ftruncate(fd, size) == 0) {
+      void* writable = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, fd, kMmapFdOffset);
+      void* executable = mmap(NULL, size, PROT_READ | PROT_EXEC,
+                              MAP_SHARED, fd, kMmapFdOffset);
+      if (writable != MAP_FAILED && executable != MAP_FAILED) {
+        address_ = executable;
+        writable_address_ = writable;
+        size_ = size;
+      } else {
+        if (writable != MAP_FAILED) munmap(writable, size);
+        if (executable != MAP_FAILED) munmap(executable, size);
+      }
+    }
+    close(fd);
+    if (IsReserved()) return;
+  }
+#endif
+  void* result = mmap(OS::GetRandomMmapAddr(),
+                      size,
+                      PROT_READ | PROT_WRITE | PROT_EXEC,
+                      MAP_PRIVATE | MAP_ANONYMOUS,
+                      kMmapFd,
+                      kMmapFdOffset);
+  if (result == MAP_FAILED) return;
+  address_ = writable_address_ = result;
+  size_ = size;
+}
+
+
+CodeMemory::~CodeMemory() {
+  if (!IsReserved()) return;
+  if (writable_address_ != address_) {
+    munmap(writable_address_, size_);
+  }
+  munmap(address_, size_);
+}
+
+
 } }  // namespace rejit::internal
@@ -245,4 +245,26 @@ bool VirtualMemory::ReleaseRegion(void* address, size_t size) {
 }
 
 
+CodeMemory::CodeMemory(size_t size)
+    : address_(NULL), writable_address_(NULL), size_(0) {
+  size = RoundUp(size, OS::AllocateAlignment());
+  void* result = mmap(OS::GetRandomMmapAddr(),
+                      size,
+                      PROT_READ | PROT_WRITE | PROT_EXEC,
+                      MAP_PRIVATE | MAP_ANON,
+                      kMmapFd,
+                      kMmapFdOffset);
+  if (result == MAP_FAILED) return;
+  address_ = writable_address_ = result;
+  size_ = size;
+}
+
+
+CodeMemory::~CodeMemory() {
+  if (IsReserved()) {
+    munmap(address_, size_);
+  }
+}
+
+
 } }  // namespace rejit::internal
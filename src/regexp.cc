@@ -13,6 +13,9 @@
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "regexp.h"
+#include "dfa.h"
+#include "shift-and.h"
+#include "submatch.h"
 #include <string.h>
 #include <map>
 
@@ -35,17 +38,18 @@ case k##RegexpType: stream << #RegexpType; break;
 }
 
 
-MultipleChar::MultipleChar(char c) : MatchingRegexp(kMultipleChar) {
+MultipleChar::MultipleChar(char c)
+  : MatchingRegexp(kMultipleChar), fold_(false) {
   chars_.push_back(c);
 }
 
 
 MultipleChar::MultipleChar(MultipleChar *mc)
-  : MatchingRegexp(kMultipleChar), chars_(mc->chars_) {}
+  : MatchingRegexp(kMultipleChar), chars_(mc->chars_), fold_(mc->fold_) {}
 
 
 MultipleChar::MultipleChar(const string& str)
-  : MatchingRegexp(kMultipleChar) {
+  : MatchingRegexp(kMultipleChar), fold_(false) {
   ASSERT(str.length() <= kMaxNodeLength);
   for (size_t i = 0; i < str.length(); i++) {
     chars_.push_back(str[i]);
@@ -54,7 +58,7 @@ MultipleChar::MultipleChar(const string& str)
 
 
 MultipleChar::MultipleChar(const char* first_char, unsigned count)
-  : MatchingRegexp(kMultipleChar) {
+  : MatchingRegexp(kMultipleChar), fold_(false) {
   ASSERT(count <= kMaxNodeLength);
   for (const char* c = first_char; c < first_char + count; c++) {
     chars_.push_back(*c);
@@ -64,16 +68,32 @@ MultipleChar::MultipleChar(const char* first_char, unsigned count)
 
 Regexp* MultipleChar::DeepCopy() {
   MultipleChar* newre = new MultipleChar(&chars_[0], chars_.size());
+  newre->set_fold(fold_);
   return newre;
 }
 
 
+void MultipleChar::ComputeBitmap(unsigned index, uint8_t* bitmap) const {
+  uint8_t c = chars_[index];
+  memset(bitmap, 0, 32);
+  bitmap[c / 8] |= 1 << (c % 8);
+  if (fold_ && IsAsciiLetter(c)) {
+    c &= ~kCaseBit;
+    bitmap[c / 8] |= 1 << (c % 8);
+  }
+}
+
+
 ostream& MultipleChar::OutputToIOStream(ostream& stream) const {  // NOLINT
   stream << string("MultipleChar [");
   for (unsigned i = 0; i < chars_length(); i++) {
     stream << chars_[i];
   }
-  stream << "] {" << entry_state_ << ", " << exit_state_ << "}";
+  stream << "]";
+  if (fold_) {
+    stream << " (fold)";
+  }
+  stream << " {" << entry_state_ << ", " << exit_state_ << "}";
   return stream;
 }
 
@@ -105,11 +125,63 @@ Regexp* Bracket::DeepCopy() {
   Bracket* bracket = new Bracket();
   bracket->single_chars_ = this->single_chars_;
   bracket->char_ranges_ = this->char_ranges_;
+  bracket->flags_ = this->flags_;
 
   return bracket;
 }
 
 
+bool Bracket::Matches(char c) {
+  // Characters are compared as signed values, as in the generated code.
+  bool in_bracket =
+    find(single_chars_.begin(), single_chars_.end(), c) != single_chars_.end();
+  vector<CharRange>::iterator it;
+  for (it = char_ranges_.begin(); it < char_ranges_.end(); it++) {
+    in_bracket |= (*it).low <= c && c <= (*it).high;
+  }
+  return (flags_ & non_matching) ? !in_bracket : in_bracket;
+}
+
+
+void Bracket::FoldCase() {
+  vector<char> other_case_chars;
+  for (char c : single_chars_) {
+    if (IsAsciiLetter(c)) {
+      other_case_chars.push_back(c ^ kCaseBit);
+    }
+  }
+  single_chars_.insert(single_chars_.end(),
+                       other_case_chars.begin(), other_case_chars.end());
+
+  vector<CharRange> other_case_ranges;
+  for (CharRange range : char_ranges_) {
+    // Intersect the range with each case, and add the result in the other case.
+    static const CharRange cases[] = {{'a', 'z'}, {'A', 'Z'}};
+    for (CharRange letters : cases) {
+      char low = max(range.low, letters.low);
+      char high = min(range.high, letters.high);
+      if (low <= high) {
+        CharRange other = {static_cast<char>(low ^ kCaseBit),
+                           static_cast<char>(high ^ kCaseBit)};
+        other_case_ranges.push_back(other);
+      }
+    }
+  }
+  char_ranges_.insert(char_ranges_.end(),
+                      other_case_ranges.begin(), other_case_ranges.end());
+}
+
+
+void Bracket::ComputeBitmap(uint8_t* bitmap) {
+  memset(bitmap, 0, 32);
+  for (unsigned c = 0; c < 256; c++) {
+    if (Matches(static_cast<char>(c))) {
+      bitmap[c / 8] |= 1 << (c % 8);
+    }
+  }
+}
+
+
 void RegexpWithSubs::DeepCopySubRegexpsFrom(RegexpWithSubs* original) {
   vector<Regexp*>::const_iterator it;
   for (it = original->sub_regexps()->begin();
@@ -229,10 +301,15 @@ Regexp* Repetition::DeepCopy() {
 
 RegexpInfo::~RegexpInfo() {
   if (regexp_)              regexp_->~Regexp();
-  if (vmem_match_full_)     delete vmem_match_full_;
-  if (vmem_match_anywhere_) delete vmem_match_anywhere_;
-  if (vmem_match_first_)    delete vmem_match_first_;
-  if (vmem_match_all_)      delete vmem_match_all_;
+  if (code_match_full_)     delete code_match_full_;
+  if (code_match_anywhere_) delete code_match_anywhere_;
+  if (code_match_first_)    delete code_match_first_;
+  if (code_match_all_)      delete code_match_all_;
+  if (code_match_count_)    delete code_match_count_;
+  if (code_match_set_)      delete code_match_set_;
+  if (dfa_)                 delete dfa_;
+  if (shift_and_)           delete shift_and_;
+  if (submatch_resolver_)   delete submatch_resolver_;
   vector<Regexp*>::iterator it;
   for (it = extra_allocated_.begin(); it < extra_allocated_.end(); it++) {
     (*it)->~Regexp();
@@ -255,6 +332,13 @@ void RegexpInfo::print_re_list() {
       cout << *re << endl;
     }
     cout << "}}}-------------------------- End of matching regexp list" << endl;
+    if (!re_counted_list_.empty()) {
+      cout << "Counted regexps list --------------------------------{{{" << endl;
+      for (Repetition* re : re_counted_list_) {
+        cout << *re << endl;
+      }
+      cout << "}}}--------------------------- End of counted regexp list" << endl;
+    }
   }
   cout << "}}}------------------------- End of regexp list" << endl;
 }
@@ -283,6 +367,115 @@ bool all_regexps_start_at(int entry_state, vector<Regexp*> *regexps) {
 }
 
 
+unsigned regexp_max_match_length(Regexp* regexp) {
+  switch (regexp->type()) {
+    case kMultipleChar:
+    case kPeriod:
+    case kBracket:
+    case kStartOfLine:
+    case kEndOfLine:
+    case kEpsilon:
+      return regexp->MatchLength();
+
+    case kRepetition: {
+      Repetition* rep = regexp->AsRepetition();
+      uint64_t sub_length = regexp_max_match_length(rep->sub_regexp());
+      if (sub_length == 0) {
+        return 0;
+      }
+      if (!rep->IsLimited() || sub_length == kMaxUInt) {
+        return kMaxUInt;
+      }
+      return min(sub_length * rep->max_rep(), static_cast<uint64_t>(kMaxUInt));
+    }
+
+    case kConcatenation:
+    case kAlternation: {
+      bool concatenation = regexp->IsConcatenation();
+      uint64_t length = 0;
+      vector<Regexp*>::iterator it;
+      vector<Regexp*>* subs = regexp->AsRegexpWithSubs()->sub_regexps();
+      for (it = subs->begin(); it < subs->end(); it++) {
+        uint64_t sub_length = regexp_max_match_length(*it);
+        length = concatenation ? length + sub_length : max(length, sub_length);
+      }
+      return min(length, static_cast<uint64_t>(kMaxUInt));
+    }
+
+    default:
+      UNREACHABLE();
+      return kMaxUInt;
+  }
+}
+
+
+bool regexp_can_match_char(Regexp* regexp, char c) {
+  switch (regexp->type()) {
+    case kMultipleChar: {
+      MultipleChar* mc = regexp->AsMultipleChar();
+      for (unsigned i = 0; i < mc->chars_length(); i++) {
+        if (mc->Matches(i, c)) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    case kPeriod:
+      // See Codegen::VisitPeriod.
+      return c != '\n' && c != '\r';
+
+    case kBracket:
+      return regexp->AsBracket()->Matches(c);
+
+    case kStartOfLine:
+    case kEndOfLine:
+    case kEpsilon:
+      return false;
+
+    case kRepetition:
+      return regexp->AsRepetition()->max_rep() != 0 &&
+        regexp_can_match_char(regexp->AsRepetition()->sub_regexp(), c);
+
+    case kConcatenation:
+    case kAlternation: {
+      vector<Regexp*>::iterator it;
+      vector<Regexp*>* subs = regexp->AsRegexpWithSubs()->sub_regexps();
+      for (it = subs->begin(); it < subs->end(); it++) {
+        if (regexp_can_match_char(*it, c)) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    default:
+      UNREACHABLE();
+      return true;
+  }
+}
+
+
+bool regexp_contains(Regexp* regexp, RegexpType type) {
+  if (regexp->type() == type) {
+    return true;
+  }
+  if (regexp->IsRegexpWithOneSub()) {
+    return regexp_contains(regexp->AsRegexpWithOneSub()->sub_regexp(), type);
+  }
+  if (regexp->IsRegexpWithSubs()) {
+    vector<Regexp*>::iterator it;
+    vector<Regexp*>* subs = regexp->AsRegexpWithSubs()->sub_regexps();
+    for (it = subs->begin(); it < subs->end(); it++) {
+      if (regexp_contains(*it, type)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+
 bool SortTopoligcal(vector<Regexp*> *regexps) {
   unsigned n_re = regexps->size();
 
@@ -15,7 +15,11 @@
 #ifndef REJIT_REGEXP_H_
 #define REJIT_REGEXP_H_
 
+#include <atomic>
+#include <mutex>
+
 #include "globals.h"
+#include "code-arena.h"
 #include "platform.h"
 #include "utils.h"
 
@@ -97,14 +101,36 @@ class Regexp;
 LIST_REAL_REGEXP_TYPES(FORWARD_DECLARE)
 LIST_INTERMEDIATE_REGEXP_TYPES(FORWARD_DECLARE)
 #undef FORWARD_DECLARE
+class LazyDFA;
+class ShiftAnd;
+class SubmatchResolver;
 
 
 // Limit the maximum length of a regexp to limit the maximum size of the state
-// ring.
+// ring. See MAX_NODE_LENGTH in config.h.
 // TODO: This should probably be computed to match some architectural
 // limit related to the caches.
-// TODO: This could be modifiable via a flag.
-static const unsigned kMaxNodeLength = 64;
+static const unsigned kMaxNodeLength = MAX_NODE_LENGTH;
+
+// Limited repetitions of a single character regexp with at least
+// kMinCountedRepetitions optional repetitions are matched with a counter
+// instead of being expanded into a chain of copies of the character regexp.
+// The generated code keeps a queue of entries for each of them in its frame
+// (see CountedQueueCapacity), so the total number of entries of the queues is
+// limited to keep the frame small.
+static const unsigned kMinCountedRepetitions = 64;
+static const unsigned kMaxCountedQueueEntries = 1 << 12;
+
+// An entry can only be used for max_rep characters, but a new entry is pushed
+// before the oldest one expires. The capacity is a power of 2 to easily wrap
+// around the queue.
+inline unsigned CountedQueueCapacity(unsigned max_rep) {
+  unsigned capacity = 1;
+  while (capacity <= max_rep) {
+    capacity <<= 1;
+  }
+  return capacity;
+}
 
 
 // Regexps ---------------------------------------------------------------------
@@ -212,7 +238,7 @@ class MatchingRegexp : public Regexp {
 // the lifetime of the generated functions.
 class MultipleChar : public MatchingRegexp {
  public:
-  MultipleChar() : MatchingRegexp(kMultipleChar) {}
+  MultipleChar() : MatchingRegexp(kMultipleChar), fold_(false) {}
   MultipleChar(MultipleChar *mc);
   MultipleChar(char c);
   MultipleChar(const string&);
@@ -242,6 +268,17 @@ class MultipleChar : public MatchingRegexp {
   const char* chars() const { return &chars_[0]; }
   unsigned chars_length() const { return chars_.size(); }
 
+  // A folding mc matches letters regardless of their case. Its letters are
+  // stored in lowercase.
+  bool fold() const { return fold_; }
+  void set_fold(bool fold) { fold_ = fold; }
+  // Returns true if the character at 'index' matches 'c'.
+  bool Matches(unsigned index, char c) const {
+    return chars_[index] == (fold_ ? ToLowerAscii(c) : c);
+  }
+  // Set the bits of the 32 bytes bitmap for the characters matched at 'index'.
+  void ComputeBitmap(unsigned index, uint8_t* bitmap) const;
+
   int64_t first_chars() const {
     return *reinterpret_cast<const int64_t*>(chars()) &
       FirstCharsMask(chars_length());
@@ -254,6 +291,7 @@ class MultipleChar : public MatchingRegexp {
 
  protected:
   vector<char> chars_;
+  bool fold_;
 
  private:
   DISALLOW_COPY_AND_ASSIGN(MultipleChar);
@@ -298,6 +336,14 @@ class Bracket : public MatchingRegexp {
   inline void AddSingleChar(char c) { single_chars_.push_back(c); }
   inline void AddCharRange(CharRange range) { char_ranges_.push_back(range); }
 
+  // Returns true if the bracket matches the character.
+  bool Matches(char c);
+  // Make the bracket match the letters it contains in both cases.
+  void FoldCase();
+  // Set bit `c` of the 32 bytes bitmap for every character `c` matched by the
+  // bracket.
+  void ComputeBitmap(uint8_t* bitmap);
+
   // Accessors.
   uint32_t flags() const { return flags_; }
   void set_flags(uint32_t flags) { flags_ = flags; }
@@ -530,10 +576,42 @@ template <class ret_type> class PhysicalRegexpVisitor {
 };
 
 
-typedef bool (*MatchFullFunc)(const char*, size_t);
-typedef bool (*MatchAnywhereFunc)(const char*, size_t);
-typedef bool (*MatchFirstFunc)(const char*, size_t, Match*);
-typedef unsigned (*MatchAllFunc)(const char*, size_t, std::vector<Match>*);
+// kMatchAll code writes the matches it finds to a buffer, and only calls back
+// into C++ (see MatchAllFlush) when the buffer is full.
+struct MatchBuffer {
+  // Next entry to write.
+  Match* cursor;
+  Match* base;
+  // Points past the last entry of the buffer.
+  Match* limit;
+  // The vector to which the matches are flushed. When both are NULL, the
+  // matches found when the buffer is full are dropped.
+  vector<Match>* matches;
+  // Matches flushed to this vector are converted to offsets from 'text'.
+  vector<CompactMatch>* compact_matches;
+  const char* text;
+
+  bool flushable() const { return matches != NULL || compact_matches != NULL; }
+};
+// Number of entries of the buffer used when matching into a vector.
+const size_t kMatchBufferLength = 128;
+
+// Texts are only split to be matched by multiple threads if each thread gets at
+// least this number of characters.
+const size_t kMinParallelChunkSize = 1 << 16;
+
+// The last argument of the compiled functions is the frame holding the state
+// ring, of the size given by CodeBlock::frame_size(). See Codegen::Generate.
+typedef bool (*MatchFullFunc)(const char*, size_t, char* frame);
+typedef bool (*MatchAnywhereFunc)(const char*, size_t, char* frame);
+typedef bool (*MatchFirstFunc)(const char*, size_t, Match*, char* frame);
+typedef void (*MatchAllFunc)(const char*, size_t, MatchBuffer*, char* frame);
+typedef size_t (*MatchCountFunc)(const char*, size_t, char* frame);
+// Returned by MatchCountFunc when it cannot count the matches. They must then
+// be counted with MatchAll.
+const size_t kMatchCountOverflow = static_cast<size_t>(-1);
+// Sets matched[i] to a non-zero value if the regexp i of the set matches.
+typedef void (*MatchSetFunc)(const char*, size_t, char* matched, char* frame);
 
 class RegexpInfo {
  public:
@@ -543,14 +621,28 @@ class RegexpInfo {
       regexp_max_length_(0),
       re_control_list_topo_sorted_(false),
       ff_reduced_(false),
+      analysed_(false),
       match_full_(NULL),
       match_anywhere_(NULL),
       match_first_(NULL),
       match_all_(NULL),
-      vmem_match_full_(NULL),
-      vmem_match_anywhere_(NULL),
-      vmem_match_first_(NULL),
-      vmem_match_all_(NULL) {}
+      match_count_(NULL),
+      match_set_(NULL),
+      count_with_match_all_(false),
+      dfa_(NULL),
+      dfa_analysed_(false),
+      shift_and_(NULL),
+      shift_and_analysed_(false),
+      anywhere_with_shift_and_(false),
+      submatch_resolver_(NULL),
+      submatch_resolver_analysed_(false),
+      code_match_full_(NULL),
+      code_match_anywhere_(NULL),
+      code_match_first_(NULL),
+      code_match_all_(NULL),
+      code_match_count_(NULL),
+      code_match_set_(NULL),
+      compiled_(0) {}
   ~RegexpInfo();
 
   void set_regexp(Regexp* regexp) { regexp_ = regexp; }
@@ -565,6 +657,12 @@ class RegexpInfo {
     return ff_list_.size() > 1 || ff_reduced_;
   }
 
+  // The analysis of the regexp populates the regexp lists below. It does not
+  // depend on the match type, so it is only done once (see AnalyseRegexp) and
+  // shared by the code generated for all match types.
+  bool analysed() const { return analysed_; }
+  void set_analysed(bool analysed) { analysed_ = analysed; }
+
   // Debugging
   void print_re_list();
 
@@ -585,6 +683,7 @@ class RegexpInfo {
   vector<Regexp*>* ff_list() { return &ff_list_; }
   vector<MatchingRegexp*>* re_matching_list() { return &re_matching_list_; }
   vector<ControlRegexp*>* re_control_list() { return &re_control_list_; }
+  vector<Repetition*>* re_counted_list() { return &re_counted_list_; }
   bool re_control_list_topo_sorted() const {
     return re_control_list_topo_sorted_;
   }
@@ -592,6 +691,8 @@ class RegexpInfo {
     re_control_list_topo_sorted_ = sorted;
   }
   vector<Regexp*>* extra_allocated() { return &extra_allocated_; }
+  // For sets of regexps, the exit state of each regexp of the set.
+  vector<int>* set_exit_states() { return &set_exit_states_; }
 
   inline bool ff_reduced() const { return ff_reduced_; }
   inline void set_ff_reduced(bool ff_reduced) { ff_reduced_ = ff_reduced; }
@@ -611,12 +712,20 @@ class RegexpInfo {
   // Cycles should be avoided in the control regexp lists. When no cycles are
   // present, better code can be generated.
   vector<ControlRegexp*> re_control_list_;
+  // Repetitions of a single character regexp, from 1 to max_rep times, for
+  // which the generated code counts the characters matched. Their sub regexp is
+  // not listed elsewhere. See RegexpLister::ListCountedRepetition.
+  vector<Repetition*> re_counted_list_;
   bool re_control_list_topo_sorted_;
   // This is used to store regexp allocated later than parsing time, and hence
   // not present in the regexp tree (which root is regexp_).
   vector<Regexp*> extra_allocated_;
+  // For sets of regexps, the root regexp is an alternation of the regexps of
+  // the set. Each of them has its own exit state.
+  vector<int> set_exit_states_;
 
   bool ff_reduced_;
+  bool analysed_;
 
  private:
   // The compiled functions.
@@ -624,15 +733,44 @@ class RegexpInfo {
   MatchAnywhereFunc match_anywhere_;
   MatchFirstFunc match_first_;
   MatchAllFunc match_all_;
-  // Their associated virtual memory.
-  VirtualMemory* vmem_match_full_;
-  VirtualMemory* vmem_match_anywhere_;
-  VirtualMemory* vmem_match_first_;
-  VirtualMemory* vmem_match_all_;
+  MatchCountFunc match_count_;
+  MatchSetFunc match_set_;
+  // Set when no kMatchCount code can be generated for the regexp. Matches are
+  // then counted using the kMatchAll code.
+  bool count_with_match_all_;
+  // The DFA tier, used before the generated code when available.
+  LazyDFA* dfa_;
+  // Set once the regexp has been checked for the DFA tier.
+  bool dfa_analysed_;
+  // The bit-parallel tier. When available, it replaces the kMatchFull code.
+  ShiftAnd* shift_and_;
+  // Set once the regexp has been checked for the bit-parallel tier.
+  bool shift_and_analysed_;
+  // Set when the bit-parallel tier replaces the kMatchAnywhere code.
+  bool anywhere_with_shift_and_;
+  // Locates the groups in the matches. Built on first use, with
+  // compile_mutex_ held.
+  SubmatchResolver* submatch_resolver_;
+  // Set once submatch_resolver_ is built. Like compiled_, it is checked
+  // without holding compile_mutex_.
+  atomic<bool> submatch_resolver_analysed_;
+  // Their associated code.
+  CodeBlock* code_match_full_;
+  CodeBlock* code_match_anywhere_;
+  CodeBlock* code_match_first_;
+  CodeBlock* code_match_all_;
+  CodeBlock* code_match_count_;
+  CodeBlock* code_match_set_;
+  // Bit n is set once the code for match type n is available. Matching
+  // functions check it before using the fields above, which are only written
+  // with compile_mutex_ held.
+  atomic<unsigned> compiled_;
+  mutex compile_mutex_;
 
   DISALLOW_COPY_AND_ASSIGN(RegexpInfo);
 
   friend Regej;
+  friend RegejSet;
 };
 
 
@@ -643,6 +781,14 @@ bool regexp_cmp_exit_state(Regexp* r1, Regexp* r2);
 
 bool all_regexps_start_at(int entry_state, vector<Regexp*> *regexps);
 
+// Returns the maximum number of characters a match of the regexp can span, or
+// kMaxUInt if it is not bounded.
+unsigned regexp_max_match_length(Regexp* regexp);
+// Returns true if a match of the regexp can contain the character c.
+bool regexp_can_match_char(Regexp* regexp, char c);
+// Returns true if the regexp contains a sub-regexp of the given type.
+bool regexp_contains(Regexp* regexp, RegexpType type);
+
 // Returns true if the list of regexps could be topoligically sorted, or false if
 // it couldn't (ie. if there is a cycle).
 bool SortTopoligcal(vector<Regexp*> *regexps);
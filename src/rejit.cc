@@ -12,12 +12,21 @@
 // You should have received a copy of the GNU General Public License
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
+#include <algorithm>
+#include <cstring>
 #include <iostream>
+#include <thread>
 
 #include "rejit.h"
 #include "checks.h"
 #include "parser.h"
 #include "codegen.h"
+#include "cache.h"
+#include "code-arena.h"
+#include "dfa.h"
+#include "shift-and.h"
+#include "snapshot.h"
+#include "submatch.h"
 
 #include "macro-assembler.h"
 
@@ -29,14 +38,66 @@ namespace rejit {
 #define __ masm->
 
 
+// Analyse where a text can be split, so that matching the pieces separately
+// finds the same matches as matching the whole text.
+//  - If the regexp cannot match a newline, after any newline.
+//  - If the regexp has a bounded length and does not use '^', anywhere, as long
+//    as the max_match_length characters following the split point are
+//    available when matching the piece before it.
+static void AnalyseSplitPoints(Regexp* regexp,
+                               unsigned* max_match_length,
+                               bool* split_on_newlines,
+                               bool* split_anywhere) {
+  *max_match_length = regexp_max_match_length(regexp);
+  *split_on_newlines = !regexp_can_match_char(regexp, '\n');
+  // Otherwise the pieces must start at the beginning of a line for '^' to
+  // behave as it would on the whole text.
+  *split_anywhere = *max_match_length != kMaxUInt &&
+    !regexp_contains(regexp, kStartOfLine);
+}
+
+
+char* MatchContext::GetFrame(const CodeBlock* code) {
+  size_t size = code->frame_size();
+  size_t clean_size = code->frame_clean_size();
+  if (buffer_.size() * sizeof(uint64_t) < size) {
+    buffer_.assign(RoundUp(size, sizeof(uint64_t)) / sizeof(uint64_t), 0);
+    clean_size_ = buffer_.size() * sizeof(uint64_t);
+  }
+  char* end = reinterpret_cast<char*>(buffer_.data() + buffer_.size());
+  if (clean_size_ < clean_size) {
+    memset(end - clean_size, 0, clean_size - clean_size_);
+    clean_size_ = clean_size;
+  }
+  // The code leaves the part it expects zeroed as it found it, but not the
+  // part below.
+  if (size > clean_size) {
+    clean_size_ = clean_size;
+  }
+  return end - size;
+}
+
+
+// The context used when none is provided.
+static MatchContext* ThreadContext() {
+  static thread_local MatchContext context;
+  return &context;
+}
+
+
+static shared_ptr<Regej> GetCachedRegej(const char* regexp,
+                                        MatchType match_type) {
+  return RegejCache::Instance()->Get(regexp, ERE, match_type);
+}
+
+
 bool MatchFull(const char* regexp, const string& text) {
   return MatchFull(regexp, text.c_str(), text.size());
 }
 
 
 bool MatchFull(const char* regexp, const char* text, size_t text_size) {
-  Regej re(regexp);
-  return re.MatchFull(text, text_size);
+  return GetCachedRegej(regexp, kMatchFull)->MatchFull(text, text_size);
 }
 
 
@@ -46,8 +107,7 @@ bool MatchAnywhere(const char* regexp, const string& text) {
 
 
 bool MatchAnywhere(const char* regexp, const char* text, size_t text_size) {
-  Regej re(regexp);
-  return re.MatchAnywhere(text, text_size);
+  return GetCachedRegej(regexp, kMatchAnywhere)->MatchAnywhere(text, text_size);
 }
 
 
@@ -58,8 +118,7 @@ bool MatchFirst(const char* regexp, const string& text, Match* match) {
 
 bool MatchFirst(const char* regexp, const char* text, size_t text_size,
                 Match* match) {
-  Regej re(regexp);
-  return re.MatchFirst(text, text_size, match);
+  return GetCachedRegej(regexp, kMatchFirst)->MatchFirst(text, text_size, match);
 }
 
 
@@ -71,8 +130,20 @@ size_t MatchAll(const char* regexp, const string& text,
 
 size_t MatchAll(const char* regexp, const char* text, size_t text_size,
                 std::vector<struct Match>* matches) {
-  Regej re(regexp);
-  return re.MatchAll(text, text_size, matches);
+  return GetCachedRegej(regexp, kMatchAll)->MatchAll(text, text_size, matches);
+}
+
+
+size_t MatchAll(const char* regexp, const char* text, size_t text_size,
+                Match* matches, size_t capacity) {
+  return GetCachedRegej(regexp, kMatchAll)->MatchAll(text, text_size,
+                                                     matches, capacity);
+}
+
+
+size_t MatchAll(const char* regexp, const char* text, size_t text_size,
+                vector<CompactMatch>* matches) {
+  return GetCachedRegej(regexp, kMatchAll)->MatchAll(text, text_size, matches);
 }
 
 
@@ -82,8 +153,7 @@ size_t MatchAllCount(const char* regexp, const string& text) {
 
 
 size_t MatchAllCount(const char* regexp, const char* text, size_t text_size) {
-  Regej re(regexp);
-  return re.MatchAllCount(text, text_size);
+  return GetCachedRegej(regexp, kMatchCount)->MatchAllCount(text, text_size);
 }
 
 
@@ -113,26 +183,107 @@ void Replace(vector<Match>* to_replace, string& text, const string& with) {
 
 
 bool ReplaceFirst(const char* regexp, string& text, const string& with) {
-  Regej re(regexp);
-  return re.ReplaceFirst(text, with);
+  return GetCachedRegej(regexp, kMatchFirst)->ReplaceFirst(text, with);
 }
 
 
 size_t ReplaceAll(const char* regexp, string& text, const string& with) {
-  Regej re(regexp);
-  return re.ReplaceAll(text, with);
+  return GetCachedRegej(regexp, kMatchAll)->ReplaceAll(text, with);
+}
+
+
+// Returns the last '\n' in [begin, end), or NULL if there is none.
+static const char* FindLastNewline(const char* begin, const char* end) {
+#ifdef REJIT_TARGET_PLATFORM_LINUX
+  return reinterpret_cast<const char*>(memrchr(begin, '\n', end - begin));
+#else
+  for (const char* c = end; c > begin; c--) {
+    if (c[-1] == '\n') {
+      return c - 1;
+    }
+  }
+  return NULL;
+#endif
+}
+
+
+Match EnclosingLines(const char* text, size_t text_size, Match match) {
+  const char* end = text + text_size;
+  // A match ending with a newline does not extend to the next line.
+  const char* last = match.end > match.begin ? match.end - 1 : match.end;
+  const char* eol =
+    reinterpret_cast<const char*>(memchr(last, '\n', end - last));
+  const char* sol = FindLastNewline(text, match.begin);
+  Match lines = {sol != NULL ? sol + 1 : text, eol != NULL ? eol : end};
+  return lines;
+}
+
+
+size_t CountNewlines(const char* text, size_t text_size) {
+  const char* c = text;
+  const char* end = text + text_size;
+  size_t n_newlines = 0;
+  while (c < end && !IsAligned(OffsetFrom(c), kPointerSize)) {
+    n_newlines += *c++ == '\n';
+  }
+  // Process eight characters at a time. The characters equal to '\n' are
+  // flagged with a 1 in their byte of 'flags'. The flags of up to 255 words
+  // are accumulated before summing the bytes, in 16-bit lanes to not overflow.
+  const uint64_t kOnes = 0x0101010101010101ULL;
+  const uint64_t kNewlines = kOnes * '\n';
+  const uint64_t kLowBits = 0x7f7f7f7f7f7f7f7fULL;
+  const uint64_t kEvenBytes = 0x00ff00ff00ff00ffULL;
+  const uint64_t kLaneOnes = 0x0001000100010001ULL;
+  while (end - c >= kPointerSize) {
+    size_t n_words = min<size_t>((end - c) / kPointerSize, 255);
+    uint64_t flags = 0;
+    for (size_t i = 0; i < n_words; i++, c += kPointerSize) {
+      uint64_t x = *reinterpret_cast<const uint64_t*>(c) ^ kNewlines;
+      // The top bit of a byte is set iff the byte of x is zero.
+      flags += (~(((x & kLowBits) + kLowBits) | x) & ~kLowBits) >> 7;
+    }
+    flags = (flags & kEvenBytes) + ((flags >> 8) & kEvenBytes);
+    n_newlines += (flags * kLaneOnes) >> 48;
+  }
+  while (c < end) {
+    n_newlines += *c++ == '\n';
+  }
+  return n_newlines;
+}
+
+
+CacheStats GetCacheStats() {
+  return RegejCache::Instance()->stats();
 }
 
 
-Regej::Regej(const char* regexp) : regexp_(regexp), rinfo_(new RegexpInfo()) {
+void SetCacheCapacity(size_t capacity) {
+  RegejCache::Instance()->set_capacity(capacity);
+}
+
+
+void ClearCache() {
+  RegejCache::Instance()->Clear();
+}
+
+
+CodeArenaStats GetCodeArenaStats() {
+  return CodeArena::Instance()->stats();
+}
+
+
+Regej::Regej(const char* regexp, unsigned options)
+  : regexp_(regexp), options_(options), rinfo_(new RegexpInfo()) {
   Parser parser;
+  parser.set_ignore_case(options_ & kIgnoreCase);
   status_ = parser.Parse(ERE, rinfo_, regexp_);
 }
 
 
-Regej::Regej(const string& regexp) :
-  regexp_(regexp.c_str()), rinfo_(new RegexpInfo()) {
+Regej::Regej(const string& regexp, unsigned options)
+  : regexp_(regexp.c_str()), options_(options), rinfo_(new RegexpInfo()) {
   Parser parser;
+  parser.set_ignore_case(options_ & kIgnoreCase);
   status_ = parser.Parse(ERE, rinfo_, regexp_);
 }
 
@@ -148,10 +299,18 @@ bool Regej::MatchFull(const string& text) {
 
 
 bool Regej::MatchFull(const char* text, size_t text_size) {
-  if (!rinfo_->match_full_) {
-    if (!Compile(kMatchFull)) return false;
+  return MatchFull(text, text_size, ThreadContext());
+}
+
+
+bool Regej::MatchFull(const char* text, size_t text_size,
+                      MatchContext* context) {
+  if (!EnsureCompiled(kMatchFull)) return false;
+  if (rinfo_->shift_and_) {
+    return rinfo_->shift_and_->MatchFull(text, text_size);
   }
-  return rinfo_->match_full_(text, text_size);
+  return rinfo_->match_full_(text, text_size,
+                             context->GetFrame(rinfo_->code_match_full_));
 }
 
 
@@ -161,10 +320,24 @@ bool Regej::MatchAnywhere(const string& text) {
 
 
 bool Regej::MatchAnywhere(const char* text, size_t text_size) {
-  if (!rinfo_->match_anywhere_) {
-    if (!Compile(kMatchAnywhere)) return false;
+  return MatchAnywhere(text, text_size, ThreadContext());
+}
+
+
+bool Regej::MatchAnywhere(const char* text, size_t text_size,
+                          MatchContext* context) {
+  if (!EnsureCompiled(kMatchAnywhere)) return false;
+  if (rinfo_->anywhere_with_shift_and_) {
+    return rinfo_->shift_and_->MatchAnywhere(text, text_size);
   }
-  return rinfo_->match_anywhere_(text, text_size);
+  if (FLAG_use_dfa && rinfo_->dfa_) {
+    LazyDFA::Result result = rinfo_->dfa_->MatchAnywhere(text, text_size);
+    if (result != LazyDFA::kFailed) {
+      return result == LazyDFA::kMatch;
+    }
+  }
+  char* frame = context->GetFrame(rinfo_->code_match_anywhere_);
+  return rinfo_->match_anywhere_(text, text_size, frame);
 }
 
 
@@ -174,10 +347,21 @@ bool Regej::MatchFirst(const string& text, Match* match) {
 
 
 bool Regej::MatchFirst(const char* text, size_t text_size, Match* match) {
-  if (!rinfo_->match_first_) {
-    if (!Compile(kMatchFirst)) return false;
+  return MatchFirst(text, text_size, match, ThreadContext());
+}
+
+
+bool Regej::MatchFirst(const char* text, size_t text_size, Match* match,
+                       MatchContext* context) {
+  if (!EnsureCompiled(kMatchFirst)) return false;
+  if (FLAG_use_dfa && rinfo_->dfa_) {
+    LazyDFA::Result result = rinfo_->dfa_->MatchFirst(text, text_size, match);
+    if (result != LazyDFA::kFailed) {
+      return result == LazyDFA::kMatch;
+    }
   }
-  return rinfo_->match_first_(text, text_size, match);
+  return rinfo_->match_first_(text, text_size, match,
+                              context->GetFrame(rinfo_->code_match_first_));
 }
 
 
@@ -187,10 +371,178 @@ size_t Regej::MatchAll(const string& text, vector<Match>* matches) {
 
 
 size_t Regej::MatchAll(const char* text, size_t text_size, vector<Match>* matches) {
-  if (!rinfo_->match_all_) {
-    if (!Compile(kMatchAll)) return 0;
+  if (!EnsureCompiled(kMatchAll)) return 0;
+  Match buffer[kMatchBufferLength];
+  MatchBuffer match_buffer = {buffer, buffer, buffer + kMatchBufferLength,
+                              matches, NULL, text};
+  if (FLAG_use_dfa && rinfo_->dfa_) {
+    size_t n_matches = matches->size();
+    if (rinfo_->dfa_->MatchAll(text, text_size, &match_buffer) !=
+        LazyDFA::kFailed) {
+      MatchAllFlush(&match_buffer);
+      return matches->size();
+    }
+    // Drop the matches found before the DFA gave up.
+    matches->resize(n_matches);
+    match_buffer.cursor = match_buffer.base;
+  }
+  rinfo_->match_all_(text, text_size, &match_buffer,
+                     ThreadContext()->GetFrame(rinfo_->code_match_all_));
+  MatchAllFlush(&match_buffer);
+  return matches->size();
+}
+
+
+size_t Regej::MatchAll(const char* text, size_t text_size,
+                       Match* matches, size_t capacity) {
+  if (!EnsureCompiled(kMatchAll)) return 0;
+  MatchBuffer match_buffer = {matches, matches, matches + capacity,
+                              NULL, NULL, text};
+  if (FLAG_use_dfa && rinfo_->dfa_) {
+    if (rinfo_->dfa_->MatchAll(text, text_size, &match_buffer) !=
+        LazyDFA::kFailed) {
+      return match_buffer.cursor - match_buffer.base;
+    }
+    match_buffer.cursor = match_buffer.base;
+  }
+  rinfo_->match_all_(text, text_size, &match_buffer,
+                     ThreadContext()->GetFrame(rinfo_->code_match_all_));
+  return match_buffer.cursor - match_buffer.base;
+}
+
+
+size_t Regej::MatchAll(const char* text, size_t text_size,
+                       vector<CompactMatch>* matches) {
+  if (text_size > kMaxCompactTextSize || !EnsureCompiled(kMatchAll)) return 0;
+  // The matches are found as pointers in a small buffer, and only converted to
+  // offsets when flushed to the vector.
+  Match buffer[kMatchBufferLength];
+  MatchBuffer match_buffer = {buffer, buffer, buffer + kMatchBufferLength,
+                              NULL, matches, text};
+  if (FLAG_use_dfa && rinfo_->dfa_) {
+    size_t n_matches = matches->size();
+    if (rinfo_->dfa_->MatchAll(text, text_size, &match_buffer) !=
+        LazyDFA::kFailed) {
+      MatchAllFlush(&match_buffer);
+      return matches->size();
+    }
+    // Drop the matches found before the DFA gave up.
+    matches->resize(n_matches);
+    match_buffer.cursor = match_buffer.base;
+  }
+  rinfo_->match_all_(text, text_size, &match_buffer,
+                     ThreadContext()->GetFrame(rinfo_->code_match_all_));
+  MatchAllFlush(&match_buffer);
+  return matches->size();
+}
+
+
+size_t Regej::MatchAll(const char* text, size_t text_size,
+                       vector<Match>* matches, unsigned n_threads) {
+  if (status() != RejitSuccess) {
+    return 0;
+  }
+  unsigned max_match_length;
+  bool split_on_newlines, split_anywhere;
+  AnalyseSplitPoints(rinfo_->regexp(), &max_match_length,
+                     &split_on_newlines, &split_anywhere);
+  if (n_threads <= 1 || text_size < 2 * kMinParallelChunkSize ||
+      (!split_on_newlines && !split_anywhere)) {
+    return MatchAll(text, text_size, matches);
+  }
+  n_threads = min(static_cast<size_t>(n_threads),
+                  text_size / kMinParallelChunkSize);
+  // Compile before the threads use the code.
+  if (!EnsureCompiled(kMatchAll)) return 0;
+
+  const char* text_end = text + text_size;
+  vector<const char*> limits;
+  limits.push_back(text);
+  for (unsigned i = 1; i < n_threads; i++) {
+    const char* limit = text + i * (text_size / n_threads);
+    if (!split_anywhere) {
+      limit = reinterpret_cast<const char*>(
+          memchr(limit, '\n', text_end - limit));
+      if (limit == NULL) {
+        break;
+      }
+      limit++;
+    }
+    if (limit > limits.back() && limit < text_end) {
+      limits.push_back(limit);
+    }
+  }
+  limits.push_back(text_end);
+  size_t n_chunks = limits.size() - 1;
+
+  // Matches in chunk i start in [limits[i], limits[i + 1]). When splitting
+  // anywhere, the text scanned extends past the end of the chunk so that
+  // matches starting in the chunk are entirely found.
+  auto scan_end = [&](size_t chunk) {
+    const char* end = limits[chunk + 1];
+    if (split_anywhere && static_cast<size_t>(text_end - end) > max_match_length) {
+      return end + max_match_length;
+    }
+    return split_anywhere ? text_end : end;
+  };
+  auto scan = [&](size_t chunk, const char* from, vector<Match>* chunk_matches) {
+    chunk_matches->clear();
+    MatchAll(from, scan_end(chunk) - from, chunk_matches);
+    // A match of length 0 can start at the end of the text.
+    if (chunk == n_chunks - 1) {
+      return;
+    }
+    while (!chunk_matches->empty() &&
+           chunk_matches->back().begin >= limits[chunk + 1]) {
+      chunk_matches->pop_back();
+    }
+  };
+
+  vector<vector<Match> > chunk_matches(n_chunks);
+  vector<thread> threads;
+  for (size_t i = 1; i < n_chunks; i++) {
+    threads.push_back(thread(scan, i, limits[i], &chunk_matches[i]));
+  }
+  scan(0, limits[0], &chunk_matches[0]);
+  for (size_t i = 0; i < threads.size(); i++) {
+    threads[i].join();
+  }
+
+  // Merge the matches. Each chunk was scanned as if no match from the previous
+  // chunk extended into it. Matches of a chunk starting before the end of the
+  // last match merged are discarded. If one of them extends past the end of the
+  // last match merged, the chunk needs to be scanned again from there.
+  size_t n_existing = matches->size();
+  const char* last_end = NULL;
+  for (size_t i = 0; i < n_chunks; i++) {
+    vector<Match>* current = &chunk_matches[i];
+    if (last_end != NULL && last_end > limits[i]) {
+      if (last_end >= limits[i + 1]) {
+        continue;
+      }
+      vector<Match>::iterator it;
+      for (it = current->begin();
+           it < current->end() && (*it).begin < last_end;
+           it++) {}
+      if (it != current->begin() && (*(it - 1)).end > last_end) {
+        scan(i, last_end, current);
+      } else {
+        current->erase(current->begin(), it);
+      }
+    }
+    vector<Match>::iterator it;
+    for (it = current->begin(); it < current->end(); it++) {
+      // See MatchAllAppendFilter for matches of length 0.
+      if (it == current->begin() && last_end != NULL &&
+          (*it).begin == (*it).end && (*it).begin == last_end) {
+        continue;
+      }
+      matches->push_back(*it);
+    }
+    if (matches->size() > n_existing) {
+      last_end = matches->back().end;
+    }
   }
-  rinfo_->match_all_(text, text_size, matches);
   return matches->size();
 }
 
@@ -201,10 +553,135 @@ size_t Regej::MatchAllCount(const string& text) {
 
 
 size_t Regej::MatchAllCount(const char* text, size_t text_size) {
-  // TODO: Test if using a separate function not registering matches in a vector
-  // is faster.
+  return MatchAllCount(text, text_size, ThreadContext());
+}
+
+
+size_t Regej::MatchAllCount(const char* text, size_t text_size,
+                            MatchContext* context) {
+  if (!EnsureCompiled(kMatchCount)) return 0;
+  if (rinfo_->count_with_match_all_) {
+    vector<Match> matches;
+    return MatchAll(text, text_size, &matches);
+  }
+  size_t count =
+    rinfo_->match_count_(text, text_size,
+                         context->GetFrame(rinfo_->code_match_count_));
+  if (count == kMatchCountOverflow) {
+    vector<Match> matches;
+    return MatchAll(text, text_size, &matches);
+  }
+  return count;
+}
+
+
+// Number of lines in [begin, end), as defined for Regej::MatchAnywhereLines.
+static size_t CountLines(const char* begin, const char* end) {
+  if (begin == end) {
+    return 0;
+  }
+  return CountNewlines(begin, end - begin) + (end[-1] != '\n');
+}
+
+
+size_t Regej::MatchAnywhereLines(const char* text, size_t text_size,
+                                 vector<bool>* matched) {
+  matched->clear();
+  if (status() != RejitSuccess) {
+    return 0;
+  }
+  const char* end = text + text_size;
+  // Start of the lines after the last line matching.
+  const char* rest = text;
+  size_t n_matched = 0;
+  RegejLines lines(this, text, text_size);
+  Match line;
+  while (lines.Next(&line)) {
+    matched->resize(lines.line_number(), false);
+    matched->push_back(true);
+    n_matched++;
+    rest = min(line.end + 1, end);
+  }
+  matched->resize(matched->size() + CountLines(rest, end), false);
+  return n_matched;
+}
+
+
+static void ResolveGroups(SubmatchResolver* resolver,
+                          const char* text, size_t text_size,
+                          Match match, vector<Match>* groups) {
+  if (!resolver->Resolve(text, text_size, match, groups)) {
+    // The program of the resolver was too large to be built. The match itself
+    // is still valid.
+    Match none = {NULL, NULL};
+    groups->assign(resolver->n_groups() + 1, none);
+    (*groups)[0] = match;
+  }
+}
+
+
+bool Regej::MatchFirst(const string& text, vector<Match>* groups) {
+  return MatchFirst(text.c_str(), text.size(), groups);
+}
+
+
+bool Regej::MatchFirst(const char* text, size_t text_size,
+                       vector<Match>* groups) {
+  Match match;
+  SubmatchResolver* resolver = GetSubmatchResolver();
+  groups->clear();
+  if (resolver == NULL || !MatchFirst(text, text_size, &match)) {
+    return false;
+  }
+  ResolveGroups(resolver, text, text_size, match, groups);
+  return true;
+}
+
+
+size_t Regej::MatchAll(const string& text, vector<vector<Match> >* groups) {
+  return MatchAll(text.c_str(), text.size(), groups);
+}
+
+
+size_t Regej::MatchAll(const char* text, size_t text_size,
+                       vector<vector<Match> >* groups) {
+  SubmatchResolver* resolver = GetSubmatchResolver();
+  if (resolver == NULL) return 0;
+  vector<Match> matches;
+  MatchAll(text, text_size, &matches);
+  size_t n_existing = groups->size();
+  groups->resize(n_existing + matches.size());
+  for (size_t i = 0; i < matches.size(); i++) {
+    ResolveGroups(resolver, text, text_size, matches[i],
+                  &(*groups)[n_existing + i]);
+  }
+  return groups->size();
+}
+
+
+SubmatchResolver* Regej::GetSubmatchResolver() {
+  if (status() != RejitSuccess) {
+    return NULL;
+  }
+  if (!rinfo_->submatch_resolver_analysed_.load(memory_order_acquire)) {
+    lock_guard<mutex> lock(rinfo_->compile_mutex_);
+    if (!rinfo_->submatch_resolver_analysed_.load(memory_order_relaxed)) {
+      rinfo_->submatch_resolver_ =
+        SubmatchResolver::New(regexp_, options_ & kIgnoreCase);
+      rinfo_->submatch_resolver_analysed_.store(true, memory_order_release);
+    }
+  }
+  return rinfo_->submatch_resolver_;
+}
+
+
+size_t Regej::MatchAllCount(const char* text, size_t text_size,
+                            unsigned n_threads) {
+  if (n_threads <= 1) {
+    return MatchAllCount(text, text_size);
+  }
   vector<Match> matches;
-  return MatchAll(text, text_size, &matches);
+  return MatchAll(text, text_size, &matches, n_threads);
 }
 
 
@@ -227,43 +704,537 @@ size_t Regej::ReplaceAll(string& text, const string& with) {
 
 
 bool Regej::Compile(MatchType match_type) {
-  if (status() != RejitSuccess) {
+  // kMatchSet code is only generated for RegejSet.
+  if (status() != RejitSuccess || match_type == kMatchSet) {
     return false;
   }
 
+  lock_guard<mutex> lock(rinfo_->compile_mutex_);
+  bool success = IsCompiled(match_type) || GenerateCode(match_type);
+  PublishCompiled();
+  return success;
+}
+
+
+void Regej::PublishCompiled() {
+  // Generating the code for a match type can make others available. See
+  // IsCompiled.
+  unsigned compiled = 0;
+  for (int i = kMatchFull; i < kMatchSet; i++) {
+    compiled |= IsCompiled(static_cast<MatchType>(i)) << i;
+  }
+  rinfo_->compiled_.store(compiled, memory_order_release);
+}
+
+
+bool Regej::EnsureCompiled(MatchType match_type) {
+  return (rinfo_->compiled_.load(memory_order_acquire) & (1 << match_type)) ||
+    Compile(match_type);
+}
+
+
+bool Regej::GenerateCode(MatchType match_type) {
+  if (FLAG_use_shift_and && !rinfo_->shift_and_analysed_ &&
+      (match_type == kMatchFull || match_type == kMatchAnywhere)) {
+    rinfo_->shift_and_ = ShiftAnd::New(rinfo_);
+    rinfo_->shift_and_analysed_ = true;
+  }
+  if (match_type == kMatchFull && rinfo_->shift_and_) {
+    // No code is needed.
+    return true;
+  }
+  if (match_type == kMatchAnywhere && rinfo_->shift_and_) {
+    // As for the DFA tier, the generated code is faster when it can
+    // fast-forward. Otherwise the bit-parallel tier is used. It never gives up,
+    // so no code is needed. The analysis finds the fast-forward elements.
+    AnalyseRegexp(rinfo_, false);
+    if (!FLAG_use_fast_forward || rinfo_->ff_list()->empty()) {
+      rinfo_->anywhere_with_shift_and_ = true;
+      return true;
+    }
+  }
+
   Codegen codegen;
-  VirtualMemory* vmem = codegen.Compile(rinfo_, match_type);
+  CodeBlock* code = codegen.Compile(rinfo_, match_type);
+
+  if (code != NULL && FLAG_use_dfa && !rinfo_->dfa_analysed_ &&
+      (match_type == kMatchAnywhere ||
+       match_type == kMatchFirst ||
+       match_type == kMatchAll)) {
+    // When fast-forward elements are available, the generated code skips most
+    // of the text faster than the DFA can scan it. Otherwise the DFA replaces
+    // the state ring. The generated code is kept for when the DFA gives up.
+    if (!FLAG_use_fast_forward || rinfo_->ff_list()->empty()) {
+      rinfo_->dfa_ = LazyDFA::New(rinfo_);
+    }
+    rinfo_->dfa_analysed_ = true;
+  }
 
+  if (code == NULL) {
+    if (match_type == kMatchCount) {
+      // The regexp cannot be counted without registering the matches. See
+      // Codegen::Compile.
+      rinfo_->count_with_match_all_ = true;
+      return rinfo_->match_all_ || GenerateCode(kMatchAll);
+    }
+    return false;
+  }
+
+  SetCode(match_type, code);
+  return true;
+}
+
+
+void Regej::SetCode(MatchType match_type, CodeBlock* code) {
   switch (match_type) {
     case kMatchFull:
-      rinfo_->vmem_match_full_ = vmem;
+      rinfo_->code_match_full_ = code;
       rinfo_->match_full_ =
-        FUNCTION_CAST<MatchFullFunc>(Address(vmem->address()));
+        FUNCTION_CAST<MatchFullFunc>(Address(code->address()));
       break;
 
     case kMatchAnywhere:
-      rinfo_->vmem_match_anywhere_ = vmem;
+      rinfo_->code_match_anywhere_ = code;
       rinfo_->match_anywhere_ =
-        FUNCTION_CAST<MatchAnywhereFunc>(Address(vmem->address()));
+        FUNCTION_CAST<MatchAnywhereFunc>(Address(code->address()));
       break;
 
     case kMatchFirst:
-      rinfo_->vmem_match_first_ = vmem;
+      rinfo_->code_match_first_ = code;
       rinfo_->match_first_ =
-        FUNCTION_CAST<MatchFirstFunc>(Address(vmem->address()));
+        FUNCTION_CAST<MatchFirstFunc>(Address(code->address()));
       break;
 
     case kMatchAll:
-      rinfo_->vmem_match_all_ = vmem;
+      rinfo_->code_match_all_ = code;
       rinfo_->match_all_ =
-        FUNCTION_CAST<MatchAllFunc>(Address(vmem->address()));
+        FUNCTION_CAST<MatchAllFunc>(Address(code->address()));
+      break;
+
+    case kMatchCount:
+      rinfo_->code_match_count_ = code;
+      rinfo_->match_count_ =
+        FUNCTION_CAST<MatchCountFunc>(Address(code->address()));
       break;
 
     default:
       UNREACHABLE();
   }
+}
+
+
+bool Regej::IsCompiled(MatchType match_type) const {
+  switch (match_type) {
+    case kMatchFull:
+      return rinfo_->match_full_ || rinfo_->shift_and_;
+    case kMatchAnywhere:
+      return rinfo_->match_anywhere_ || rinfo_->anywhere_with_shift_and_;
+    case kMatchFirst:
+      return rinfo_->match_first_;
+    case kMatchAll:
+      return rinfo_->match_all_;
+    case kMatchCount:
+      return rinfo_->match_count_ ||
+        (rinfo_->count_with_match_all_ && rinfo_->match_all_);
+    default:
+      return false;
+  }
+}
+
+
+bool Regej::CompileAll(unsigned match_types) {
+  bool success = true;
+  for (int i = kMatchFull; i < kMatchSet; i++) {
+    MatchType match_type = static_cast<MatchType>(i);
+    if (match_types & (1 << i)) {
+      success &= EnsureCompiled(match_type);
+    }
+  }
+  return success;
+}
+
+
+// Flags describing how the match types are handled, saved in snapshots.
+enum SnapshotFlags {
+  kSnapshotShiftAnd            = 1 << 0,
+  kSnapshotShiftAndAnalysed    = 1 << 1,
+  kSnapshotAnywhereWithShiftAnd = 1 << 2,
+  kSnapshotCountWithMatchAll   = 1 << 3,
+  kSnapshotDFA                 = 1 << 4,
+  kSnapshotDFAAnalysed         = 1 << 5
+};
+
+
+CodeBlock* Regej::GetCode(MatchType match_type) const {
+  switch (match_type) {
+    case kMatchFull:     return rinfo_->code_match_full_;
+    case kMatchAnywhere: return rinfo_->code_match_anywhere_;
+    case kMatchFirst:    return rinfo_->code_match_first_;
+    case kMatchAll:      return rinfo_->code_match_all_;
+    case kMatchCount:    return rinfo_->code_match_count_;
+    default:
+      UNREACHABLE();
+      return NULL;
+  }
+}
+
+
+bool Regej::Serialize(string* snapshot) {
+  if (status() != RejitSuccess) {
+    return false;
+  }
+  string buffer;
+  SnapshotWriter writer(&buffer);
+  lock_guard<mutex> lock(rinfo_->compile_mutex_);
+
+  writer.WriteUInt64(kSnapshotMagic);
+  writer.WriteUInt64(kSnapshotVersion);
+  writer.WriteUInt64(SnapshotFingerprint());
+  writer.WriteString(regexp_, strlen(regexp_));
+  writer.WriteUInt64(options_);
+  // The DFA and bit-parallel tiers are not saved. They are rebuilt from the
+  // regexp when the snapshot is loaded.
+  uint64_t flags =
+    (rinfo_->shift_and_ ? kSnapshotShiftAnd : 0) |
+    (rinfo_->shift_and_analysed_ ? kSnapshotShiftAndAnalysed : 0) |
+    (rinfo_->anywhere_with_shift_and_ ? kSnapshotAnywhereWithShiftAnd : 0) |
+    (rinfo_->count_with_match_all_ ? kSnapshotCountWithMatchAll : 0) |
+    (rinfo_->dfa_ ? kSnapshotDFA : 0) |
+    (rinfo_->dfa_analysed_ ? kSnapshotDFAAnalysed : 0);
+  writer.WriteUInt64(flags);
+  for (int i = kMatchFull; i < kMatchSet; i++) {
+    CodeBlock* code = GetCode(static_cast<MatchType>(i));
+    writer.WriteUInt64(code != NULL);
+    if (code != NULL && !writer.WriteCode(code)) {
+      return false;
+    }
+  }
+  snapshot->append(buffer);
+  return true;
+}
+
+
+bool Regej::Deserialize(const string& snapshot) {
+  return Deserialize(snapshot.data(), snapshot.size());
+}
+
+
+bool Regej::Deserialize(const char* snapshot, size_t snapshot_size) {
+  if (status() != RejitSuccess) {
+    return false;
+  }
+  SnapshotReader reader(snapshot, snapshot_size);
+  uint64_t magic, version, fingerprint, options, flags;
+  string regexp;
+  if (!reader.ReadUInt64(&magic) || magic != kSnapshotMagic ||
+      !reader.ReadUInt64(&version) || version != kSnapshotVersion ||
+      !reader.ReadUInt64(&fingerprint) ||
+      fingerprint != SnapshotFingerprint() ||
+      !reader.ReadString(&regexp) || regexp != regexp_ ||
+      !reader.ReadUInt64(&options) || options != options_ ||
+      !reader.ReadUInt64(&flags)) {
+    return false;
+  }
+
+  CodeBlock* codes[kMatchSet] = {NULL};
+  bool valid = true;
+  for (int i = kMatchFull; i < kMatchSet && valid; i++) {
+    uint64_t has_code;
+    valid = reader.ReadUInt64(&has_code) && has_code <= 1;
+    if (valid && has_code) {
+      codes[i] = reader.ReadCode();
+      valid = codes[i] != NULL;
+    }
+  }
+  valid = valid && reader.done();
+
+  lock_guard<mutex> lock(rinfo_->compile_mutex_);
+  if (valid && (flags & kSnapshotShiftAndAnalysed) &&
+      !rinfo_->shift_and_analysed_) {
+    if (flags & kSnapshotShiftAnd) {
+      rinfo_->shift_and_ = ShiftAnd::New(rinfo_);
+      valid = rinfo_->shift_and_ != NULL;
+    }
+    rinfo_->shift_and_analysed_ = true;
+  }
+  if (valid && (flags & kSnapshotDFAAnalysed) && !rinfo_->dfa_analysed_) {
+    if (flags & kSnapshotDFA) {
+      rinfo_->dfa_ = LazyDFA::New(rinfo_);
+    }
+    rinfo_->dfa_analysed_ = true;
+  }
+  for (int i = kMatchFull; i < kMatchSet; i++) {
+    MatchType match_type = static_cast<MatchType>(i);
+    if (valid && codes[i] != NULL && !IsCompiled(match_type)) {
+      SetCode(match_type, codes[i]);
+    } else {
+      delete codes[i];
+    }
+  }
+  if (valid) {
+    rinfo_->anywhere_with_shift_and_ |=
+      (flags & kSnapshotAnywhereWithShiftAnd) && rinfo_->shift_and_;
+    rinfo_->count_with_match_all_ |= (flags & kSnapshotCountWithMatchAll) != 0;
+  }
+  PublishCompiled();
+  return valid;
+}
+
+
+RegejSet::RegejSet(const vector<string>& regexps)
+  : regexps_(regexps),
+    regejs_(regexps.size(), NULL),
+    rinfo_(new RegexpInfo()),
+    status_(RejitSuccess),
+    matched_(regexps.size()) {
+  // Each regexp is parsed on its own, and the set is represented by the
+  // alternation of the regexps.
+  Alternation* set = new Alternation();
+  Parser parser;
+  vector<string>::iterator it;
+  for (it = regexps_.begin(); it < regexps_.end(); it++) {
+    status_ = parser.Parse(ERE, rinfo_, (*it).c_str());
+    if (status_ != RejitSuccess) {
+      break;
+    }
+    set->sub_regexps()->push_back(rinfo_->regexp());
+  }
+  rinfo_->set_regexp(set);
+}
+
+
+RegejSet::~RegejSet() {
+  vector<Regej*>::iterator it;
+  for (it = regejs_.begin(); it < regejs_.end(); it++) {
+    delete *it;
+  }
+  delete rinfo_;
+}
+
+
+bool RegejSet::Match(const string& text, vector<size_t>* matched) {
+  return Match(text.c_str(), text.size(), matched);
+}
+
+
+bool RegejSet::Match(const char* text, size_t text_size,
+                     vector<size_t>* matched) {
+  matched->clear();
+  if (!rinfo_->match_set_) {
+    if (!Compile()) return false;
+  }
+  fill(matched_.begin(), matched_.end(), 0);
+  rinfo_->match_set_(text, text_size, matched_.data(),
+                     ThreadContext()->GetFrame(rinfo_->code_match_set_));
+  for (size_t i = 0; i < matched_.size(); i++) {
+    if (matched_[i]) {
+      matched->push_back(i);
+    }
+  }
+  return !matched->empty();
+}
+
+
+size_t RegejSet::MatchAll(const string& text, vector<SetMatch>* matches) {
+  return MatchAll(text.c_str(), text.size(), matches);
+}
+
+
+size_t RegejSet::MatchAll(const char* text, size_t text_size,
+                          vector<SetMatch>* matches) {
+  vector<size_t> matched;
+  vector<struct Match> regexp_matches;
+  matches->clear();
+  Match(text, text_size, &matched);
+  vector<size_t>::iterator it;
+  for (it = matched.begin(); it < matched.end(); it++) {
+    if (!regejs_[*it]) {
+      regejs_[*it] = new Regej(regexps_[*it]);
+    }
+    regexp_matches.clear();
+    regejs_[*it]->MatchAll(text, text_size, &regexp_matches);
+    vector<struct Match>::iterator match_it;
+    for (match_it = regexp_matches.begin();
+         match_it < regexp_matches.end();
+         match_it++) {
+      SetMatch match = {*it, *match_it};
+      matches->push_back(match);
+    }
+  }
+  return matches->size();
+}
+
+
+bool RegejSet::Compile() {
+  if (status() != RejitSuccess || regexps_.empty()) {
+    return false;
+  }
+  if (rinfo_->match_set_) {
+    return true;
+  }
+
+  Codegen codegen;
+  CodeBlock* code = codegen.Compile(rinfo_, kMatchSet);
+  if (code == NULL) {
+    return false;
+  }
+  rinfo_->code_match_set_ = code;
+  rinfo_->match_set_ = FUNCTION_CAST<MatchSetFunc>(Address(code->address()));
+  return true;
+}
+
+
+RegejStream::RegejStream(Regej* re)
+  : re_(re),
+    max_match_length_(kMaxUInt),
+    split_on_newlines_(false),
+    split_anywhere_(false) {
+  if (re_->status() == RejitSuccess) {
+    AnalyseSplitPoints(re_->rinfo_->regexp(), &max_match_length_,
+                       &split_on_newlines_, &split_anywhere_);
+  }
+  Reset();
+}
+
+
+size_t RegejStream::Feed(const char* chunk, size_t chunk_size,
+                         vector<StreamMatch>* matches) {
+  if (re_->status() != RejitSuccess) {
+    return 0;
+  }
+  pending_.append(chunk, chunk_size);
+  size_t pending_end = pending_offset_ + pending_.size();
+
+  // Compute the limit before which matches cannot be modified by the text that
+  // follows.
+  size_t limit = pending_offset_;
+  if (split_on_newlines_) {
+    // The text kept before this chunk does not contain a newline.
+    for (size_t i = chunk_size; i > 0; i--) {
+      if (chunk[i - 1] == '\n') {
+        limit = pending_end - chunk_size + i;
+        break;
+      }
+    }
+  }
+  if (split_anywhere_ && pending_end > max_match_length_) {
+    limit = max(limit, pending_end - max_match_length_);
+  }
+  if (limit == pending_offset_) {
+    return 0;
+  }
+
+  size_t n_matches = ReportMatches(limit, matches);
+
+  // Discard the text that cannot be part of the matches to come.
+  size_t new_offset = matched_ ? max(limit, last_match_end_) : limit;
+  pending_.erase(0, new_offset - pending_offset_);
+  pending_offset_ = new_offset;
+  return n_matches;
+}
+
+
+size_t RegejStream::Finish(vector<StreamMatch>* matches) {
+  size_t n_matches = 0;
+  if (re_->status() == RejitSuccess) {
+    // Include matches of length 0 at the end of the stream.
+    n_matches = ReportMatches(pending_offset_ + pending_.size() + 1, matches);
+  }
+  Reset();
+  return n_matches;
+}
+
+
+void RegejStream::Reset() {
+  pending_.clear();
+  pending_offset_ = 0;
+  last_match_end_ = 0;
+  matched_ = false;
+}
+
+
+size_t RegejStream::ReportMatches(size_t limit, vector<StreamMatch>* matches) {
+  chunk_matches_.clear();
+  re_->MatchAll(pending_.data(), pending_.size(), &chunk_matches_);
+
+  size_t n_matches = 0;
+  vector<Match>::iterator it;
+  for (it = chunk_matches_.begin(); it < chunk_matches_.end(); it++) {
+    StreamMatch match;
+    match.begin = pending_offset_ + ((*it).begin - pending_.data());
+    match.end = pending_offset_ + ((*it).end - pending_.data());
+    if (match.begin >= limit) {
+      break;
+    }
+    // The pending text may start where the last match reported finished. See
+    // MatchAllAppendFilter for matches of length 0.
+    if (matched_ && match.begin == match.end &&
+        match.begin == last_match_end_) {
+      continue;
+    }
+    matches->push_back(match);
+    last_match_end_ = match.end;
+    matched_ = true;
+    n_matches++;
+  }
+  return n_matches;
+}
+
+
+RegejLines::RegejLines(Regej* re, const char* text, size_t text_size)
+  : re_(re),
+    text_end_(text + text_size),
+    position_(text),
+    line_(text),
+    split_on_newlines_(false),
+    n_newlines_(0),
+    counted_(text) {
+  if (re_->status() == RejitSuccess) {
+    unsigned max_match_length;
+    bool split_anywhere;
+    AnalyseSplitPoints(re_->rinfo_->regexp(), &max_match_length,
+                       &split_on_newlines_, &split_anywhere);
+  } else {
+    position_ = text_end_;
+  }
+}
+
+
+bool RegejLines::Next(Match* line) {
+  MatchContext* context = ThreadContext();
+  while (position_ < text_end_) {
+    const char* begin = position_;
+    if (split_on_newlines_) {
+      // The first match from the start of a line is in the first line matching
+      // after it.
+      Match match;
+      if (!re_->MatchFirst(position_, text_end_ - position_, &match, context) ||
+          (match.begin == text_end_ && text_end_[-1] == '\n')) {
+        break;
+      }
+      // Do not trust a match start located before the text searched.
+      begin = max(match.begin, position_);
+    }
+    Match in_line = {begin, begin};
+    Match lines = EnclosingLines(position_, text_end_ - position_, in_line);
+    position_ = min(lines.end + 1, text_end_);
+    // Otherwise matches may span lines, so each line is matched on its own.
+    if (split_on_newlines_ ||
+        re_->MatchAnywhere(lines.begin, lines.end - lines.begin, context)) {
+      line_ = lines.begin;
+      *line = lines;
+      return true;
+    }
+  }
+  position_ = text_end_;
+  return false;
+}
+
 
-  return vmem != NULL;
+size_t RegejLines::line_number() {
+  n_newlines_ += CountNewlines(counted_, line_ - counted_);
+  counted_ = line_;
+  return n_newlines_;
 }
 
 
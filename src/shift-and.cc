@@ -0,0 +1,302 @@
+// Copyright (C) 2013 Alexandre Rames <alexandre@coreperf.com>
+// rejit is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "shift-and.h"
+
+#include "dfa.h"
+
+namespace rejit {
+namespace internal {
+
+// A set of positions held in kWords machine words.
+template <int kWords>
+class PositionSet {
+ public:
+  PositionSet() {
+    for (int i = 0; i < kWords; i++) words_[i] = 0;
+  }
+
+  void Set(int position) {
+    words_[position / kBitsPerPointer] |=
+      static_cast<uint64_t>(1) << (position % kBitsPerPointer);
+  }
+  bool IsSet(int position) const {
+    return (words_[position / kBitsPerPointer] >>
+            (position % kBitsPerPointer)) & 1;
+  }
+  bool IsEmpty() const {
+    uint64_t any = 0;
+    for (int i = 0; i < kWords; i++) any |= words_[i];
+    return any == 0;
+  }
+  bool Intersects(const PositionSet& other) const {
+    uint64_t any = 0;
+    for (int i = 0; i < kWords; i++) any |= words_[i] & other.words_[i];
+    return any != 0;
+  }
+  // The byte holding positions [8 * index, 8 * index + 8).
+  uint8_t Byte(int index) const {
+    return words_[index / kPointerSize] >>
+      (kBitsPerByte * (index % kPointerSize));
+  }
+  // The positions following the ones in the set.
+  PositionSet ShiftedByOne() const {
+    PositionSet result;
+    uint64_t carry = 0;
+    for (int i = 0; i < kWords; i++) {
+      result.words_[i] = (words_[i] << 1) | carry;
+      carry = words_[i] >> (kBitsPerPointer - 1);
+    }
+    return result;
+  }
+
+  PositionSet& operator|=(const PositionSet& other) {
+    for (int i = 0; i < kWords; i++) words_[i] |= other.words_[i];
+    return *this;
+  }
+  PositionSet operator|(const PositionSet& other) const {
+    PositionSet result = *this;
+    return result |= other;
+  }
+  PositionSet operator&(const PositionSet& other) const {
+    PositionSet result;
+    for (int i = 0; i < kWords; i++) {
+      result.words_[i] = words_[i] & other.words_[i];
+    }
+    return result;
+  }
+
+ private:
+  uint64_t words_[kWords];
+};
+
+
+// A character transition of the ByteNFA.
+struct Position {
+  int from;
+  int to;
+  int char_set;
+};
+
+
+template <int kWords>
+class ShiftAndMatcher : public ShiftAnd {
+ public:
+  typedef PositionSet<kWords> Set;
+
+  ShiftAndMatcher(const ByteNFA& nfa, const vector<Position>& positions,
+                  const vector<vector<bool> >& closures);
+
+  virtual bool MatchFull(const char* text, size_t text_size);
+  virtual bool MatchAnywhere(const char* text, size_t text_size);
+
+ private:
+  inline Set Follow(const Set& active) const {
+    Set next = (active & shifted_).ShiftedByOne();
+    for (int i = 0; i < n_chunks_; i++) {
+      next |= follow_tables_[i][active.Byte(chunks_[i])];
+    }
+    return next;
+  }
+
+  // Positions that can start a match.
+  Set first_;
+  // Positions after which a match ends.
+  Set final_;
+  // Positions followed by the next position.
+  Set shifted_;
+  // Positions matching each character.
+  Set matching_[256];
+  // Characters matched by a position of first_.
+  bool starts_[256];
+  bool match_empty_;
+  // Bytes of the positions with following positions not handled by the shift.
+  int n_chunks_;
+  int chunks_[kMaxShiftAndPositions / kBitsPerByte];
+  // For each byte of chunks_ and each value of that byte, the positions
+  // following the positions set in the byte, excluding those handled by the
+  // shift.
+  Set follow_tables_[kMaxShiftAndPositions / kBitsPerByte][256];
+};
+
+
+template <int kWords>
+ShiftAndMatcher<kWords>::ShiftAndMatcher(
+    const ByteNFA& nfa,
+    const vector<Position>& positions,
+    const vector<vector<bool> >& closures) : n_chunks_(0) {
+  int n_positions = positions.size();
+  const vector<bool>& start_closure = closures[nfa.start()];
+  match_empty_ = start_closure[nfa.accept()];
+
+  vector<Set> follows(n_positions);
+  for (int p = 0; p < n_positions; p++) {
+    const Position& position = positions[p];
+    if (start_closure[position.from]) {
+      first_.Set(p);
+    }
+    const vector<bool>& closure = closures[position.to];
+    if (closure[nfa.accept()]) {
+      final_.Set(p);
+    }
+    for (int c = 0; c < 256; c++) {
+      if (nfa.CharSetContains(position.char_set, c)) {
+        matching_[c].Set(p);
+      }
+    }
+    for (int q = 0; q < n_positions; q++) {
+      if (!closure[positions[q].from]) continue;
+      if (q == p + 1) {
+        shifted_.Set(p);
+      } else {
+        follows[p].Set(q);
+      }
+    }
+  }
+  for (int c = 0; c < 256; c++) {
+    starts_[c] = first_.Intersects(matching_[c]);
+  }
+
+  int n_chunks = (n_positions + kBitsPerByte - 1) / kBitsPerByte;
+  for (int chunk = 0; chunk < n_chunks; chunk++) {
+    bool needed = false;
+    for (int bit = 0; bit < kBitsPerByte; bit++) {
+      int p = chunk * kBitsPerByte + bit;
+      if (p < n_positions && !follows[p].IsEmpty()) {
+        needed = true;
+      }
+    }
+    if (!needed) continue;
+    Set* table = follow_tables_[n_chunks_];
+    chunks_[n_chunks_++] = chunk;
+    for (int value = 0; value < 256; value++) {
+      Set* entry = &table[value];
+      for (int bit = 0; bit < kBitsPerByte; bit++) {
+        int p = chunk * kBitsPerByte + bit;
+        if ((value & (1 << bit)) && p < n_positions) {
+          *entry |= follows[p];
+        }
+      }
+    }
+  }
+}
+
+
+template <int kWords>
+bool ShiftAndMatcher<kWords>::MatchFull(const char* text, size_t text_size) {
+  if (text_size == 0) {
+    return match_empty_;
+  }
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(text);
+  const uint8_t* end = p + text_size;
+  Set active = first_ & matching_[*p];
+  for (p++; p < end; p++) {
+    if (active.IsEmpty()) {
+      return false;
+    }
+    active = Follow(active) & matching_[*p];
+  }
+  return active.Intersects(final_);
+}
+
+
+template <int kWords>
+bool ShiftAndMatcher<kWords>::MatchAnywhere(const char* text,
+                                            size_t text_size) {
+  if (match_empty_) {
+    return true;
+  }
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(text);
+  const uint8_t* end = p + text_size;
+  Set active;
+  while (p < end) {
+    if (active.IsEmpty()) {
+      // Skip the characters that cannot start a match.
+      while (!starts_[*p]) {
+        if (++p == end) {
+          return false;
+        }
+      }
+      active = first_ & matching_[*p];
+    } else {
+      active = (Follow(active) | first_) & matching_[*p];
+    }
+    if (active.Intersects(final_)) {
+      return true;
+    }
+    p++;
+  }
+  return false;
+}
+
+
+// Number the transitions reachable from `state`. The transitions leaving the
+// target of a transition are numbered right after it, so that the positions of
+// a sequence of characters are consecutive.
+static void NumberPositions(const ByteNFA& nfa, int state,
+                            vector<bool>* visited,
+                            vector<Position>* positions) {
+  if ((*visited)[state]) return;
+  (*visited)[state] = true;
+  for (const ByteNFA::Transition& transition : nfa.transitions(state, false)) {
+    Position position = {state, transition.target, transition.char_set};
+    positions->push_back(position);
+    NumberPositions(nfa, transition.target, visited, positions);
+  }
+  for (int target : nfa.epsilons(state, false)) {
+    NumberPositions(nfa, target, visited, positions);
+  }
+}
+
+
+ShiftAnd* ShiftAnd::New(RegexpInfo* rinfo) {
+  ByteNFA nfa;
+  if (!nfa.Build(rinfo)) {
+    return NULL;
+  }
+
+  int n_states = nfa.n_states();
+  vector<Position> positions;
+  vector<bool> visited(n_states, false);
+  NumberPositions(nfa, nfa.start(), &visited, &positions);
+  if (positions.size() > static_cast<size_t>(kMaxShiftAndPositions)) {
+    return NULL;
+  }
+
+  // The states reachable from each state without consuming characters.
+  vector<vector<bool> > closures(n_states, vector<bool>(n_states, false));
+  for (int state = 0; state < n_states; state++) {
+    vector<bool>* closure = &closures[state];
+    vector<int> stack(1, state);
+    (*closure)[state] = true;
+    while (!stack.empty()) {
+      int current = stack.back();
+      stack.pop_back();
+      for (int target : nfa.epsilons(current, false)) {
+        if (!(*closure)[target]) {
+          (*closure)[target] = true;
+          stack.push_back(target);
+        }
+      }
+    }
+  }
+
+  if (positions.size() <= static_cast<size_t>(kBitsPerPointer)) {
+    return new ShiftAndMatcher<1>(nfa, positions, closures);
+  } else {
+    return new ShiftAndMatcher<2>(nfa, positions, closures);
+  }
+}
+
+} }  // namespace rejit::internal
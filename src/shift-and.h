@@ -0,0 +1,57 @@
+// Copyright (C) 2013 Alexandre Rames <alexandre@coreperf.com>
+// rejit is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef REJIT_SHIFT_AND_H_
+#define REJIT_SHIFT_AND_H_
+
+#include "globals.h"
+#include "regexp.h"
+
+namespace rejit {
+namespace internal {
+
+// Regexps with more positions than this do not use the bit-parallel tier.
+const int kMaxShiftAndWords = 2;
+const int kMaxShiftAndPositions = kMaxShiftAndWords * kBitsPerPointer;
+
+// A bit-parallel matcher for regexps with few positions, used for kMatchFull
+// and kMatchAnywhere.
+// The positions are the character transitions of the ByteNFA, as in a Glushkov
+// automaton: a bit set for a position indicates that the last character read
+// was matched by this transition. After reading a character c the active
+// positions become
+//   (Follow(active) | first) & positions_matching[c]
+// where `first` is only added at the start of the text for anchored matches.
+// Positions are numbered so that most of them are followed by the next one, so
+// Follow() is mostly a shift, and the other transitions are looked up in tables
+// indexed by bytes of the active positions.
+class ShiftAnd {
+ public:
+  // Returns NULL if the regexp is not suitable for the bit-parallel tier.
+  static ShiftAnd* New(RegexpInfo* rinfo);
+  virtual ~ShiftAnd() {}
+
+  virtual bool MatchFull(const char* text, size_t text_size) = 0;
+  virtual bool MatchAnywhere(const char* text, size_t text_size) = 0;
+
+ protected:
+  ShiftAnd() {}
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(ShiftAnd);
+};
+
+} }  // namespace rejit::internal
+
+#endif  // REJIT_SHIFT_AND_H_
@@ -0,0 +1,156 @@
+// Copyright (C) 2013 Alexandre Rames <alexandre@coreperf.com>
+// rejit is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "snapshot.h"
+
+#include <string.h>
+
+#include "codegen.h"
+
+namespace rejit {
+namespace internal {
+
+// The C++ functions the generated code can call. Debug code calls others, but
+// is not relocatable.
+static const Address kExternalFunctions[] = {
+  FUNCTION_ADDR(MatchAllFlush)
+};
+static const size_t kNExternalFunctions =
+  sizeof(kExternalFunctions) / sizeof(kExternalFunctions[0]);
+
+
+uint64_t SnapshotFingerprint() {
+  // The flags changing the generated code or how it is used.
+  const bool flags[] = {
+    FLAG_use_fast_forward, FLAG_use_fast_forward_early, FLAG_use_ff_reduce,
+    FLAG_use_dfa, FLAG_use_shift_and, FLAG_use_packed_states,
+    FLAG_use_parser_opt, FLAG_use_rep_counters
+  };
+  uint64_t flags_bits = 0;
+  for (size_t i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+    flags_bits |= static_cast<uint64_t>(flags[i]) << i;
+  }
+  // The cpu features use bits below 56.
+  return Codegen::CpuFeaturesFingerprint() | (flags_bits << 56);
+}
+
+
+void SnapshotWriter::WriteUInt64(uint64_t value) {
+  buffer_->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+
+void SnapshotWriter::WriteString(const char* str, size_t size) {
+  WriteUInt64(size);
+  buffer_->append(str, size);
+}
+
+
+bool SnapshotWriter::WriteCode(const CodeBlock* code) {
+  if (!code->relocatable()) {
+    return false;
+  }
+  const char* base = reinterpret_cast<const char*>(code->address());
+  const vector<int>& references = code->external_references();
+  vector<uint64_t> indexes;
+  for (int offset : references) {
+    Address address;
+    memcpy(&address, base + offset, sizeof(address));
+    size_t index = 0;
+    while (index < kNExternalFunctions &&
+           kExternalFunctions[index] != address) {
+      index++;
+    }
+    if (index == kNExternalFunctions) {
+      return false;
+    }
+    indexes.push_back(index);
+  }
+
+  WriteUInt64(code->frame_size());
+  WriteUInt64(code->frame_clean_size());
+  WriteUInt64(references.size());
+  for (size_t i = 0; i < references.size(); i++) {
+    WriteUInt64(references[i]);
+    WriteUInt64(indexes[i]);
+  }
+  WriteString(base, code->size());
+  return true;
+}
+
+
+bool SnapshotReader::ReadUInt64(uint64_t* value) {
+  if (static_cast<size_t>(end_ - pos_) < sizeof(*value)) {
+    return false;
+  }
+  memcpy(value, pos_, sizeof(*value));
+  pos_ += sizeof(*value);
+  return true;
+}
+
+
+bool SnapshotReader::ReadString(string* str) {
+  uint64_t size;
+  if (!ReadUInt64(&size) || static_cast<uint64_t>(end_ - pos_) < size) {
+    return false;
+  }
+  str->assign(pos_, size);
+  pos_ += size;
+  return true;
+}
+
+
+CodeBlock* SnapshotReader::ReadCode() {
+  uint64_t frame_size, frame_clean_size, n_references;
+  if (!ReadUInt64(&frame_size) || !ReadUInt64(&frame_clean_size) ||
+      frame_clean_size > frame_size || !ReadUInt64(&n_references) ||
+      n_references > static_cast<uint64_t>(end_ - pos_) / 16) {
+    return NULL;
+  }
+  vector<uint64_t> offsets;
+  vector<uint64_t> indexes;
+  for (uint64_t i = 0; i < n_references; i++) {
+    uint64_t offset, index;
+    if (!ReadUInt64(&offset) || !ReadUInt64(&index) ||
+        index >= kNExternalFunctions) {
+      return NULL;
+    }
+    offsets.push_back(offset);
+    indexes.push_back(index);
+  }
+  string code;
+  if (!ReadString(&code) || code.empty()) {
+    return NULL;
+  }
+
+  // Fix up the addresses before the code is copied to executable memory.
+  vector<int> references;
+  for (size_t i = 0; i < offsets.size(); i++) {
+    if (offsets[i] > code.size() ||
+        code.size() - offsets[i] < sizeof(Address)) {
+      return NULL;
+    }
+    Address address = kExternalFunctions[indexes[i]];
+    memcpy(&code[offsets[i]], &address, sizeof(address));
+    references.push_back(offsets[i]);
+  }
+  CodeBlock* block = CodeArena::Instance()->Allocate(code.data(), code.size());
+  if (block != NULL) {
+    block->set_relocation_info(references, true);
+    block->set_frame_size(frame_size, frame_clean_size);
+  }
+  return block;
+}
+
+} }  // namespace rejit::internal
@@ -0,0 +1,82 @@
+// Copyright (C) 2013 Alexandre Rames <alexandre@coreperf.com>
+// rejit is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef REJIT_SNAPSHOT_H_
+#define REJIT_SNAPSHOT_H_
+
+#include <string>
+
+#include "globals.h"
+#include "code-arena.h"
+
+namespace rejit {
+namespace internal {
+
+// Snapshots hold the code compiled for a Regej, so that it can be loaded by
+// another process instead of compiling the regexp again (see Regej::Serialize).
+// The generated code is position independent, except for the addresses of the
+// C++ functions it calls. Snapshots refer to these functions by their index in
+// a table, and the addresses are fixed up when the code is loaded.
+// Snapshots are only loaded with the same version, on a CPU with the same
+// features and with the same code generation flags, as identified by
+// SnapshotFingerprint().
+
+const uint64_t kSnapshotMagic = 0x544f485350414e53ULL;  // "SNAPSHOT"
+// Must be incremented when the layout of snapshots or the conventions of the
+// generated code change.
+const uint32_t kSnapshotVersion = 4;
+
+uint64_t SnapshotFingerprint();
+
+
+class SnapshotWriter {
+ public:
+  explicit SnapshotWriter(string* buffer) : buffer_(buffer) {}
+
+  void WriteUInt64(uint64_t value);
+  void WriteString(const char* str, size_t size);
+  // Returns false if the code cannot be relocated.
+  bool WriteCode(const CodeBlock* code);
+
+ private:
+  string* buffer_;
+
+  DISALLOW_COPY_AND_ASSIGN(SnapshotWriter);
+};
+
+
+// The read functions return false, or NULL, if the snapshot is truncated or
+// invalid.
+class SnapshotReader {
+ public:
+  SnapshotReader(const char* data, size_t size)
+    : pos_(data), end_(data + size) {}
+
+  bool ReadUInt64(uint64_t* value);
+  bool ReadString(string* str);
+  // The code is allocated in the code arena.
+  CodeBlock* ReadCode();
+
+  bool done() const { return pos_ == end_; }
+
+ private:
+  const char* pos_;
+  const char* end_;
+
+  DISALLOW_COPY_AND_ASSIGN(SnapshotReader);
+};
+
+} }  // namespace rejit::internal
+
+#endif  // REJIT_SNAPSHOT_H_
@@ -0,0 +1,288 @@
+// Copyright (C) 2013 Alexandre Rames <alexandre@coreperf.com>
+// rejit is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "submatch.h"
+
+#include "parser.h"
+
+namespace rejit {
+namespace internal {
+
+SubmatchResolver* SubmatchResolver::New(const char* regexp, bool ignore_case) {
+  RegexpInfo rinfo;
+  vector<Regexp*> groups;
+  Parser parser(&groups);
+  parser.set_ignore_case(ignore_case);
+  if (parser.Parse(ERE, &rinfo, regexp) != RejitSuccess) {
+    return NULL;
+  }
+  SubmatchResolver* resolver = new SubmatchResolver();
+  resolver->n_groups_ = groups.size();
+  if (resolver->Compile(rinfo.regexp(), groups)) {
+    resolver->Emit(kOpAccept);
+  } else {
+    // The number of groups is still known, so that callers can report them as
+    // unset.
+    resolver->program_.clear();
+    resolver->char_sets_.clear();
+  }
+  return resolver;
+}
+
+
+int SubmatchResolver::Emit(Opcode opcode, int x, int y) {
+  Instruction instruction = {opcode, x, y};
+  program_.push_back(instruction);
+  return program_.size() - 1;
+}
+
+
+int SubmatchResolver::EmitCharSet(const uint8_t* bitmap) {
+  char_sets_.push_back(vector<uint8_t>(bitmap, bitmap + 32));
+  return Emit(kOpChar, char_sets_.size() - 1);
+}
+
+
+bool SubmatchResolver::Compile(Regexp* regexp, const vector<Regexp*>& groups) {
+  if (program_.size() > kMaxSubmatchProgramSize) {
+    return false;
+  }
+  // The same regexp is recorded for directly nested groups, as in '((a))'.
+  for (size_t i = 0; i < groups.size(); i++) {
+    if (groups[i] == regexp) {
+      Emit(kOpSave, 2 * i);
+    }
+  }
+
+  uint8_t bitmap[32];
+  switch (regexp->type()) {
+    case kMultipleChar: {
+      MultipleChar* mc = regexp->AsMultipleChar();
+      for (unsigned i = 0; i < mc->chars_length(); i++) {
+        mc->ComputeBitmap(i, bitmap);
+        EmitCharSet(bitmap);
+      }
+      break;
+    }
+
+    case kPeriod:
+      // Match all characters exept '\n' and '\r'. See ByteNFA::Build.
+      memset(bitmap, 0xff, 32);
+      bitmap['\n' / 8] &= ~(1 << ('\n' % 8));
+      bitmap['\r' / 8] &= ~(1 << ('\r' % 8));
+      EmitCharSet(bitmap);
+      break;
+
+    case kBracket:
+      regexp->AsBracket()->ComputeBitmap(bitmap);
+      EmitCharSet(bitmap);
+      break;
+
+    case kStartOfLine:
+      Emit(kOpStartOfLine);
+      break;
+
+    case kEndOfLine:
+      Emit(kOpEndOfLine);
+      break;
+
+    case kConcatenation:
+      for (Regexp* sub : *regexp->AsConcatenation()->sub_regexps()) {
+        if (!Compile(sub, groups)) {
+          return false;
+        }
+      }
+      break;
+
+    case kAlternation: {
+      // The parser stores the alternatives in reverse order.
+      vector<Regexp*>* subs = regexp->AsAlternation()->sub_regexps();
+      vector<int> jumps;
+      for (size_t i = subs->size(); i-- > 0;) {
+        int split = -1;
+        if (i > 0) {
+          split = Emit(kOpSplit, program_.size() + 1);
+        }
+        if (!Compile(subs->at(i), groups)) {
+          return false;
+        }
+        if (i > 0) {
+          jumps.push_back(Emit(kOpJump));
+          program_[split].y = program_.size();
+        }
+      }
+      for (int jump : jumps) {
+        program_[jump].x = program_.size();
+      }
+      break;
+    }
+
+    case kRepetition: {
+      Repetition* repetition = regexp->AsRepetition();
+      Regexp* sub = repetition->sub_regexp();
+      for (uint32_t i = 0; i < repetition->min_rep(); i++) {
+        if (!Compile(sub, groups)) {
+          return false;
+        }
+      }
+      if (!repetition->IsLimited()) {
+        int split = Emit(kOpSplit, program_.size() + 1);
+        if (!Compile(sub, groups)) {
+          return false;
+        }
+        Emit(kOpJump, split);
+        program_[split].y = program_.size();
+      } else {
+        // Each optional repetition can only be entered after the previous one.
+        vector<int> splits;
+        for (uint32_t i = repetition->min_rep();
+             i < repetition->max_rep(); i++) {
+          splits.push_back(Emit(kOpSplit, program_.size() + 1));
+          if (!Compile(sub, groups)) {
+            return false;
+          }
+        }
+        for (int split : splits) {
+          program_[split].y = program_.size();
+        }
+      }
+      break;
+    }
+
+    default:
+      UNREACHABLE();
+      return false;
+  }
+
+  for (size_t i = groups.size(); i-- > 0;) {
+    if (groups[i] == regexp) {
+      Emit(kOpSave, 2 * i + 1);
+    }
+  }
+  return true;
+}
+
+
+void SubmatchResolver::AddThread(vector<Thread>* threads,
+                                 vector<int>* marks, int mark,
+                                 Thread thread, const char* pos,
+                                 const char* text, const char* text_end) const {
+  // Follow the instructions not consuming characters, in order of priority. An
+  // instruction reached by a thread is not followed again by lower priority
+  // threads for the same position.
+  vector<Thread> stack;
+  stack.push_back(thread);
+  while (!stack.empty()) {
+    Thread current = stack.back();
+    stack.pop_back();
+    if ((*marks)[current.pc] == mark) {
+      continue;
+    }
+    (*marks)[current.pc] = mark;
+    const Instruction& instruction = program_[current.pc];
+    switch (instruction.opcode) {
+      case kOpChar:
+      case kOpAccept:
+        threads->push_back(current);
+        break;
+
+      case kOpSplit: {
+        Thread low_priority = current;
+        low_priority.pc = instruction.y;
+        stack.push_back(low_priority);
+        current.pc = instruction.x;
+        stack.push_back(current);
+        break;
+      }
+
+      case kOpJump:
+        current.pc = instruction.x;
+        stack.push_back(current);
+        break;
+
+      case kOpSave:
+        current.slots[instruction.x] = pos;
+        current.pc++;
+        stack.push_back(current);
+        break;
+
+      // See MatchStartOrEndOfLine in the codegen.
+      case kOpStartOfLine:
+        if (pos == text || pos[-1] == '\n' || pos[-1] == '\r') {
+          current.pc++;
+          stack.push_back(current);
+        }
+        break;
+
+      case kOpEndOfLine:
+        if (pos == text_end || *pos == '\n' || *pos == '\r') {
+          current.pc++;
+          stack.push_back(current);
+        }
+        break;
+    }
+  }
+}
+
+
+bool SubmatchResolver::Resolve(const char* text, size_t text_size,
+                               Match match, vector<Match>* groups) const {
+  if (program_.empty()) {
+    return false;
+  }
+  const char* text_end = text + text_size;
+  vector<int> marks(program_.size(), -1);
+  vector<Thread> current, next;
+  Thread start;
+  start.pc = 0;
+  start.slots.assign(2 * n_groups_, NULL);
+  int mark = 0;
+  AddThread(&current, &marks, mark, start, match.begin, text, text_end);
+
+  for (const char* pos = match.begin; pos < match.end && !current.empty();
+       pos++) {
+    uint8_t c = *pos;
+    mark++;
+    next.clear();
+    for (Thread& thread : current) {
+      const Instruction& instruction = program_[thread.pc];
+      if (instruction.opcode == kOpChar &&
+          char_sets_[instruction.x][c / 8] & (1 << (c % 8))) {
+        thread.pc++;
+        AddThread(&next, &marks, mark, thread, pos + 1, text, text_end);
+      }
+    }
+    current.swap(next);
+  }
+
+  // The highest priority thread matching the whole span gives the groups.
+  for (const Thread& thread : current) {
+    if (program_[thread.pc].opcode != kOpAccept) {
+      continue;
+    }
+    groups->assign(1, match);
+    for (size_t i = 0; i < n_groups_; i++) {
+      Match group = {NULL, NULL};
+      if (thread.slots[2 * i] && thread.slots[2 * i + 1]) {
+        group.begin = thread.slots[2 * i];
+        group.end = thread.slots[2 * i + 1];
+      }
+      groups->push_back(group);
+    }
+    return true;
+  }
+  return false;
+}
+
+} }  // namespace rejit::internal
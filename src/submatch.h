@@ -0,0 +1,96 @@
+// Copyright (C) 2013 Alexandre Rames <alexandre@coreperf.com>
+// rejit is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef REJIT_SUBMATCH_H_
+#define REJIT_SUBMATCH_H_
+
+#include "globals.h"
+#include "regexp.h"
+
+namespace rejit {
+namespace internal {
+
+// Programs longer than this are not built, to bound the memory used.
+const size_t kMaxSubmatchProgramSize = 1 << 16;
+
+// Locates the groups of the regexp in a match found by the other tiers.
+// The regexp is parsed again preserving its groups, and compiled to a program
+// run by a Pike VM: an NFA simulation where each thread carries the positions
+// of the groups it went through. Only the span of the match is scanned, and
+// only the threads reaching the end of the match are considered. Within the
+// match, the groups are assigned as by a backtracking matcher: alternatives are
+// preferred in order and repetitions are greedy.
+class SubmatchResolver {
+ public:
+  // Returns NULL if the regexp cannot be parsed. If its program would be longer
+  // than kMaxSubmatchProgramSize, the resolver is still returned, but cannot
+  // resolve any match.
+  static SubmatchResolver* New(const char* regexp, bool ignore_case = false);
+
+  // Resolve the groups of 'match', found in the text. 'groups' receives the
+  // match followed by one entry per group. Groups not part of the match have
+  // NULL begin and end.
+  // Returns false if the regexp does not match exactly the text of 'match', or
+  // if the program was not built.
+  bool Resolve(const char* text, size_t text_size, Match match,
+               vector<Match>* groups) const;
+
+  size_t n_groups() const { return n_groups_; }
+
+ private:
+  SubmatchResolver() : n_groups_(0) {}
+
+  enum Opcode {
+    // Consume a character of the char set 'x'.
+    kOpChar,
+    // Continue at 'x', and with a lower priority at 'y'.
+    kOpSplit,
+    kOpJump,
+    // Record the current position in slot 'x'. Group n uses slots 2n and
+    // 2n + 1.
+    kOpSave,
+    kOpStartOfLine,
+    kOpEndOfLine,
+    kOpAccept
+  };
+
+  struct Instruction {
+    Opcode opcode;
+    int x;
+    int y;
+  };
+
+  struct Thread {
+    int pc;
+    vector<const char*> slots;
+  };
+
+  int Emit(Opcode opcode, int x = 0, int y = 0);
+  int EmitCharSet(const uint8_t* bitmap);
+  bool Compile(Regexp* regexp, const vector<Regexp*>& groups);
+  void AddThread(vector<Thread>* threads, vector<int>* marks, int mark,
+                 Thread thread, const char* pos,
+                 const char* text, const char* text_end) const;
+
+  vector<Instruction> program_;
+  // Bitmaps of 32 bytes.
+  vector<vector<uint8_t> > char_sets_;
+  size_t n_groups_;
+
+  DISALLOW_COPY_AND_ASSIGN(SubmatchResolver);
+};
+
+} }  // namespace rejit::internal
+
+#endif  // REJIT_SUBMATCH_H_
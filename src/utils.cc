@@ -20,8 +20,7 @@
 
 namespace rejit {
 
-char rejit_status_string_buf[STATUS_STRING_SIZE];
-char * const rejit_status_string = rejit_status_string_buf;
+thread_local char rejit_status_string[STATUS_STRING_SIZE];
 
 namespace internal {
 
@@ -127,6 +127,22 @@ inline Dest BitCast(const Source& source) {
 //#define offsetof(type, member) __builtin_offsetof(type, member)
 
 
+// Characters ------------------------------------------------------------------
+
+// Case folding only applies to ASCII letters. The cases of a letter only differ
+// by the 0x20 bit, which is set for lowercase letters.
+const char kCaseBit = 0x20;
+
+inline bool IsAsciiLetter(char c) {
+  char lower = c | kCaseBit;
+  return 'a' <= lower && lower <= 'z';
+}
+
+inline char ToLowerAscii(char c) {
+  return IsAsciiLetter(c) ? c | kCaseBit : c;
+}
+
+
 // Arithmetic ------------------------------------------------------------------
 // TODO(rames): Use good implementations for all arithmetic utils.
 
@@ -47,6 +47,7 @@
 
 #if defined(REJIT_TARGET_ARCH_X64)
 
+#include <cpuid.h>
 #include <string.h>
 
 #include "globals.h"
@@ -67,6 +68,36 @@ uint64_t CpuFeatures::supported_ = CpuFeatures::kDefaultCpuFeatures;
 uint64_t CpuFeatures::found_by_runtime_probing_ = 0;
 
 
+// Probe the features reported by CPUID(7, 0) that we use. They also require the
+// OS to save the extended register state, as reported via xgetbv.
+static uint64_t ProbeExtendedFeatures() {
+  unsigned eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) ||
+      !(ecx & (1 << 27))) {  // OSXSAVE
+    return 0;
+  }
+  uint32_t xcr0_lo, xcr0_hi;
+  __asm__ volatile("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+  // The OS must save the xmm and ymm state (bits 1 and 2) for AVX, and also the
+  // opmask and zmm state (bits 5 to 7) for AVX-512.
+  bool os_avx = (xcr0_lo & 0x6) == 0x6;
+  bool os_avx512 = os_avx && (xcr0_lo & 0xe0) == 0xe0;
+
+  if (__get_cpuid_max(0, NULL) < 7) {
+    return 0;
+  }
+  __cpuid_count(7, 0, eax, ebx, ecx, edx);
+  uint64_t features = 0;
+  if (os_avx && (ebx & (1 << 5))) {
+    features |= 1LL << AVX2;
+  }
+  if (os_avx512 && (ebx & (1 << 30))) {
+    features |= 1LL << AVX512BW;
+  }
+  return features;
+}
+
+
 void CpuFeatures::Probe() {
   ASSERT(supported_ == CpuFeatures::kDefaultCpuFeatures);
   initialized_ = true;
@@ -153,6 +184,9 @@ void CpuFeatures::Probe() {
   typedef uint64_t (*F0)();
   F0 probe = FUNCTION_CAST<F0>(reinterpret_cast<Address>(memory->address()));
   supported_ = probe();
+  // The bits used for the extended features are reserved in CPUID(1).
+  supported_ &= ~(1LL << AVX2 | 1LL << AVX512BW);
+  supported_ |= ProbeExtendedFeatures();
   found_by_runtime_probing_ = supported_;
   found_by_runtime_probing_ &= ~kDefaultCpuFeatures;
   uint64_t os_guarantees = OS::CpuFeaturesImpliedByPlatform();
@@ -729,6 +763,15 @@ void Assembler::bt(const Operand& dst, Register src) {
 }
 
 
+void Assembler::bt(Register dst, Register src) {
+  EnsureSpace ensure_space(this);
+  emit_rex_64(src, dst);
+  emit(0x0F);
+  emit(0xA3);
+  emit_modrm(src, dst);
+}
+
+
 void Assembler::bts(const Operand& dst, Register src) {
   EnsureSpace ensure_space(this);
   emit_rex_64(src, dst);
@@ -2908,6 +2951,200 @@ void Assembler::movdqu(XMMRegister dst, const Operand& src) {
 }
 
 
+void Assembler::pand(XMMRegister dst, XMMRegister src) {
+  EnsureSpace ensure_space(this);
+  emit(0x66);
+  emit_optional_rex_32(dst, src);
+  emit(0x0F);
+  emit(0xDB);
+  emit_sse_operand(dst, src);
+}
+
+
+void Assembler::por(XMMRegister dst, XMMRegister src) {
+  EnsureSpace ensure_space(this);
+  emit(0x66);
+  emit_optional_rex_32(dst, src);
+  emit(0x0F);
+  emit(0xEB);
+  emit_sse_operand(dst, src);
+}
+
+
+void Assembler::pxor(XMMRegister dst, XMMRegister src) {
+  EnsureSpace ensure_space(this);
+  emit(0x66);
+  emit_optional_rex_32(dst, src);
+  emit(0x0F);
+  emit(0xEF);
+  emit_sse_operand(dst, src);
+}
+
+
+void Assembler::pcmpeqb(XMMRegister dst, XMMRegister src) {
+  EnsureSpace ensure_space(this);
+  emit(0x66);
+  emit_optional_rex_32(dst, src);
+  emit(0x0F);
+  emit(0x74);
+  emit_sse_operand(dst, src);
+}
+
+
+void Assembler::psrlw(XMMRegister dst, uint8_t shift) {
+  EnsureSpace ensure_space(this);
+  Register rm = { dst.code() };
+  emit(0x66);
+  emit_optional_rex_32(rm);
+  emit(0x0F);
+  emit(0x71);
+  emit(0xC0 | 2 << 3 | dst.low_bits());
+  emit(shift);
+}
+
+
+void Assembler::pmovmskb(Register dst, XMMRegister src) {
+  EnsureSpace ensure_space(this);
+  emit(0x66);
+  emit_optional_rex_32(dst, src);
+  emit(0x0F);
+  emit(0xD7);
+  emit_sse_operand(dst, src);
+}
+
+
+void Assembler::pshufb(XMMRegister dst, XMMRegister src) {
+  ASSERT(CpuFeatures::IsSupported(SSSE3));
+  EnsureSpace ensure_space(this);
+  emit(0x66);
+  emit_optional_rex_32(dst, src);
+  emit(0x0F);
+  emit(0x38);
+  emit(0x00);
+  emit_sse_operand(dst, src);
+}
+
+
+void Assembler::bsfq(Register dst, Register src) {
+  EnsureSpace ensure_space(this);
+  emit_rex_64(dst, src);
+  emit(0x0F);
+  emit(0xBC);
+  emit_modrm(dst, src);
+}
+
+
+void Assembler::emit_vex3_prefix(int reg, int vreg, int rm_rex,
+                                 VexLength l, VexSIMDPrefix pp,
+                                 VexLeadingOpcode m) {
+  // The R, X, B, and vvvv fields are stored inverted.
+  emit(0xC4);
+  emit((~(reg >> 3) & 1) << 7 | (~rm_rex & 3) << 5 | m);
+  emit((~vreg & 0xF) << 3 | l << 2 | pp);
+}
+
+
+void Assembler::vmovdqu(YMMRegister dst, const Operand& src) {
+  EnsureSpace ensure_space(this);
+  emit_vex3_prefix(dst, ymm0, src, kL256, kF3, k0F);
+  emit(0x6F);
+  emit_sse_operand(dst, src);
+}
+
+
+void Assembler::vpbroadcastb(YMMRegister dst, XMMRegister src) {
+  EnsureSpace ensure_space(this);
+  emit_vex3_prefix(dst, ymm0, src, kL256, k66, k0F38);
+  emit(0x78);
+  emit_sse_operand(dst, src);
+}
+
+
+void Assembler::vpbroadcastb(YMMRegister dst, const Operand& src) {
+  EnsureSpace ensure_space(this);
+  emit_vex3_prefix(dst, ymm0, src, kL256, k66, k0F38);
+  emit(0x78);
+  emit_sse_operand(dst, src);
+}
+
+
+void Assembler::vpcmpeqb(YMMRegister dst, YMMRegister src1, YMMRegister src2) {
+  EnsureSpace ensure_space(this);
+  emit_vex3_prefix(dst, src1, src2, kL256, k66, k0F);
+  emit(0x74);
+  emit_sse_operand(dst, src2);
+}
+
+
+void Assembler::vpcmpeqb(YMMRegister dst, YMMRegister src1,
+                         const Operand& src2) {
+  EnsureSpace ensure_space(this);
+  emit_vex3_prefix(dst, src1, src2, kL256, k66, k0F);
+  emit(0x74);
+  emit_sse_operand(dst, src2);
+}
+
+
+void Assembler::vpand(YMMRegister dst, YMMRegister src1, YMMRegister src2) {
+  EnsureSpace ensure_space(this);
+  emit_vex3_prefix(dst, src1, src2, kL256, k66, k0F);
+  emit(0xDB);
+  emit_sse_operand(dst, src2);
+}
+
+
+void Assembler::vpor(YMMRegister dst, YMMRegister src1, YMMRegister src2) {
+  EnsureSpace ensure_space(this);
+  emit_vex3_prefix(dst, src1, src2, kL256, k66, k0F);
+  emit(0xEB);
+  emit_sse_operand(dst, src2);
+}
+
+
+void Assembler::vpxor(YMMRegister dst, YMMRegister src1, YMMRegister src2) {
+  EnsureSpace ensure_space(this);
+  emit_vex3_prefix(dst, src1, src2, kL256, k66, k0F);
+  emit(0xEF);
+  emit_sse_operand(dst, src2);
+}
+
+
+void Assembler::vpshufb(YMMRegister dst, YMMRegister src1, YMMRegister src2) {
+  EnsureSpace ensure_space(this);
+  emit_vex3_prefix(dst, src1, src2, kL256, k66, k0F38);
+  emit(0x00);
+  emit_sse_operand(dst, src2);
+}
+
+
+void Assembler::vpsrlw(YMMRegister dst, YMMRegister src, uint8_t shift) {
+  EnsureSpace ensure_space(this);
+  // The destination is encoded in vvvv, and the ModR/M reg field holds the
+  // opcode extension.
+  emit_vex3_prefix(2, dst.code(), src.high_bit(), kL256, k66, k0F);
+  emit(0x71);
+  emit(0xC0 | 2 << 3 | src.low_bits());
+  emit(shift);
+}
+
+
+void Assembler::vpmovmskb(Register dst, YMMRegister src) {
+  EnsureSpace ensure_space(this);
+  XMMRegister xdst = { dst.code() };
+  emit_vex3_prefix(xdst, ymm0, src, kL256, k66, k0F);
+  emit(0xD7);
+  emit_sse_operand(dst, src);
+}
+
+
+void Assembler::vzeroupper() {
+  EnsureSpace ensure_space(this);
+  emit(0xC5);
+  emit(0xF8);
+  emit(0x77);
+}
+
+
 // End of rejit specific code --------------------------------------------------
 
 
@@ -224,6 +224,27 @@ const XMMRegister xmm14 = { 14 };
 const XMMRegister xmm15 = { 15 };
 
 
+// The 256-bit AVX registers alias the xmm registers.
+typedef XMMRegister YMMRegister;
+
+const YMMRegister ymm0 = { 0 };
+const YMMRegister ymm1 = { 1 };
+const YMMRegister ymm2 = { 2 };
+const YMMRegister ymm3 = { 3 };
+const YMMRegister ymm4 = { 4 };
+const YMMRegister ymm5 = { 5 };
+const YMMRegister ymm6 = { 6 };
+const YMMRegister ymm7 = { 7 };
+const YMMRegister ymm8 = { 8 };
+const YMMRegister ymm9 = { 9 };
+const YMMRegister ymm10 = { 10 };
+const YMMRegister ymm11 = { 11 };
+const YMMRegister ymm12 = { 12 };
+const YMMRegister ymm13 = { 13 };
+const YMMRegister ymm14 = { 14 };
+const YMMRegister ymm15 = { 15 };
+
+
 typedef XMMRegister DoubleRegister;
 
 
@@ -418,7 +439,8 @@ class CpuFeatures {
     ASSERT(initialized_);
 #ifdef NO_SIMD
     // TODO: Introduce separate flags for different versions of SSE.
-    if (f == SSE2 || f == SSE3 || f == SSE4_1 || f == SSE4_2) {
+    if (f == SSE2 || f == SSE3 || f == SSSE3 || f == SSE4_1 ||
+        f == SSE4_2 || f == AVX2 || f == AVX512BW) {
       return false;
     }
 #endif
@@ -900,6 +922,10 @@ class Assembler : public AssemblerBase {
   void not_(const Operand& dst);
   void notl(Register dst);
 
+  void orb(const Operand& dst, Immediate src) {
+    immediate_arithmetic_op_8(0x1, dst, src);
+  }
+
   void or_(Register dst, Register src) {
     arithmetic_op(0x0B, dst, src);
   }
@@ -1116,6 +1142,7 @@ class Assembler : public AssemblerBase {
 
   // Bit operations.
   void bt(const Operand& dst, Register src);
+  void bt(Register dst, Register src);
   void bts(const Operand& dst, Register src);
 
   // Miscellaneous
@@ -1474,6 +1501,36 @@ class Assembler : public AssemblerBase {
   void movdqu(const Operand& dst, XMMRegister src);
   void movdqu(XMMRegister dst, const Operand& src);
 
+  // Packed integer SSE instructions.
+  void pand(XMMRegister dst, XMMRegister src);
+  void por(XMMRegister dst, XMMRegister src);
+  void pxor(XMMRegister dst, XMMRegister src);
+  void pcmpeqb(XMMRegister dst, XMMRegister src);
+  void psrlw(XMMRegister dst, uint8_t shift);
+  void pmovmskb(Register dst, XMMRegister src);
+  // SSSE3.
+  void pshufb(XMMRegister dst, XMMRegister src);
+
+  // Bit scan forward. The result is undefined if src is 0.
+  void bsfq(Register dst, Register src);
+
+  // AVX2 instructions. They all operate on the full 256 bits of the ymm
+  // registers.
+  void vmovdqu(YMMRegister dst, const Operand& src);
+  void vpbroadcastb(YMMRegister dst, XMMRegister src);
+  void vpbroadcastb(YMMRegister dst, const Operand& src);
+  void vpcmpeqb(YMMRegister dst, YMMRegister src1, YMMRegister src2);
+  void vpcmpeqb(YMMRegister dst, YMMRegister src1, const Operand& src2);
+  void vpand(YMMRegister dst, YMMRegister src1, YMMRegister src2);
+  void vpor(YMMRegister dst, YMMRegister src1, YMMRegister src2);
+  void vpxor(YMMRegister dst, YMMRegister src1, YMMRegister src2);
+  void vpshufb(YMMRegister dst, YMMRegister src1, YMMRegister src2);
+  void vpsrlw(YMMRegister dst, YMMRegister src, uint8_t shift);
+  void vpmovmskb(Register dst, YMMRegister src);
+  // Clear the upper halves of the ymm registers. This must be executed before
+  // going back to legacy SSE code to avoid transition penalties.
+  void vzeroupper();
+
   // End of rejit added code -------------------------------
 
  protected:
@@ -1578,6 +1635,24 @@ class Assembler : public AssemblerBase {
   // numbers have a high bit set.
   inline void emit_optional_rex_32(const Operand& op);
 
+  // Emit a three-byte VEX prefix.
+  // `reg` is the register encoded in the ModR/M reg field, `vreg` the
+  // additional source register, and `rm_rex` the REX.X and REX.B bits
+  // required by the ModR/M r/m field.
+  enum VexLength { kL128 = 0, kL256 = 1 };
+  enum VexSIMDPrefix { kNoPrefix = 0, k66 = 1, kF3 = 2, kF2 = 3 };
+  enum VexLeadingOpcode { k0F = 1, k0F38 = 2, k0F3A = 3 };
+  void emit_vex3_prefix(int reg, int vreg, int rm_rex,
+                        VexLength l, VexSIMDPrefix pp, VexLeadingOpcode m);
+  void emit_vex3_prefix(XMMRegister reg, XMMRegister vreg, XMMRegister rm,
+                        VexLength l, VexSIMDPrefix pp, VexLeadingOpcode m) {
+    emit_vex3_prefix(reg.code(), vreg.code(), rm.high_bit(), l, pp, m);
+  }
+  void emit_vex3_prefix(XMMRegister reg, XMMRegister vreg, const Operand& rm,
+                        VexLength l, VexSIMDPrefix pp, VexLeadingOpcode m) {
+    emit_vex3_prefix(reg.code(), vreg.code(), rm.rex_, l, pp, m);
+  }
+
 
   // Emit the ModR/M byte, and optionally the SIB byte and
   // 1- or 4-byte offset for a memory operand.  Also encodes
@@ -26,6 +26,11 @@ namespace internal {
 Codegen::Codegen()
   : masm_(new MacroAssembler()),
     rinfo_(NULL),
+    counted_headers_size_(0),
+    counted_queues_size_(0),
+    frame_size_(0),
+    frame_clean_size_(0),
+    packed_states_(false),
     ring_base_(rax, 0),
     fast_forward_(NULL),
     unwind_and_return_(NULL) {}
@@ -61,11 +66,12 @@ Operand Codegen::StateOperand(int time, int state_index) {
                  ring_index,
                  times_1,
                  StateRingBaseOffsetFromFrame() +
-                 time * state_ring_time_size() + state_index * kPointerSize);
+                 time * state_ring_time_size() + StateOffset(state_index));
 }
 
 
 Operand Codegen::StateOperand(int time, Register state_index) {
+  ASSERT(!packed_states_);
   __ movq(scratch, state_index);
   __ shl(scratch, Immediate(kPointerSizeLog2));
   __ addq(scratch, ring_index);
@@ -79,7 +85,7 @@ void Codegen::ComputeStateOperandOffset(Register offset, int time, int index) {
   ASSERT(!offset.is(scratch1));
   __ Move(scratch1, 0);
   __ Move(offset,
-       time * state_ring_time_size() + index * kPointerSize);
+       time * state_ring_time_size() + StateOffset(index));
   __ addq(offset, ring_index);
 
   __ cmpq(offset, Immediate(state_ring_size()));
@@ -95,30 +101,91 @@ Operand Codegen::StateOperand(Register offset) {
 }
 
 
+int Codegen::CountedHeadersOffsetFromFrame() {
+  return StateRingBaseOffsetFromFrame() - counted_headers_size();
+}
+
+
+int Codegen::CountedQueuesOffsetFromFrame() {
+  return CountedHeadersOffsetFromFrame() - counted_queues_size();
+}
+
+
+Operand Codegen::CountedQueueHead(int index) {
+  return Operand(rbp,
+                 CountedHeadersOffsetFromFrame() + 2 * index * kPointerSize);
+}
+
+
+Operand Codegen::CountedQueueTail(int index) {
+  return Operand(rbp, CountedHeadersOffsetFromFrame() +
+                 (2 * index + 1) * kPointerSize);
+}
+
+
+void Codegen::ComputeCountedEntryOffset(Register offset, int index,
+                                        Register entry_index) {
+  if (!offset.is(entry_index)) {
+    __ movq(offset, entry_index);
+  }
+  __ and_(offset, Immediate(counted_queues_capacities_[index] - 1));
+  __ shl(offset, Immediate(kCountedEntrySizeLog2));
+}
+
+
+Operand Codegen::CountedEntry(int index, Register offset, int field_offset) {
+  return Operand(rbp, offset, times_1, CountedQueuesOffsetFromFrame() +
+                 counted_queues_offsets_[index] + field_offset);
+}
+
+
+uint64_t Codegen::CpuFeaturesFingerprint() {
+  if (!CpuFeatures::initialized()) {
+    CpuFeatures::Probe();
+  }
+  const CpuFeature features[] = {SSE2, SSE3, SSSE3, SSE4_1, SSE4_2, AVX512BW};
+  uint64_t fingerprint = 0;
+  for (CpuFeature feature : features) {
+    if (CpuFeatures::IsAvailable(feature)) {
+      fingerprint |= 1ULL << feature;
+    }
+  }
+  if (FLAG_use_avx2 && CpuFeatures::IsAvailable(AVX2)) {
+    fingerprint |= 1ULL << AVX2;
+  }
+  return fingerprint;
+}
+
+
 // This is the entry point from C++.
 void Codegen::Generate() {
   if (!CpuFeatures::initialized()) {
     CpuFeatures::Probe();
   }
 
-  Label matching, unwind_and_return;
+  Label matching, unwind_and_return, return_without_frame;
   unwind_and_return_ = &unwind_and_return;
 
   __ push(rbp);
   __ movq(rbp, rsp);
   __ PushCalleeSavedRegisters();
 
+  if (match_type_ == kMatchCount) {
+    __ Move(match_count, 0);
+  }
+
   if (FLAG_emit_debug_code) {
     // Check that the base string we were passed is not null.
     __ testq(rdi, rdi);
     __ debug_msg(zero, "base string is NULL.\n");
-    __ j(zero, &unwind_and_return);
+    __ j(zero, &return_without_frame);
 
     // Check the match results pointer.
-    if (match_type_ != kMatchFull && !FLAG_benchtest) {
+    if (match_type_ != kMatchFull && match_type_ != kMatchCount &&
+        !FLAG_benchtest) {
       __ testq(rdx, rdx);
       __ debug_msg(zero, "match results pointer is NULL.\n");
-      __ j(zero, &unwind_and_return);
+      __ j(zero, &return_without_frame);
     }
   }
 
@@ -127,31 +194,65 @@ void Codegen::Generate() {
   __ movq(string_base, rdi);
   __ movq(string_end, rdi);
   __ addq(string_end, rsi);
-  __ movq(result_matches, rdx);
+  if (match_type_ != kMatchCount) {
+    __ movq(result_matches, rdx);
+  }
+
+  // The frame is the last argument. It is allocated by the caller, so large
+  // state rings cannot overflow the stack.
+  // It is addressed from rbp as if it were on the stack below the callee saved
+  // registers, and rbp is restored before returning.
+  //  0x0                  : (Callee saved registers, on the stack.)
+  // -CalleeSavedRegsSize  : Saved state. See definition of kStateInfoSize for
+  //                         comments.
+  //                       : Time summary.
+  //                       : State ring.
+  //                       : Heads and tails of the counted repetitions queues.
+  // -frame_clean_size_    : Counted repetitions queues, not cleared.
+  // -frame_size_          : Start of the frame.
+  // The time summary, state ring, and queue heads and tails must be zeroed when
+  // the code is called. Instead of clearing them on every call, the code clears
+  // the times it used before returning, so the caller can reuse the frame as
+  // is. See ClearAllTimes.
+  const Register frame = (match_type_ == kMatchFirst ||
+                          match_type_ == kMatchAll ||
+                          match_type_ == kMatchSet) ? rcx : rdx;
+  frame_clean_size_ = kStateInfoSize + state_ring_size() +
+    time_summary_size() + counted_headers_size();
+  frame_size_ = frame_clean_size_ + counted_queues_size();
+  if (FLAG_emit_debug_code) {
+    __ testq(frame, frame);
+    __ debug_msg(zero, "frame pointer is NULL.\n");
+    __ j(zero, &return_without_frame);
+  }
+  __ lea(rbp, Operand(frame, frame_size_ + CalleeSavedRegsSize()));
 
-  // Reserve space on the stack.
-  const size_t reserved_space =
-    kStateInfoSize + state_ring_size() + time_summary_size();
-  __ subq(rsp, Immediate(reserved_space));
+  if (FLAG_emit_debug_code) {
+    Label check_clean;
+    __ lea(scratch2, Operand(rbp, -CalleeSavedRegsSize() - frame_clean_size_));
+    __ lea(scratch3, Operand(rbp, -CalleeSavedRegsSize() - kStateInfoSize));
+    __ Move(scratch1, 0);
+    __ bind(&check_clean);
+    __ or_(scratch1, Operand(scratch2, 0));
+    __ addq(scratch2, Immediate(kPointerSize));
+    __ cmpq(scratch2, scratch3);
+    __ j(below, &check_clean);
+    __ testq(scratch1, scratch1);
+    __ debug_msg(not_zero, "frame is not clean.\n");
+    __ j(not_zero, &return_without_frame);
+  }
 
   if (FLAG_use_fast_forward && FLAG_use_fast_forward_early &&
       (match_type_ != kMatchFull)) {
     GenerateFastForwardEarly();
-    // We have a potential match. Fall through to the stack setup.
+    // We have a potential match. Fall through to the frame setup.
   }
 
-  // Set up the stack.
-  //  0x8 and up     : callee saved registers
-  //  0x0            : rbp caller's rbp.
-  // -kStateInfoSize : Saved state. See definition of kStateInfoSize for
-  //                   comments.
-  // -reserved_space : State ring.
-
   __ Move(ring_index, 0);
-  __ movq(scratch1, rsp);
-  __ addq(scratch1, Immediate(reserved_space));
-  Register zero = ring_index;
-  __ MemZero(rsp, scratch1, zero, MacroAssembler::AtLowAddress);
+  for (int field = 1; field <= kStateInfoFields; field++) {
+    __ movq(Operand(rbp, -CalleeSavedRegsSize() - field * kPointerSize),
+            ring_index);
+  }
 
   // Set up the rest of the information.
   __ movq(ff_position, string_pointer);
@@ -192,8 +293,14 @@ void Codegen::Generate() {
 
   // Unwind the stack and return.
   __ bind(&unwind_and_return);
+  // Leave the frame clean for the next call.
+  ClearAllTimes();
+  __ bind(&return_without_frame);
+  if (match_type_ == kMatchCount) {
+    __ movq(rax, match_count);
+  }
   __ cld();
-  __ addq(rsp, Immediate(reserved_space));
+  __ lea(rbp, Operand(rsp, CalleeSavedRegsSize()));
   __ PopCalleeSavedRegisters();
   __ pop(rbp);
   __ ret(0);
@@ -219,8 +326,7 @@ void Codegen::FlowTime() {
   __ movq(scratch1, TimeSummary(offset));
   __ shr(scratch1, Immediate(1));
   __ movq(TimeSummary(offset), scratch1);
-  for (offset = offset - kPointerSize; offset >= 0; offset--) {
-    // TODO(rames): TEST.
+  for (offset = offset - kPointerSize; offset >= 0; offset -= kPointerSize) {
     // TODO(rames): Optimize.
     __ setcc(carry, scratch2);
     __ movq(scratch1, TimeSummary(offset));
@@ -268,12 +374,19 @@ void Codegen::CheckTimeFlow(Direction direction,
         __ Move(rax, 1);
         TestTimeFlow();
         __ j(zero, limit);
-      } else {  // kMatchAll
+      } else {  // kMatchAll or kMatchCount
         RegisterMatch();
       }
 
       __ bind(&done);
 
+    } else if (match_type_ == kMatchSet && direction == kForward) {
+      TestTimeFlow();
+      __ j(not_zero, &done);
+      // Matching forward went past the ff_position, but other regexps of the
+      // set may match from there.
+      FastForwardAfterSetMatching(limit);
+
     } else {
       TestTimeFlow();
       __ j(not_zero, &done);
@@ -285,10 +398,10 @@ void Codegen::CheckTimeFlow(Direction direction,
               Immediate(0));
       __ j(zero, fast_forward_);
 
-      if (match_type_ != kMatchAll) {
+      if (!LooksForAllMatches()) {
         __ jmp(limit);
 
-      } else {  // kMatchAll
+      } else {  // kMatchAll or kMatchCount
         if (direction == kBackward) {
           if (!rinfo_->ff_requires_full_forward_matching()) {
             __ movq(string_pointer, backward_match);
@@ -350,7 +463,6 @@ bool Codegen::GenerateFastForward_(bool early) {
     __ Move(scratch, 0);
     __ movq(backward_match, scratch);
     __ movq(forward_match,  scratch);
-    __ movq(last_match_end, scratch);
   }
   ffgen.Generate(early ? FastForwardGen::FallThrough
                        : FastForwardGen::SetStateFallThrough);
@@ -386,7 +498,9 @@ void Codegen::HandleControlRegexps() {
   } else {
     vector<ControlRegexp*>::reverse_iterator it;
     for (it = ctrl_list->rbegin(); it != ctrl_list->rend(); ++it) {
-      Visit(*it);
+      if (backward_states_[(*it)->exit_state()]) {
+        Visit(*it);
+      }
     }
   }
 
@@ -406,6 +520,9 @@ void Codegen::CheckMatch(Direction direction,
     //  - when hitting the terminating '\0' or the beginning of the string.
     //  - when time stops flowing.
 
+  } else if (match_type_ == kMatchSet && direction == kForward) {
+    CheckSetMatches();
+
   } else {
     Label no_match;
 
@@ -414,11 +531,6 @@ void Codegen::CheckMatch(Direction direction,
     __ j(zero, &no_match);
 
     if (direction == kBackward) {
-      if (match_type_ == kMatchAll) {
-        // A new match cannot start before the latest match finishes.
-        __ cmpq(string_pointer, last_match_end);
-        __ j(below, limit);
-      }
       // TODO: Potential optimisation for kMatchAnywhere. In some situations we
       // could stop matching backward and jump back to fast-forward.
       __ movq(backward_match, string_pointer);
@@ -430,7 +542,7 @@ void Codegen::CheckMatch(Direction direction,
         __ Move(rax, 1);
         __ jmp(unwind_and_return_);
       } else {
-        if (!fast_forward_ && match_type_ == kMatchAll) {
+        if (!fast_forward_ && LooksForAllMatches()) {
           // Check if we were still waiting for the time to stop to register a
           // previous match.
           Label no_unregistered_match;
@@ -452,7 +564,7 @@ void Codegen::CheckMatch(Direction direction,
           __ movq(backward_match, scratch1);
           // We must clear more recent threads that are still running to avoid the
           // older match to be overridden.
-          if (match_type_ == kMatchAll) {
+          if (LooksForAllMatches()) {
             ClearStates(scratch1, string_pointer);
           } else {
             ClearStates(scratch1);
@@ -466,6 +578,31 @@ void Codegen::CheckMatch(Direction direction,
 }
 
 
+void Codegen::FastForwardAfterSetMatching(Label* done) {
+  ASSERT(fast_forward_);
+  __ movq(scratch, ff_position);
+  __ cmpq(scratch, string_end);
+  __ j(above_equal, done);
+  ClearAllTimes();
+  __ jmp(fast_forward_);
+}
+
+
+void Codegen::CheckSetMatches() {
+  // Unlike for kMatchAnywhere, matching goes on after a match is found, as
+  // other regexps of the set may still match.
+  vector<int>* exit_states = rinfo_->set_exit_states();
+  __ Move(scratch2, 1);
+  for (size_t i = 0; i < exit_states->size(); i++) {
+    Label no_match;
+    TestState(0, exit_states->at(i));
+    __ j(zero, &no_match);
+    __ movb(Operand(result_matches, i), scratch2);
+    __ bind(&no_match);
+  }
+}
+
+
 void Codegen::RegisterMatch() {
   Label done;
   switch (match_type_) {
@@ -488,9 +625,7 @@ void Codegen::RegisterMatch() {
         __ movq(rdx, forward_match);
         __ movq(rsi, backward_match);
         __ movq(last_match_end, rdx);
-        if (!fast_forward_) {
-          __ CallCpp(FUNCTION_ADDR(MatchAllAppendFilter));
-        } else {
+        if (fast_forward_) {
           // Avoid infinite loop if the end of the match is the same as the ff
           // position that yielded it.
           __ Move(scratch, 0);
@@ -498,9 +633,8 @@ void Codegen::RegisterMatch() {
           __ setcc(not_equal, scratch);
           __ movq(ff_position, rdx);
           __ subq(ff_position, scratch);
-
-          __ CallCpp(FUNCTION_ADDR(MatchAllAppendFilter));
         }
+        BufferMatch();
       }
 
       __ movq(scratch1, forward_match);
@@ -511,8 +645,89 @@ void Codegen::RegisterMatch() {
       __ movq(forward_match,  Immediate(0));
       break;
     }
+    case kMatchCount: {
+      // Codegen::Compile only generates kMatchCount code when fast-forwarding.
+      // Matches are then registered in order, but a match can still supersede
+      // the last few matches registered (see MatchAllAppendFilter). The count
+      // history allows to discount them. A match superseding matches dropped
+      // from the history cannot be discounted, and the count is left to
+      // MatchAll (see Regej::MatchAllCount).
+      ASSERT(fast_forward_);
+      Label discount, discount_next, discount_done, count, store, done_counting;
+      STATIC_ASSERT((kCountHistorySize & (kCountHistorySize - 1)) == 0);
+      const int kCountHistoryMask = kCountHistorySize - 1;
+      const Register top = scratch1;
+      const Register size = scratch2;
+
+      __ movq(rdx, forward_match);
+      __ movq(rsi, backward_match);
+      __ movq(last_match_end, rdx);
+      // Same as for kMatchAll.
+      __ Move(scratch, 0);
+      __ cmpq(rdx, ff_position);
+      __ setcc(not_equal, scratch);
+      __ movq(ff_position, rdx);
+      __ subq(ff_position, scratch);
+
+      __ movq(top, count_history_top);
+      __ movq(size, count_history_size);
+
+      // Discount the matches starting at or after the new match.
+      __ bind(&discount);
+      __ testq(size, size);
+      __ j(not_zero, &discount_next);
+      __ cmpq(count_history_dropped, rsi);
+      __ j(below, &discount_done);
+      __ Move(match_count, kMatchCountOverflow);
+      __ jmp(unwind_and_return_);
+      __ bind(&discount_next);
+      __ cmpq(CountHistoryEntry(top, offsetof(Match, begin)), rsi);
+      __ j(below, &discount_done);
+      __ decq(match_count);
+      __ decq(size);
+      __ subq(top, Immediate(kCountHistoryEntrySize));
+      __ and_(top, Immediate(kCountHistoryMask));
+      __ jmp(&discount);
+      __ bind(&discount_done);
+
+      // Ignore a match of length 0 starting where the previous match finished.
+      __ cmpq(rsi, rdx);
+      __ j(not_equal, &count);
+      __ testq(size, size);
+      __ j(zero, &count);
+      __ cmpq(CountHistoryEntry(top, offsetof(Match, end)), rsi);
+      __ j(equal, &done_counting);
+
+      __ bind(&count);
+      __ addq(top, Immediate(kCountHistoryEntrySize));
+      __ and_(top, Immediate(kCountHistoryMask));
+      // When the history is full the oldest entry is overwritten.
+      __ cmpq(size, Immediate(kCountHistoryLength));
+      __ j(not_equal, &store);
+      __ movq(scratch3, CountHistoryEntry(top, offsetof(Match, begin)));
+      __ movq(count_history_dropped, scratch3);
+      __ decq(size);
+      __ bind(&store);
+      __ movq(CountHistoryEntry(top, offsetof(Match, begin)), rsi);
+      __ movq(CountHistoryEntry(top, offsetof(Match, end)), rdx);
+      __ incq(match_count);
+      __ incq(size);
+
+      __ bind(&done_counting);
+      __ movq(count_history_top, top);
+      __ movq(count_history_size, size);
+
+      __ cmpq(rdx, string_end);
+      __ j(equal, unwind_and_return_);
+
+      __ movq(backward_match, Immediate(0));
+      __ movq(forward_match,  Immediate(0));
+      break;
+    }
     case kMatchAnywhere:
-      // There is nothing to register.
+    case kMatchSet:
+      // There is nothing to register. kMatchSet code flags the regexps matching
+      // in CheckSetMatches.
       __ movq(backward_match, Immediate(0));
       break;
     default:
@@ -522,6 +737,63 @@ void Codegen::RegisterMatch() {
 }
 
 
+void Codegen::BufferMatch() {
+  // This performs the same filtering as MatchAllAppendFilter, but only against
+  // the matches still in the buffer. If the buffer becomes empty, the filtering
+  // against the matches already flushed is done by MatchAllFlush.
+  Label discard, discard_done, write, write_match, done;
+  const Register cursor = scratch1;
+  const Operand buffer_cursor = Operand(rdi, offsetof(MatchBuffer, cursor));
+  const Operand buffer_base = Operand(rdi, offsetof(MatchBuffer, base));
+  const Operand buffer_limit = Operand(rdi, offsetof(MatchBuffer, limit));
+  const int previous_begin_offset =
+    static_cast<int>(offsetof(Match, begin)) - static_cast<int>(sizeof(Match));
+  const int previous_end_offset =
+    static_cast<int>(offsetof(Match, end)) - static_cast<int>(sizeof(Match));
+  const Operand previous_begin = Operand(cursor, previous_begin_offset);
+  const Operand previous_end = Operand(cursor, previous_end_offset);
+
+  __ movq(cursor, buffer_cursor);
+
+  // Discard the buffered matches starting at or after the new match.
+  __ bind(&discard);
+  __ cmpq(cursor, buffer_base);
+  __ j(equal, &discard_done);
+  __ cmpq(previous_begin, rsi);
+  __ j(below, &discard_done);
+  __ subq(cursor, Immediate(sizeof(Match)));
+  __ jmp(&discard);
+  __ bind(&discard_done);
+
+  // Ignore a match of length 0 starting where the previous match finished.
+  __ cmpq(rsi, rdx);
+  __ j(not_equal, &write);
+  __ cmpq(cursor, buffer_base);
+  __ j(equal, &write);
+  __ cmpq(previous_end, rsi);
+  __ j(equal, &done);
+
+  __ bind(&write);
+  __ cmpq(cursor, buffer_limit);
+  __ j(below, &write_match);
+  __ movq(buffer_cursor, cursor);
+  __ CallCpp(FUNCTION_ADDR(MatchAllFlush));
+  __ movq(cursor, buffer_cursor);
+  // The buffer has no associated vector and is full. We still need to go
+  // through the matches found later, as they can render some of the buffered
+  // matches invalid and free space in the buffer.
+  __ cmpq(cursor, buffer_limit);
+  __ j(equal, &done);
+  __ bind(&write_match);
+  __ movq(Operand(cursor, offsetof(Match, begin)), rsi);
+  __ movq(Operand(cursor, offsetof(Match, end)), rdx);
+  __ addq(cursor, Immediate(sizeof(Match)));
+
+  __ bind(&done);
+  __ movq(buffer_cursor, cursor);
+}
+
+
 void Codegen::set_direction(Direction dir) {
   direction_ = dir;
   if (direction() == kForward) {
@@ -548,6 +820,10 @@ void Codegen::GenerateMatchDirection(Direction direction) {
       __ j(above, &done);
       __ cmpq(forward_match, Immediate(0));
       __ j(above, &done);
+    } else if (match_type_ == kMatchFirst) {
+      // A match starting after the match found cannot be the first one.
+      __ cmpq(forward_match, Immediate(0));
+      __ j(above, &done);
     }
     SetStateForce(0, rinfo_->entry_state());
     __ bind(&done);
@@ -559,6 +835,12 @@ void Codegen::GenerateMatchDirection(Direction direction) {
 
   __ cmpq(string_pointer, direction == kForward ? string_end : string_base);
   __ j(equal, &limit);
+  if (direction == kBackward && LooksForAllMatches()) {
+    // Matches cannot start before the end of the previous match, so there is
+    // no need to look at the text before it.
+    __ cmpq(string_pointer, last_match_end);
+    __ j(below_equal, &limit);
+  }
 
   GenerateTransitions(direction);
 
@@ -590,7 +872,12 @@ void Codegen::GenerateMatchDirection(Direction direction) {
     // Control will fall through to unwind_and_return.
 
   } else {
-    if (direction == kForward) {
+    if (direction == kForward && match_type_ == kMatchSet) {
+      if (fast_forward_) {
+        FastForwardAfterSetMatching(&done_matching);
+      }
+
+    } else if (direction == kForward) {
       __ Move(rax, 0);
       __ cmpq(forward_match, Immediate(0));
       __ j(zero, &done_matching);
@@ -599,7 +886,7 @@ void Codegen::GenerateMatchDirection(Direction direction) {
       __ Move(rax, 1);
       RegisterMatch();
 
-      if (match_type_ == kMatchAll) {
+      if (LooksForAllMatches()) {
         // If the ff_position is already at the eos, we should exit here.
         // Otherwise we reset the state ring and continue looking for matches.
         __ movq(scratch, ff_position);
@@ -661,6 +948,10 @@ void Codegen::GenerateTransitions(Direction direction) {
   Label skip;
   int current_state = -1;
   for (MatchingRegexp *re : *gen_list) {
+    if (direction == kBackward && !backward_states_[re->exit_state()]) {
+      // This regexp is after the fast-forward elements.
+      continue;
+    }
     if ((direction == kForward && re->entry_state() != current_state) ||
         (direction == kBackward && re->exit_state() != current_state)) {
       __ bind(&skip);
@@ -674,6 +965,17 @@ void Codegen::GenerateTransitions(Direction direction) {
     Visit(re);
   }
   __ bind(&skip);
+
+  // Counted repetitions must see every character, as they track the entries
+  // made at previous positions.
+  vector<Repetition*>* counted_list = rinfo_->re_counted_list();
+  for (size_t index = 0; index < counted_list->size(); index++) {
+    if (direction == kBackward &&
+        !backward_states_[counted_list->at(index)->exit_state()]) {
+      continue;
+    }
+    GenerateCountedRepetition(index);
+  }
 }
 
 
@@ -749,11 +1051,25 @@ static void CheckEnoughStringLength(MacroAssembler *masm_,
 }
 
 
+// Returns the bits to set in n_chars characters of the text to compare them
+// with the (lowercase) characters of a folding mc: the case bit of letters.
+static uint64_t CaseBits(const char* chars, unsigned n_chars) {
+  uint64_t bits = 0;
+  for (unsigned i = 0; i < n_chars; i++) {
+    if (IsAsciiLetter(chars[i])) {
+      bits |= static_cast<uint64_t>(kCaseBit) << (i * kBitsPerByte);
+    }
+  }
+  return bits;
+}
+
+
 // Try to match mc from the current string_pointer position.
 // string_pointer is not modified.
 // On output the condition flags will match equal/not_equal depending on wether
 // there is a match or not.
 // If provided, fixed_chars contains the min(8, n_chars) first bytes of the mc.
+// It must not be provided for folding mcs, which clobber scratch and rcx.
 static void MatchMultipleChar(MacroAssembler *masm_,
                               Direction direction,
                               MultipleChar* mc,
@@ -770,13 +1086,36 @@ static void MatchMultipleChar(MacroAssembler *masm_,
                             on_no_match ? on_no_match : &done);
   }
 
-  if (direction == kBackward) {
-    __ dec_c(string_pointer);
+  // The string pointer is not moved, so that it is still valid when jumping to
+  // on_no_match.
+  const int offset = direction == kForward ? 0 : -n_chars;
+  const Operand c = Operand(string_pointer, offset);
+
+  if (mc->fold()) {
+    ASSERT(!fixed_chars.is_valid());
+    // Set the case bit of the letters in the text, and compare it with the
+    // characters of the mc, by chunks of up to 8 characters.
+    unsigned index = 0;
+    while (index < n_chars) {
+      unsigned left = n_chars - index;
+      unsigned width = left >= 8 ? 8 : left >= 4 ? 4 : left >= 2 ? 2 : 1;
+      uint64_t chars = 0;
+      memcpy(&chars, mc->chars() + index, width);
+      uint64_t case_bits = CaseBits(mc->chars() + index, width);
+      __ mov_truncated(width, scratch, Operand(string_pointer, offset + index));
+      if (case_bits) {
+        __ Move(rcx, case_bits);
+        __ or_(scratch, rcx);
+      }
+      __ Move(rcx, chars);
+      __ cmp_truncated(width, scratch, rcx);
+      __ j(not_equal, on_no_match ? on_no_match : &done);
+      index += width;
+    }
+    __ bind(&done);
+    return;
   }
 
-  const Operand c = direction == kForward ?
-    current_chars : Operand(string_pointer, -(n_chars - 1));
-
   if (!fixed_chars.is_valid()) {
     __ cmp_truncated(n_chars, c, mc->imm_chars());
   } else {
@@ -814,26 +1153,22 @@ static void MatchMultipleChar(MacroAssembler *masm_,
   }
 
   if (n_chars > 8) {
-    __ movq(rsi, string_pointer);
-    if (direction == kForward) {
-      __ Move(rdi, (uint64_t)(mc->chars()));
-    } else {
-      __ Move(rdi, (uint64_t)(mc->chars() + n_chars - 1));
-    }
-    __ Move(rcx, n_chars / 8);
-    __ repnecmpsq();
-    if (n_chars % 8 > 0) {
-      __ Move(rcx, n_chars % 8);
-      __ repnecmpsb();
-    }
-    if (on_no_match) {
-      __ j(not_equal, on_no_match);
+    // The first 8 characters were checked above. Compare the others by chunks
+    // of up to 8 characters.
+    unsigned index = 8;
+    while (index < n_chars) {
+      unsigned left = n_chars - index;
+      unsigned width = left >= 8 ? 8 : left >= 4 ? 4 : left >= 2 ? 2 : 1;
+      uint64_t chars = 0;
+      memcpy(&chars, mc->chars() + index, width);
+      __ mov_truncated(width, scratch, Operand(string_pointer, offset + index));
+      __ Move(rcx, chars);
+      __ cmp_truncated(width, scratch, rcx);
+      __ j(not_equal, on_no_match ? on_no_match : &done);
+      index += width;
     }
   }
   __ bind(&done);
-  if (direction == kBackward) {
-    __ inc_c(string_pointer);
-  }
 }
 
 
@@ -875,6 +1210,9 @@ void Codegen::VisitPeriod(Period* period) {
 
 // If the current character matches, jump to 'on_matching_char', else fall
 // through.
+// Beyond this number of compare instructions MatchBracket uses a bitmap.
+static const unsigned kMaxBracketCompares = 4;
+
 static void MatchBracket(MacroAssembler *masm_,
                          const Operand& c,
                          Bracket* bracket,
@@ -885,6 +1223,29 @@ static void MatchBracket(MacroAssembler *masm_,
     __ j(equal, on_eos);
   }
 
+  // Brackets with more than a few items are tested with a lookup in a bitmap
+  // of the characters in the bracket.
+  unsigned n_compares =
+    bracket->single_chars()->size() + 3 * bracket->char_ranges()->size();
+  if (n_compares > kMaxBracketCompares) {
+    uint8_t bitmap[32];
+    bracket->ComputeBitmap(bitmap);
+    if (bracket->flags() & Bracket::non_matching) {
+      // We look for the characters in the bracket, not those it matches.
+      for (int i = 0; i < 32; i++) {
+        bitmap[i] = ~bitmap[i];
+      }
+    }
+    __ movzxbl(rax, c);
+    __ movl(rcx, rax);
+    __ shrl(rcx, Immediate(6));
+    __ lea(rdx, __ RelocatedConstant(reinterpret_cast<char*>(bitmap), 32));
+    __ movq(rdx, Operand(rdx, rcx, times_8, 0));
+    __ bt(rdx, rax);
+    __ j(carry, on_matching_char);
+    return;
+  }
+
   __ movb(rax, c);
 
   vector<char>::const_iterator it;
@@ -932,11 +1293,135 @@ void Codegen::VisitBracket(Bracket* bracket) {
   __ bind(&no_match);
 }
 
+// Jump to 'on_match' if the character matches the single character regexp,
+// else fall through.
+static void MatchSingleCharRegexp(MacroAssembler *masm_,
+                                  const Operand& c,
+                                  Regexp* re,
+                                  Label* on_match) {
+  Label no_match;
+  if (re->IsPeriod()) {
+    __ cmpb(c, Immediate('\n'));
+    __ j(equal, &no_match);
+    __ cmpb(c, Immediate('\r'));
+    __ j(equal, &no_match);
+    __ jmp(on_match);
+
+  } else if (re->IsBracket()) {
+    Bracket* bracket = re->AsBracket();
+    if (bracket->flags() & Bracket::non_matching) {
+      MatchBracket(masm_, c, bracket, &no_match);
+      __ jmp(on_match);
+    } else {
+      MatchBracket(masm_, c, bracket, on_match);
+    }
+
+  } else {
+    MultipleChar* mc = re->AsMultipleChar();
+    ASSERT(mc->chars_length() == 1);
+    char expected = mc->chars()[0];
+    if (mc->fold() && IsAsciiLetter(expected)) {
+      __ movzxbl(rax, c);
+      __ or_(rax, Immediate(kCaseBit));
+      __ cmpb_al(Immediate(expected | kCaseBit));
+    } else {
+      __ cmpb(c, Immediate(expected));
+    }
+    __ j(equal, on_match);
+  }
+  __ bind(&no_match);
+}
+
+
+// Counted repetitions match their sub regexp from 1 to max_rep times. The
+// entries made while the text matches the sub regexp are kept in a queue,
+// oldest first. An entry stays in the queue until it has seen max_rep
+// characters, and the match source of the oldest entry is propagated to the
+// output state.
+// Entries at the tail of the queue whose match source is not older than the
+// match source of a new entry are dropped, as the new entry will outlive them.
+// So the work per character does not depend on max_rep.
+void Codegen::GenerateCountedRepetition(int index) {
+  Repetition* counted = rinfo_->re_counted_list()->at(index);
+  int in_state = direction() == kForward ? counted->entry_state()
+                                         : counted->exit_state();
+  int out_state = direction() == kForward ? counted->exit_state()
+                                          : counted->entry_state();
+  Label in_run, no_entry, drop_tail, push, output, done;
+
+  MatchSingleCharRegexp(masm_,
+                        direction() == kForward ? current_char : previous_char,
+                        counted->sub_regexp(), &in_run);
+  // The run of matching characters is broken. Drop all the entries.
+  __ movq(rax, CountedQueueTail(index));
+  __ movq(CountedQueueHead(index), rax);
+  __ jmp(&done);
+
+  __ bind(&in_run);
+  TestState(0, in_state);
+  __ j(zero, &no_entry);
+  if (packed_states_) {
+    __ Move(rdx, 1);
+  } else {
+    __ movq(rdx, StateOperand(0, in_state));
+  }
+  __ movq(rax, CountedQueueTail(index));
+  __ bind(&drop_tail);
+  __ cmpq(rax, CountedQueueHead(index));
+  __ j(equal, &push);
+  __ lea(rcx, Operand(rax, -1));
+  ComputeCountedEntryOffset(rcx, index, rcx);
+  __ cmpq(CountedEntry(index, rcx, kCountedEntrySource), rdx);
+  __ j(below, &push);
+  __ decq(rax);
+  __ jmp(&drop_tail);
+  __ bind(&push);
+  ComputeCountedEntryOffset(rcx, index, rax);
+  __ movq(CountedEntry(index, rcx, kCountedEntryPosition), string_pointer);
+  __ movq(CountedEntry(index, rcx, kCountedEntrySource), rdx);
+  __ incq(rax);
+  __ movq(CountedQueueTail(index), rax);
+
+  __ bind(&no_entry);
+  // Drop the oldest entry if it has seen max_rep characters. The code runs for
+  // every character, so no other entry can be that old.
+  __ movq(rax, CountedQueueHead(index));
+  __ cmpq(rax, CountedQueueTail(index));
+  __ j(equal, &done);
+  ComputeCountedEntryOffset(rcx, index, rax);
+  if (direction() == kForward) {
+    __ movq(rdx, string_pointer);
+    __ subq(rdx, CountedEntry(index, rcx, kCountedEntryPosition));
+  } else {
+    __ movq(rdx, CountedEntry(index, rcx, kCountedEntryPosition));
+    __ subq(rdx, string_pointer);
+  }
+  __ cmpq(rdx, Immediate(counted->max_rep()));
+  __ j(below, &output);
+  __ incq(rax);
+  __ movq(CountedQueueHead(index), rax);
+  __ cmpq(rax, CountedQueueTail(index));
+  __ j(equal, &done);
+  ComputeCountedEntryOffset(rcx, index, rax);
+
+  __ bind(&output);
+  __ movq(rdx, CountedEntry(index, rcx, kCountedEntrySource));
+  SetState(1, out_state, rdx);
+  __ bind(&done);
+}
+
 
 // TODO(rames): optimize when state_ring_size is a power of 2.
 void Codegen::TestState(int time, int state_index) {
   ASSERT(time >= 0);
-  if (time != 0) {
+  if (packed_states_) {
+    if (time != 0) {
+      ComputeStateOperandOffset(scratch2, time, state_index);
+      __ testb(StateOperand(scratch2), Immediate(StateBit(state_index)));
+    } else {
+      __ testb(StateOperand(0, state_index), Immediate(StateBit(state_index)));
+    }
+  } else if (time != 0) {
     ComputeStateOperandOffset(scratch2, time, state_index);
     __ cmpq(StateOperand(scratch2), Immediate(0));
   } else {
@@ -953,7 +1438,23 @@ void Codegen::SetState(int target_time,
                           int source_index) {
   ASSERT(target_time >= 0);
 
-  if (target_time == 0) {
+  if (packed_states_) {
+    // The target state is simply activated if the source state is.
+    Label skip;
+    __ testb(StateOperand(0, source_index), Immediate(StateBit(source_index)));
+    __ j(zero, &skip);
+    if (target_time == 0) {
+      __ orb(StateOperand(0, target_index), Immediate(StateBit(target_index)));
+    } else {
+      Register target_offset = scratch3;
+      ComputeStateOperandOffset(target_offset, target_time, target_index);
+      __ orb(StateOperand(target_offset), Immediate(StateBit(target_index)));
+    }
+    __ or_(TimeSummaryOperand(target_time),
+           Immediate(1 << (target_time % kBitsPerByte)));
+    __ bind(&skip);
+
+  } else if (target_time == 0) {
     Label skip;
     __ movq(scratch1, StateOperand(0, source_index));
     __ decq(scratch1);
@@ -987,11 +1488,41 @@ void Codegen::SetState(int target_time,
 }
 
 
+void Codegen::SetState(int target_time,
+                       int target_index,
+                       Register match_source) {
+  ASSERT(target_time > 0);
+  ASSERT(!match_source.is(scratch1) && !match_source.is(scratch2) &&
+         !match_source.is(scratch3));
+  Label skip;
+  Register target_offset = scratch3;
+  ComputeStateOperandOffset(target_offset, target_time, target_index);
+  if (packed_states_) {
+    __ orb(StateOperand(target_offset), Immediate(StateBit(target_index)));
+  } else {
+    __ movq(scratch1, match_source);
+    __ decq(scratch1);
+    __ movq(scratch2, StateOperand(target_offset));
+    __ decq(scratch2);
+    __ cmpq(scratch1, scratch2);
+    __ j(above_equal, &skip);
+    __ movq(StateOperand(target_offset), match_source);
+  }
+  __ or_(TimeSummaryOperand(target_time),
+         Immediate(1 << (target_time % kBitsPerByte)));
+  __ bind(&skip);
+}
+
+
 void Codegen::SetStateForce(int target_time, int target_index) {
   ASSERT(target_time >= 0);
 
   if (target_time == 0) {
-    __ movq(StateOperand(0, target_index), string_pointer);
+    if (packed_states_) {
+      __ orb(StateOperand(0, target_index), Immediate(StateBit(target_index)));
+    } else {
+      __ movq(StateOperand(0, target_index), string_pointer);
+    }
 
   } else {
     // We are not using this yet.
@@ -1006,7 +1537,13 @@ void Codegen::SetStateForce(int target_time, Register target_index) {
   ASSERT(target_time >= 0);
 
   if (target_time == 0) {
-    __ movq(StateOperand(0, target_index), string_pointer);
+    if (packed_states_) {
+      // The bit offset of bts with a register operand is not limited to the
+      // addressed word.
+      __ bts(StateOperand(0, 0), target_index);
+    } else {
+      __ movq(StateOperand(0, target_index), string_pointer);
+    }
 
   } else {
     // We are not using this yet.
@@ -1065,14 +1602,61 @@ void Codegen::ClearTime(int time) {
 
 
 void Codegen::ClearAllTimes() {
-  Register zero = scratch;
-  __ Move(zero, 0);
-  __ MemZero(StateRingBase(), state_ring_size(), zero);
-  __ MemZero(TimeSummary(0), time_summary_size(), zero);
+  // A time of the ring can only hold states if its bit is set in the time
+  // summary. Clear these times one by one, lowest first.
+  // This must preserve rax, which holds the return value when exiting.
+  Register bits = scratch3;
+  Register offset = scratch1;
+  Register zero_reg = scratch2;
+  __ Move(zero_reg, 0);
+  for (int summary_offset = 0;
+       summary_offset < time_summary_size();
+       summary_offset += kPointerSize) {
+    Label next_time, done;
+    __ movq(bits, TimeSummary(summary_offset));
+    __ testq(bits, bits);
+    __ j(zero, &done);
+    __ movq(TimeSummary(summary_offset), zero_reg);
+
+    __ bind(&next_time);
+    __ bsfq(rcx, bits);
+    __ imul(offset, rcx, Immediate(state_ring_time_size()));
+    __ addq(offset, ring_index);
+    if (summary_offset > 0) {
+      __ addq(offset, Immediate(summary_offset * kBitsPerByte *
+                                state_ring_time_size()));
+    }
+    Label no_wrapping;
+    __ cmpq(offset, Immediate(state_ring_size()));
+    __ j(less, &no_wrapping);
+    __ subq(offset, Immediate(state_ring_size()));
+    __ bind(&no_wrapping);
+    if (state_ring_time_size() <= 4 * kPointerSize) {
+      for (int i = 0; i < state_ring_time_size(); i += kPointerSize) {
+        __ movq(Operand(rbp, offset, times_1,
+                        StateRingBaseOffsetFromFrame() + i), zero_reg);
+      }
+    } else {
+      __ lea(offset, StateOperand(offset));
+      __ lea(rcx, Operand(offset, state_ring_time_size()));
+      __ MemZero(offset, rcx, zero_reg);
+    }
+    // Clear the lowest bit set.
+    __ lea(rcx, Operand(bits, -1));
+    __ and_(bits, rcx);
+    __ j(not_zero, &next_time);
+
+    __ bind(&done);
+  }
+  if (counted_headers_size() > 0) {
+    __ MemZero(Operand(rbp, CountedHeadersOffsetFromFrame()),
+               counted_headers_size(), zero_reg);
+  }
 }
 
 
 void Codegen::ClearStates(Register begin, Register end) {
+  ASSERT(!packed_states_);
   ASSERT(!begin.is(scratch2) && !begin.is(scratch3));
   ASSERT(!end.is(scratch2) && !end.is(scratch3));
   // TODO: Use a loop instruction.
@@ -1094,6 +1678,24 @@ void Codegen::ClearStates(Register begin, Register end) {
   __ movq(Operand(scratch2, 0), Immediate(0));
   __ jmp(&loop);
   __ bind(&done);
+
+  // The entries of the counted repetitions queues are sorted by match source,
+  // and were all entered before the current position.
+  for (size_t index = 0; index < rinfo_->re_counted_list()->size(); index++) {
+    Label drop_tail, counted_done;
+    __ movq(rax, CountedQueueTail(index));
+    __ bind(&drop_tail);
+    __ cmpq(rax, CountedQueueHead(index));
+    __ j(equal, &counted_done);
+    __ lea(rcx, Operand(rax, -1));
+    ComputeCountedEntryOffset(rcx, index, rcx);
+    __ cmpq(begin, CountedEntry(index, rcx, kCountedEntrySource));
+    __ j(above_equal, &counted_done);
+    __ decq(rax);
+    __ jmp(&drop_tail);
+    __ bind(&counted_done);
+    __ movq(CountedQueueTail(index), rax);
+  }
 }
 
 
@@ -1119,21 +1721,33 @@ void FastForwardGen::Generate(Behaviour behaviour) {
 
     vector<Regexp*>::iterator it;
     bool multiple_chars_only = true;
+    // See VisitSingleMultipleChar for how folding mcs are handled.
+    bool fold = false;
     for (it = ff_list_->begin(); it < ff_list_->end(); it++) {
       if (!(*it)->IsMultipleChar()) {
         multiple_chars_only = false;
         break;
       }
+      fold |= (*it)->AsMultipleChar()->fold();
     }
 
     // We currently only support a SIMD path for alternations of MultipleChars.
     // TODO: Add support for alternations of other regexps. This should be
     // simpler with the new code structure.
-    if (CpuFeatures::IsAvailable(SSE4_2) &&
+    if (FLAG_use_avx2 && CpuFeatures::IsAvailable(AVX2) &&
+        multiple_chars_only) {
+      vector<MultipleChar*> mcs;
+      for (it = ff_list_->begin(); it < ff_list_->end(); it++) {
+        mcs.push_back((*it)->AsMultipleChar());
+      }
+      MultipleCharsAVX2(&mcs, &potential_match, &standard_code);
+
+    } else if (CpuFeatures::IsAvailable(SSE4_2) &&
         multiple_chars_only &&
-        // xmm0-xmm8 give 8 registers minus one allocated for the string.
+        // xmm0-xmm8 give 8 registers minus one allocated for the string, and
+        // one for the case bits when folding.
         // TODO: Can we use a REX prefix to use all xmm registers?
-        ff_list_->size() <= 7) {
+        ff_list_->size() <= (fold ? 6 : 7)) {
       // This code is designed after VisitSingleMultipleChar().
 
       static const uint8_t pcmp_str_control =
@@ -1142,14 +1756,24 @@ void FastForwardGen::Generate(Behaviour behaviour) {
 
       // Pre-load the XMM registers for MultipleChars.
       static const int first_free_xmm_code = 1;
+      const XMMRegister case_bits_simd = xmm7;
       unsigned min_n_chars = kMaxNodeLength, max_n_chars = 0;
       for (unsigned i = 0; i < ff_list_->size(); i++) {
         MultipleChar *mc = ff_list_->at(i)->AsMultipleChar();
+        string chars(mc->chars(), mc->chars_length());
+        if (fold) {
+          for (char& c : chars) {
+            c |= kCaseBit;
+          }
+        }
         __ movdqp(XMMRegister::from_code(first_free_xmm_code + i),
-                  mc->chars(), mc->chars_length());
+                  chars.data(), chars.length());
         min_n_chars = min(min_n_chars, mc->chars_length());
         max_n_chars = max(max_n_chars, mc->chars_length());
       }
+      if (fold) {
+        __ movdqa(case_bits_simd, __ BroadcastedChar(kCaseBit));
+      }
 
 
       Register low_index = scratch2;
@@ -1166,6 +1790,9 @@ void FastForwardGen::Generate(Behaviour behaviour) {
       __ j(above, &standard_code);
 
       __ movdqu(xmm0, Operand(string_pointer, 0x0));
+      if (fold) {
+        __ por(xmm0, case_bits_simd);
+      }
       __ Move(low_index, 0x10);
       for (unsigned i = 0; i < ff_list_->size(); i++) {
         __ pcmpistri(pcmp_str_control,
@@ -1199,6 +1826,9 @@ void FastForwardGen::Generate(Behaviour behaviour) {
           /* The conditional jump above ensures that the eos wasn't reached. */\
           __ movdqa(xmm0,                                                      \
                     Operand(string_pointer, current_offset));                  \
+          if (fold) {                                                          \
+            __ por(xmm0, case_bits_simd);                                      \
+          }                                                                    \
         }                                                                      \
         __ pcmpistri(pcmp_str_control,                                         \
                      XMMRegister::from_code(first_free_xmm_code + i),          \
@@ -1228,6 +1858,9 @@ void FastForwardGen::Generate(Behaviour behaviour) {
       __ Move(low_index, 0x10);
 
       __ movdqa(xmm0, Operand(string_pointer, 0));
+      if (fold) {
+        __ por(xmm0, case_bits_simd);
+      }
       for (unsigned i = 0; i < ff_list_->size(); i++) {
         __ pcmpistri(pcmp_str_control,
                      XMMRegister::from_code(first_free_xmm_code + i), xmm0);
@@ -1253,8 +1886,6 @@ void FastForwardGen::Generate(Behaviour behaviour) {
 
     __ bind(&standard_code);
 
-    __ Move(rax, 0);
-
     Label loop;
     potential_match_ = &potential_match;
 
@@ -1270,6 +1901,8 @@ void FastForwardGen::Generate(Behaviour behaviour) {
     // potential match before this and others after.
     __ cmpq(string_pointer, string_end);
     __ j(not_equal, &loop);
+    // The visitors may have used rax as a scratch register.
+    __ Move(rax, 0);
     __ jmp(unwind_and_return_);
 
     __ bind(&potential_match);
@@ -1299,14 +1932,37 @@ void FastForwardGen::VisitSingleMultipleChar(MultipleChar* mc) {
   Register fixed_chars = scratch3;
   XMMRegister fixed_chars_simd = xmm0;
 
+  bool use_avx2 = FLAG_use_avx2 && CpuFeatures::IsAvailable(AVX2);
+
+  // For a folding mc the case bit is set in all the characters of the text and
+  // of the mc before comparing them. This finds all the matches, and some
+  // positions that do not match, like '@' for '`', rejected by the
+  // verification.
+  bool fold = mc->fold();
+  string chars(mc->chars(), n_chars);
+  if (fold) {
+    for (char& c : chars) {
+      c |= kCaseBit;
+    }
+  }
+  XMMRegister case_bits_simd = xmm3;
+
   // Pre-load the constant values for the characters to match.
-  __ MoveCharsFrom(fixed_chars, n_chars, mc->chars());
-  if (CpuFeatures::IsAvailable(SSE4_2)) {
-    __ movdqp(fixed_chars_simd, mc->chars(), n_chars);
+  __ MoveCharsFrom(fixed_chars, n_chars, chars.data());
+  if (!use_avx2 && CpuFeatures::IsAvailable(SSE4_2)) {
+    __ movdqp(fixed_chars_simd, chars.data(), n_chars);
+    if (fold) {
+      __ movdqa(case_bits_simd, __ BroadcastedChar(kCaseBit));
+    }
   }
 
 
-  if (CpuFeatures::IsAvailable(SSE4_2)) {
+  if (use_avx2) {
+    vector<MultipleChar*> mcs(1, mc);
+    MultipleCharsAVX2(&mcs, &found, &standard_code,
+                      fold ? no_reg : fixed_chars);
+
+  } else if (CpuFeatures::IsAvailable(SSE4_2)) {
     Label inc_align_or_finish;
     Label simd_code, simd_loop;
     Label potential_match;
@@ -1336,6 +1992,9 @@ void FastForwardGen::VisitSingleMultipleChar(MultipleChar* mc) {
     // Note that we check further than is actually required to align
     // string_pointer, but there is no point purposedly ignoring a match.
     __ movdqu(xmm1, Operand(string_pointer, 0x0));
+    if (fold) {
+      __ por(xmm1, case_bits_simd);
+    }
     __ pcmpistri(pcmp_str_control, xmm0, xmm1);
     // If CFlag is set there was a match.
     __ j(below, &potential_match);
@@ -1355,9 +2014,15 @@ void FastForwardGen::VisitSingleMultipleChar(MultipleChar* mc) {
     __ cmpq(string_pointer, simd_max_index);
     __ j(above, &standard_code);
     __ movdqa(xmm1, Operand(string_pointer, 0x0));
+    if (fold) {
+      __ por(xmm1, case_bits_simd);
+    }
     __ pcmpistri(pcmp_str_control, xmm0, xmm1);
     __ j(below, &offset_0x0);
     __ movdqa(xmm2, Operand(string_pointer, 0x10));
+    if (fold) {
+      __ por(xmm2, case_bits_simd);
+    }
     __ pcmpistri(pcmp_str_control, xmm0, xmm2);
     __ j(below, &offset_0x10);
     __ addq(string_pointer, Immediate(0x20));
@@ -1371,7 +2036,7 @@ void FastForwardGen::VisitSingleMultipleChar(MultipleChar* mc) {
     // After pcmpistri rcx contains the offset to the first potential match.
     __ addq(string_pointer, rcx);
     MatchMultipleChar(masm_, kForward, mc, true,
-                      &inc_align_or_finish, fixed_chars);
+                      &inc_align_or_finish, fold ? no_reg : fixed_chars);
 
     __ jmp(&found);
   }
@@ -1388,13 +2053,22 @@ void FastForwardGen::VisitSingleMultipleChar(MultipleChar* mc) {
   // accessing memory from the eos.
   __ movq(scratch2, string_end);
   __ subq(scratch2, Immediate(n_chars));
+  if (fold) {
+    __ Move(rcx, 0x2020202020202020ULL);
+  }
 
   __ dec_c(string_pointer);
   __ bind(&loop);
   __ inc_c(string_pointer);
   __ cmpq(string_pointer, scratch2);
   __ j(above, unwind_and_return_);
-  __ cmp_truncated(n_chars, fixed_chars, current_chars);
+  if (fold) {
+    __ mov_truncated(n_chars, scratch, current_chars);
+    __ or_(scratch, rcx);
+    __ cmp_truncated(n_chars, fixed_chars, scratch);
+  } else {
+    __ cmp_truncated(n_chars, fixed_chars, current_chars);
+  }
   __ j(not_equal, &loop);
 
   __ bind(&found);
@@ -1403,6 +2077,273 @@ void FastForwardGen::VisitSingleMultipleChar(MultipleChar* mc) {
 }
 
 
+void FastForwardGen::MultipleCharsAVX2(vector<MultipleChar*>* mcs,
+                                       Label* found, Label* fallback,
+                                       Register fixed_chars) {
+  // For every position in blocks of 0x40 bytes, compare the first and last
+  // characters of each MultipleChar with the text. Only the positions where
+  // both compare equal are verified.
+  Label simd_start, simd_loop, candidates, next_candidate, exit_to_fallback;
+
+  Register simd_max_index = scratch2;
+  Register block = rax;
+  Register mask = rdx;
+  const YMMRegister text = ymm0;
+  const YMMRegister acc[2] = { ymm1, ymm2 };
+  const YMMRegister first = ymm3;
+  const YMMRegister last = ymm4;
+  const YMMRegister case_bits = ymm5;
+
+  unsigned max_n_chars = 0;
+  int n_constants = 0;
+  // When any of the mcs is folding, the case bit is set in the text and in the
+  // characters compared. See VisitSingleMultipleChar.
+  bool fold = false;
+  for (MultipleChar* mc : *mcs) {
+    max_n_chars = max(max_n_chars, mc->chars_length());
+    n_constants += mc->chars_length() > 1 ? 2 : 1;
+    fold |= mc->fold();
+  }
+  const char fold_bits = fold ? kCaseBit : 0;
+  const int first_free_ymm_code = fold ? 6 : 5;
+  if (fold) {
+    __ vpbroadcastbp(case_bits, kCaseBit);
+  }
+
+  // Keep the broadcasted characters in registers if there are enough of them.
+  // Otherwise compare with constants in memory.
+  bool in_registers =
+    first_free_ymm_code + n_constants <= YMMRegister::kNumRegisters;
+  vector<Operand> first_chars, last_chars;
+  int ymm_code = first_free_ymm_code;
+  for (MultipleChar* mc : *mcs) {
+    char first_char = mc->chars()[0] | fold_bits;
+    char last_char = mc->chars()[mc->chars_length() - 1] | fold_bits;
+    if (in_registers) {
+      __ vpbroadcastbp(YMMRegister::from_code(ymm_code++), first_char);
+      if (mc->chars_length() > 1) {
+        __ vpbroadcastbp(YMMRegister::from_code(ymm_code++), last_char);
+      }
+    } else {
+      first_chars.push_back(__ BroadcastedChar(first_char));
+      last_chars.push_back(__ BroadcastedChar(last_char));
+    }
+  }
+
+  // The SIMD loop reads up to 0x40 + max_n_chars - 1 bytes, and the
+  // verification of a potential match may read 8 bytes at its last position.
+  int margin_before_eos = 0x40 + max(max_n_chars, 8u);
+
+  // The verification code clobbers simd_max_index.
+  __ bind(&simd_start);
+  __ movq(simd_max_index, string_end);
+  __ subq(simd_max_index, Immediate(margin_before_eos));
+
+  __ bind(&simd_loop);
+  __ cmpq(string_pointer, simd_max_index);
+  __ j(above, &exit_to_fallback);
+  for (int half = 0; half < 2; half++) {
+    int offset = half * 0x20;
+    __ vmovdqu(text, Operand(string_pointer, offset));
+    if (fold) {
+      __ vpor(text, text, case_bits);
+    }
+    ymm_code = first_free_ymm_code;
+    for (unsigned i = 0; i < mcs->size(); i++) {
+      unsigned n_chars = mcs->at(i)->chars_length();
+      YMMRegister res = i == 0 ? acc[half] : first;
+      if (in_registers) {
+        __ vpcmpeqb(res, text, YMMRegister::from_code(ymm_code++));
+      } else {
+        __ vpcmpeqb(res, text, first_chars.at(i));
+      }
+      if (n_chars > 1) {
+        Operand text_last(string_pointer, offset + n_chars - 1);
+        if (fold) {
+          __ vmovdqu(last, text_last);
+          __ vpor(last, last, case_bits);
+          if (in_registers) {
+            __ vpcmpeqb(last, last, YMMRegister::from_code(ymm_code++));
+          } else {
+            __ vpcmpeqb(last, last, last_chars.at(i));
+          }
+        } else if (in_registers) {
+          __ vpcmpeqb(last, YMMRegister::from_code(ymm_code++), text_last);
+        } else {
+          __ vmovdqu(last, text_last);
+          __ vpcmpeqb(last, last, last_chars.at(i));
+        }
+        __ vpand(res, res, last);
+      }
+      if (i != 0) {
+        __ vpor(acc[half], acc[half], first);
+      }
+    }
+  }
+  __ vpmovmskb(mask, acc[1]);
+  __ shl(mask, Immediate(32));
+  __ vpmovmskb(rcx, acc[0]);
+  __ or_(mask, rcx);
+  __ j(not_zero, &candidates);
+  __ addq(string_pointer, Immediate(0x40));
+  __ jmp(&simd_loop);
+
+  // Verify the potential matches in the order of their positions. The mask
+  // bits are cleared as they are checked.
+  __ bind(&candidates);
+  __ movq(block, string_pointer);
+  __ bind(&next_candidate);
+  __ bsfq(rcx, mask);
+  __ lea(string_pointer, Operand(block, rcx, times_1, 0));
+  for (MultipleChar* mc : *mcs) {
+    Label no_match;
+    MatchMultipleChar(masm_, kForward, mc, true, &no_match, fixed_chars);
+    __ vzeroupper();
+    __ jmp(found);
+    __ bind(&no_match);
+  }
+  __ lea(rcx, Operand(mask, -1));
+  __ and_(mask, rcx);
+  __ j(not_zero, &next_candidate);
+  __ lea(string_pointer, Operand(block, 0x40));
+  __ jmp(&simd_start);
+
+  __ bind(&exit_to_fallback);
+  __ vzeroupper();
+  __ jmp(fallback);
+}
+
+
+void FastForwardGen::BracketSIMD(Bracket* bracket,
+                                 Label* found, Label* fallback) {
+  bool avx2 = FLAG_use_avx2 && CpuFeatures::IsAvailable(AVX2);
+  int width = avx2 ? 0x20 : 0x10;
+
+  // The set of characters is looked up with two nibble tables. For a character
+  // with low nibble `lo` and high nibble `hi`:
+  //  - low_table[lo] has bit `hi` set if the character matches, for hi < 8.
+  //    high_table[lo] has bit `hi - 8` set for hi >= 8.
+  //  - hi_bit[hi] is the bit to test in the entry found above.
+  // pshufb yields 0 for indexes with the top bit set, so looking up low_table
+  // with the character and high_table with the character ^ 0x80 selects the
+  // entry from the correct table.
+  // This costs a constant number of instructions whatever the set is.
+  uint8_t bitmap[32];
+  bracket->ComputeBitmap(bitmap);
+  char low_table[32], high_table[32], hi_bit[32];
+  char low_nibble_mask[32], top_bit[32];
+  bool has_high_chars = false;
+  for (int i = 0; i < 32; i++) {
+    int nibble = i % 16;
+    low_table[i] = high_table[i] = 0;
+    for (int hi = 0; hi < 16; hi++) {
+      int c = hi << 4 | nibble;
+      if (bitmap[c / 8] & (1 << (c % 8))) {
+        if (hi < 8) {
+          low_table[i] |= 1 << hi;
+        } else {
+          high_table[i] |= 1 << (hi - 8);
+          has_high_chars = true;
+        }
+      }
+    }
+    hi_bit[i] = 1 << (nibble % 8);
+    low_nibble_mask[i] = 0xf;
+    top_bit[i] = static_cast<char>(0x80);
+  }
+
+  Label simd_loop, found_in_block, exit_to_fallback;
+  Register simd_max_index = scratch2;
+  Register mask = rcx;
+  const XMMRegister text = xmm0;
+  const XMMRegister bits = xmm1;
+  const XMMRegister tmp1 = xmm2;
+  const XMMRegister tmp2 = xmm8;
+  const XMMRegister low_table_reg = xmm3;
+  const XMMRegister high_table_reg = xmm4;
+  const XMMRegister hi_bit_reg = xmm5;
+  const XMMRegister low_nibble_mask_reg = xmm6;
+  const XMMRegister top_bit_reg = xmm7;
+
+  if (avx2) {
+    __ vmovdqu(low_table_reg, __ RelocatedConstant(low_table, 32));
+    __ vmovdqu(hi_bit_reg, __ RelocatedConstant(hi_bit, 32));
+    __ vmovdqu(low_nibble_mask_reg, __ RelocatedConstant(low_nibble_mask, 32));
+    if (has_high_chars) {
+      __ vmovdqu(high_table_reg, __ RelocatedConstant(high_table, 32));
+      __ vmovdqu(top_bit_reg, __ RelocatedConstant(top_bit, 32));
+    }
+  } else {
+    __ movdqa(low_table_reg, __ RelocatedConstant(low_table, 16));
+    __ movdqa(hi_bit_reg, __ RelocatedConstant(hi_bit, 16));
+    __ movdqa(low_nibble_mask_reg, __ RelocatedConstant(low_nibble_mask, 16));
+    if (has_high_chars) {
+      __ movdqa(high_table_reg, __ RelocatedConstant(high_table, 16));
+      __ movdqa(top_bit_reg, __ RelocatedConstant(top_bit, 16));
+    }
+  }
+
+  __ movq(simd_max_index, string_end);
+  __ subq(simd_max_index, Immediate(width));
+
+  __ bind(&simd_loop);
+  __ cmpq(string_pointer, simd_max_index);
+  __ j(above, &exit_to_fallback);
+  if (avx2) {
+    __ vmovdqu(text, Operand(string_pointer, 0));
+    __ vpshufb(bits, low_table_reg, text);
+    if (has_high_chars) {
+      __ vpxor(tmp1, text, top_bit_reg);
+      __ vpshufb(tmp1, high_table_reg, tmp1);
+      __ vpor(bits, bits, tmp1);
+    }
+    __ vpsrlw(tmp1, text, 4);
+    __ vpand(tmp1, tmp1, low_nibble_mask_reg);
+    __ vpshufb(tmp1, hi_bit_reg, tmp1);
+    __ vpand(bits, bits, tmp1);
+    __ vpcmpeqb(bits, bits, tmp1);
+    __ vpmovmskb(mask, bits);
+  } else {
+    __ movdqu(text, Operand(string_pointer, 0));
+    __ movaps(bits, low_table_reg);
+    __ pshufb(bits, text);
+    if (has_high_chars) {
+      __ movaps(tmp1, text);
+      __ pxor(tmp1, top_bit_reg);
+      __ movaps(tmp2, high_table_reg);
+      __ pshufb(tmp2, tmp1);
+      __ por(bits, tmp2);
+    }
+    __ movaps(tmp1, text);
+    __ psrlw(tmp1, 4);
+    __ pand(tmp1, low_nibble_mask_reg);
+    __ movaps(tmp2, hi_bit_reg);
+    __ pshufb(tmp2, tmp1);
+    __ pand(bits, tmp2);
+    __ pcmpeqb(bits, tmp2);
+    __ pmovmskb(mask, bits);
+  }
+  __ testq(mask, mask);
+  __ j(not_zero, &found_in_block);
+  __ addq(string_pointer, Immediate(width));
+  __ jmp(&simd_loop);
+
+  __ bind(&found_in_block);
+  __ bsfq(mask, mask);
+  __ addq(string_pointer, mask);
+  if (avx2) {
+    __ vzeroupper();
+  }
+  __ jmp(found);
+
+  __ bind(&exit_to_fallback);
+  if (avx2) {
+    __ vzeroupper();
+  }
+  __ jmp(fallback);
+}
+
+
 // TODO(rames): slow single visitors are all too similar not to be refactord!
 void FastForwardGen::VisitSinglePeriod(Period* period) {
   // TODO(rames): we probably never want to have a single ff for a period!!
@@ -1435,115 +2376,10 @@ void FastForwardGen::VisitSingleBracket(Bracket* bracket) {
   Label match;
   Label exit;
 
-  // This code is inefficient. The high density of matches makes the SIMD setup
-  // too costly.
-  //if (CpuFeatures::IsAvailable(SSE4_2) &&
-  //    bracket->single_chars()->size() < 16 &&
-  //    bracket->char_ranges()->size() < 8) {
-  //  Label align_or_finish;
-  //  Label simd_code, simd_loop;
-  //  Label simd_adjust;
-
-  //  const uint64_t ctrl_single_chars =
-  //    Assembler::unsigned_bytes | Assembler::equal_any |
-  //    Assembler::pol_pos | Assembler::lsi;
-  //  const uint64_t ctrl_ranges =
-  //    Assembler::unsigned_bytes | Assembler::ranges |
-  //    Assembler::pol_pos | Assembler::lsi;
-
-  //  // Only execute the SIMD code if the length of string to process is big
-  //  // enough to be aligned on a 0x10 bytes boundary (maximum 0xf offset
-  //  // adjustment) and go through one iteration of the SIMD loop.
-  //  Register simd_max_index = scratch3;
-  //  int margin_for_simd_loop = 0xf + 0x20;
-  //  __ movq(simd_max_index, string_end);
-  //  __ subq(simd_max_index, Immediate(margin_for_simd_loop));
-
-  //  // Preload the xmm registers.
-  //  XMMRegister xmm_chars = xmm1;
-  //  XMMRegister xmm_ranges = xmm2;
-  //  uint64_t high = 0;
-  //  uint64_t low = 0;
-  //  if (bracket->single_chars()->size()) {
-  //    for (unsigned i = 0; i < bracket->single_chars()->size() && i < 8; i++) {
-  //      low |= bracket->single_chars()->at(i) << (i * 8);
-  //    }
-  //    for (unsigned i = 8; i < bracket->single_chars()->size() && i < 16; i++) {
-  //      high |= bracket->single_chars()->at(i) << ((i - 8) * 8);
-  //    }
-  //    __ movdq(xmm_chars, high, low);
-  //  }
-  //  if (bracket->char_ranges()->size()) {
-  //    for (unsigned i = 0; i < bracket->char_ranges()->size() && i < 4; i++) {
-  //      low |= bracket->char_ranges()->at(i).low << (i * 8);
-  //      low |= bracket->char_ranges()->at(i).high << (i * 8 + 8);
-  //    }
-  //    for (unsigned i = 4; i < bracket->char_ranges()->size() && i < 8; i++) {
-  //      high |= bracket->char_ranges()->at(i).low << ((i - 4) * 8);
-  //      high |= bracket->char_ranges()->at(i).high << ((i - 4) * 8 + 8);
-  //    }
-  //    __ movdq(xmm_ranges, high, low);
-  //  }
-
-  //  __ bind(&align_or_finish);
-  //  __ cmpq(string_pointer, simd_max_index);
-  //  __ j(above, &standard_code);
-
-  //  // We know there are more than 0x10 bytes to process, so we can safely use
-  //  // movdqu and pcmpistri.
-  //  // Note that we check further than is actually required to align
-  //  // string_pointer, but there is no point purposedly ignoring a match.
-  //  __ movdqu(xmm2, Operand(string_pointer, 0x0));
-  //  if (bracket->single_chars()->size()) {
-  //    __ pcmpistri(ctrl_single_chars, xmm_chars, xmm2);
-  //    __ j(below, &match);
-  //  }
-  //  if (bracket->char_ranges()->size()) {
-  //    __ pcmpistri(ctrl_ranges, xmm_ranges, xmm2);
-  //    __ j(below, &match);
-  //  }
-
-  //  // No match in the following 0x10 bytes. Align the string pointer on the
-  //  // next closest 0x10 bytes boundary.
-  //  __ and_(string_pointer, Immediate(~0xf));
-  //  __ addq(string_pointer, Immediate(0x10));
-
-
-  //  __ bind(&simd_code);
-  //  Label offset_0x0, offset_0x10;
-  //  __ bind(&simd_loop);
-  //  __ cmpq(string_pointer, simd_max_index);
-  //  __ j(above, &standard_code);
-  //  __ movdqa(xmm3, Operand(string_pointer, 0x0));
-  //  if (bracket->single_chars()->size()) {
-  //    __ pcmpistri(ctrl_single_chars, xmm_chars, xmm3);
-  //    __ j(below, &offset_0x0);
-  //  }
-  //  if (bracket->char_ranges()->size()) {
-  //    __ pcmpistri(ctrl_ranges, xmm_ranges, xmm3);
-  //    __ j(below, &offset_0x0);
-  //  }
-  //  __ movdqa(xmm4, Operand(string_pointer, 0x10));
-  //  if (bracket->single_chars()->size()) {
-  //    __ pcmpistri(ctrl_single_chars, xmm_chars, xmm4);
-  //    __ j(below, &offset_0x10);
-  //  }
-  //  if (bracket->char_ranges()->size()) {
-  //    __ pcmpistri(ctrl_ranges, xmm_ranges, xmm4);
-  //    __ j(below, &offset_0x10);
-  //  }
-  //  __ addq(string_pointer, Immediate(0x20));
-  //  __ jmp(&simd_loop);
-
-  //  __ bind(&offset_0x10);
-  //  __ addq(string_pointer, Immediate(0x10));
-  //  __ bind(&offset_0x0);
-
-  //  __ bind(&simd_adjust);
-  //  // After pcmpistri rcx contains the offset to the first potential match.
-  //  __ addq(string_pointer, rcx);
-  //  __ jmp(&match);
-  //}
+  if ((FLAG_use_avx2 && CpuFeatures::IsAvailable(AVX2)) ||
+      CpuFeatures::IsAvailable(SSSE3)) {
+    BracketSIMD(bracket, &match, &standard_code);
+  }
 
   __ bind(&standard_code);
 
@@ -307,6 +307,27 @@ void MacroAssembler::movdqp(XMMRegister dst, const char* chars, unsigned n_chars
 }
 
 
+void MacroAssembler::vpbroadcastbp(YMMRegister dst, char c) {
+  RelocatedData *reloc_char = this->NewRelocatedData(&c, 1, true, 1);
+  vpbroadcastb(dst, Operand(reloc_char, 0));
+}
+
+
+Operand MacroAssembler::BroadcastedChar(char c) {
+  char chars[32];
+  memset(chars, c, 32);
+  return RelocatedConstant(chars, 32);
+}
+
+
+Operand MacroAssembler::RelocatedConstant(const char* data, unsigned size) {
+  ASSERT(size == 16 || size == 32);
+  RelocatedData *reloc_data =
+    this->NewRelocatedData(const_cast<char*>(data), size, true, size);
+  return Operand(reloc_data, 0);
+}
+
+
 void MacroAssembler::MemZero(Register start, Register end, Register zero,
                              MemZeroOutputStatus out_status,
                              MemZeroSizeHint size_hint) {
@@ -383,7 +404,8 @@ void MacroAssembler::CallCppPrepareStack() {
 void MacroAssembler::CallCpp(Address address) {
   PushCallerSavedRegisters();
   CallCppPrepareStack();
-  Move(rax, (int64_t)address);
+  movq(rax, reinterpret_cast<void*>(address));
+  RecordExternalReference(pc_offset() - kPointerSize);
   call(rax);
   // Restore the stack pointer.
   movq(rsp, Operand(rsp, 0));
@@ -402,6 +424,7 @@ void MacroAssembler::asm_assert_(Condition cond, const char *file, int line, con
   Label skip;
   j(cond, &skip);
 
+  set_not_relocatable();
   Move(rdi, (int64_t)file);
   Move(rsi, line);
   Move(rdx, (int64_t)description);
@@ -413,6 +436,7 @@ void MacroAssembler::asm_assert_(Condition cond, const char *file, int line, con
 
 void MacroAssembler::msg(const char *message) {
     PushAllRegistersAndFlags();
+    set_not_relocatable();
     Move(rdi, (int64_t)message);
     CallCpp(FUNCTION_ADDR(LocalPrint));
     PopAllRegistersAndFlags();
@@ -24,6 +24,9 @@ namespace internal {
 
 
 const Register result_matches = rbx;
+// kMatchCount code does not register matches, and instead uses this register to
+// count them.
+const Register match_count = rbx;
 const Register ring_index = r12;
 
 const Register string_base = r13;
@@ -45,7 +48,17 @@ static inline int CalleeSavedRegsSize() {
   }
 }
 
-const int kStateInfoSize = 5 * kPointerSize;
+// kMatchCount code does not register matches, but keeps the last matches it
+// counted in a small ring so that they can be discounted if a later match
+// supersedes them. Entries have the layout of a Match.
+const int kCountHistoryLength = 8;
+const int kCountHistoryEntrySize = 2 * kPointerSize;
+const int kCountHistorySize = kCountHistoryLength * kCountHistoryEntrySize;
+
+// The fields below are set up by the generated code on entry. The count history
+// entries are only read once written.
+const int kStateInfoFields = 8;
+const int kStateInfoSize = kStateInfoFields * kPointerSize + kCountHistorySize;
 // Next starting position for fast forwarding.
 const Operand ff_position    (rbp, -CalleeSavedRegsSize() - 1 * kPointerSize);
 // State from which FF thinks there may be a potential match.
@@ -59,6 +72,25 @@ const Operand forward_match  (rbp, -CalleeSavedRegsSize() - 4 * kPointerSize);
 // Used when looking for multiple matches (kMatchAll) to indicate the end of the
 // previous match.
 const Operand last_match_end (rbp, -CalleeSavedRegsSize() - 5 * kPointerSize);
+// Offset in the count history of the last match counted.
+const Operand count_history_top (rbp, -CalleeSavedRegsSize() - 6 * kPointerSize);
+// Number of valid entries in the count history.
+const Operand count_history_size(rbp, -CalleeSavedRegsSize() - 7 * kPointerSize);
+// Beginning of the last match dropped from the full count history, or 0.
+const Operand count_history_dropped(rbp,
+                                    -CalleeSavedRegsSize() - 8 * kPointerSize);
+// The count history is at the bottom of the saved state.
+static inline Operand CountHistoryEntry(Register offset, int field_offset) {
+  return Operand(rbp, offset, times_1,
+                 -CalleeSavedRegsSize() - kStateInfoSize + field_offset);
+}
+
+// Entries of the queues of counted repetitions hold the position where the
+// repetition was entered and the associated match source.
+const int kCountedEntryPosition = 0;
+const int kCountedEntrySource = kPointerSize;
+const int kCountedEntrySizeLog2 = kPointerSizeLog2 + 1;
+const int kCountedEntrySize = 1 << kCountedEntrySizeLog2;
 
 const Register mscratch = r8;
 const Register scratch = r9;
@@ -138,6 +170,12 @@ class MacroAssembler : public MacroAssemblerBase {
 
   void movdq(XMMRegister dst, uint64_t high, uint64_t low);
   void movdqp(XMMRegister dst, const char* chars, unsigned n_chars);
+  // Fill all the bytes of the ymm register with the character.
+  void vpbroadcastbp(YMMRegister dst, char c);
+  // Returns an operand for a 32 bytes constant filled with the character.
+  Operand BroadcastedChar(char c);
+  // Returns an operand for a constant of 16 or 32 bytes, aligned on its size.
+  Operand RelocatedConstant(const char* data, unsigned size);
 
   // Clear a memory region.
   // The start and end (and size) must be 8-bytes aligned.
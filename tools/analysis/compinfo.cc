@@ -43,7 +43,7 @@ struct arguments {
 
 struct argp_option options[] =
 {
-  {"match_type" , 'm' , "all"  , OPTION_ARG_OPTIONAL , "Matching type. One of 'full', 'anywhere', 'first', 'all'. Default: 'all'"},
+  {"match_type" , 'm' , "all"  , OPTION_ARG_OPTIONAL , "Matching type. One of 'full', 'anywhere', 'first', 'all', 'count'. Default: 'all'"},
 #define FLAG_OPTION(flag_name, r, d) \
   {#flag_name , flag_name##_key , FLAG_##flag_name ? "1" : "0"   , OPTION_ARG_OPTIONAL , "0 to disable, 1 to enable."},
   REJIT_FLAGS_LIST(FLAG_OPTION)
@@ -74,6 +74,8 @@ error_t parse_opt(int key, char *arg, struct argp_state *state) {
         arguments->match_type = kMatchFirst;
       } else if (strcmp("all", arg) == 0) {
         arguments->match_type = kMatchAll;
+      } else if (strcmp("count", arg) == 0) {
+        arguments->match_type = kMatchCount;
       } else {
         printf("ERROR: Invalid match type\n.");
         argp_usage(state);
@@ -12,7 +12,9 @@
 // You should have received a copy of the GNU General Public License
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
+#include <algorithm>
 #include <iostream>
+#include <thread>
 #include <argp.h>
 #include <string.h>
 
@@ -135,14 +137,54 @@ static void PrintTest(struct arguments *arguments, int line, int test_id) {
 
 
 static int test_id = 0;
-// Every call to this function increments the global counter `test_id`, even
-// when the test is skipped.
 typedef int TestStatus;
 enum {
   TEST_SKIPPED = 0,
   TEST_PASSED = 1,
   TEST_FAILED = -1
 };
+
+
+// Increments the global counter `test_id`, even when the test is skipped, and
+// returns true if the test should run.
+static bool StartTest(unsigned line) {
+  ++test_id;
+  if (!ShouldTest(&arguments, line, test_id)) {
+    return false;
+  }
+  PrintTest(&arguments, line, test_id);
+  return true;
+}
+
+
+// Prints the header of the report for a failure of the current test, and
+// returns the stream where to describe the failure.
+static ostream& ReportFailure(unsigned line) {
+  cout << "--- FAILED line " << line << " test_id " << test_id
+       << " ------------------------------------------------------" << endl;
+  return cout;
+}
+
+
+static ostream& ReportFailure(unsigned line,
+                              const char* regexp, const string& text) {
+  ReportFailure(line) << "regexp:\n" << regexp << endl;
+  cout << "text:\n" << text << endl;
+  return cout;
+}
+
+
+static TestStatus EndTest(bool success) {
+  TestStatus status = success ? TEST_PASSED : TEST_FAILED;
+  if (arguments.break_on_fail) {
+    assert(status == TEST_PASSED);
+  }
+  return status;
+}
+
+
+// Every call to this function increments the global counter `test_id`, even
+// when the test is skipped.
 static TestStatus Test(MatchType match_type,
                        const char* regexp,
                        const string& text,
@@ -161,6 +203,48 @@ static int TestMultiple(const char* regexp, const string& text,
                         int expected_start = -1, int expected_end = -1,
                         bool unbound = false);
 
+static TestStatus TestMatchAllArray(const char* regexp, const string& text,
+                                    unsigned line);
+
+static TestStatus TestMatchAllCompact(const char* regexp, const string& text,
+                                      unsigned line);
+
+static TestStatus TestGroups(const char* regexp, const string& text,
+                             const char* expected, unsigned line);
+
+static TestStatus TestIgnoreCase(const char* regexp, const string& text,
+                                 unsigned expected, unsigned line);
+
+static TestStatus TestCache(unsigned line);
+
+static TestStatus TestCodeArena(unsigned line);
+
+static TestStatus TestCompileAll(const char* regexp, const string& text,
+                                 unsigned line);
+
+static TestStatus TestSnapshot(const char* regexp, const string& text,
+                               unsigned line);
+
+static TestStatus TestStream(const char* regexp, const string& text,
+                             unsigned line);
+
+static TestStatus TestSet(const string& text, const vector<string>& regexps,
+                          unsigned line);
+
+static TestStatus TestMatchAllParallel(const char* regexp, const string& pattern,
+                                       unsigned line);
+
+static TestStatus TestSharedRegej(const char* regexp, const string& pattern,
+                                  unsigned line);
+
+static TestStatus TestContext(const string& text, const vector<string>& regexps,
+                              unsigned line);
+
+static TestStatus TestBatch(const char* regexp, const string& text,
+                            unsigned line);
+
+static TestStatus TestLines(const string& text, unsigned line);
+
 
 int RunTest(struct arguments *arguments) {
   assert(FLAG_benchtest);
@@ -189,6 +273,66 @@ int RunTest(struct arguments *arguments) {
       re, string(text), expected, __LINE__, start, end, true);                 \
   UPDATE_RESULTS(local_rc)
 
+#define TEST_MatchAllArray(re, text)                                            \
+  local_rc = TestMatchAllArray(re, string(text), __LINE__);                    \
+  UPDATE_RESULTS(local_rc)
+
+#define TEST_MatchAllCompact(re, text)                                         \
+  local_rc = TestMatchAllCompact(re, string(text), __LINE__);                  \
+  UPDATE_RESULTS(local_rc)
+
+#define TEST_Groups(re, text, expected)                                        \
+  local_rc = TestGroups(re, string(text), expected, __LINE__);                 \
+  UPDATE_RESULTS(local_rc)
+
+#define TEST_IgnoreCase(expected, re, text)                                    \
+  local_rc = TestIgnoreCase(re, string(text), expected, __LINE__);             \
+  UPDATE_RESULTS(local_rc)
+
+#define TEST_Cache()                                                           \
+  local_rc = TestCache(__LINE__);                                              \
+  UPDATE_RESULTS(local_rc)
+
+#define TEST_CodeArena()                                                       \
+  local_rc = TestCodeArena(__LINE__);                                          \
+  UPDATE_RESULTS(local_rc)
+
+#define TEST_CompileAll(re, text)                                              \
+  local_rc = TestCompileAll(re, string(text), __LINE__);                       \
+  UPDATE_RESULTS(local_rc)
+
+#define TEST_Snapshot(re, text)                                                \
+  local_rc = TestSnapshot(re, string(text), __LINE__);                         \
+  UPDATE_RESULTS(local_rc)
+
+#define TEST_Stream(re, text)                                                  \
+  local_rc = TestStream(re, string(text), __LINE__);                           \
+  UPDATE_RESULTS(local_rc)
+
+#define TEST_Set(text, ...)                                                    \
+  local_rc = TestSet(string(text), {__VA_ARGS__}, __LINE__);                   \
+  UPDATE_RESULTS(local_rc)
+
+#define TEST_MatchAllParallel(re, pattern)                                     \
+  local_rc = TestMatchAllParallel(re, string(pattern), __LINE__);              \
+  UPDATE_RESULTS(local_rc)
+
+#define TEST_SharedRegej(re, pattern)                                          \
+  local_rc = TestSharedRegej(re, string(pattern), __LINE__);                   \
+  UPDATE_RESULTS(local_rc)
+
+#define TEST_Context(text, ...)                                                \
+  local_rc = TestContext(string(text), {__VA_ARGS__}, __LINE__);               \
+  UPDATE_RESULTS(local_rc)
+
+#define TEST_Batch(re, text)                                                   \
+  local_rc = TestBatch(re, string(text), __LINE__);                            \
+  UPDATE_RESULTS(local_rc)
+
+#define TEST_Lines(text)                                                       \
+  local_rc = TestLines(string(text), __LINE__);                                \
+  UPDATE_RESULTS(local_rc)
+
   // Test the test routines.
   TEST_Full(1, "x", "x");
   TEST_Full(0, "x", "y");
@@ -210,6 +354,9 @@ int RunTest(struct arguments *arguments) {
   TEST_Full(1, x100("0123456789"), x100("0123456789"));
   TEST_Full(0, x100("0123456789"), x100("0123456789") "X");
   TEST_Full(0, x100("0123456789"), "X" x100("0123456789"));
+  TEST_Multiple_unbound(0, "0123456789abcdefghi", "012345678Xabcdefghi", 0, 0);
+  TEST_Multiple_unbound(1, "0123456789abcdefghi", "_0123456789abcdefghi_",
+                        1, 20);
 
   // Period.
   TEST_Full(1, "01234.6789", "0123456789");
@@ -279,6 +426,18 @@ int RunTest(struct arguments *arguments) {
   TEST(kMatchAll, 1, "(^|\n)", "\n");
   TEST(kMatchAll, 1, "($|x)", "x");
 
+  TEST(kMatchCount, 6, "(^|$|[x])", "_xxx_x_");
+  TEST(kMatchCount, 5, "(^|$|[x])", "_xxx_x");
+  TEST(kMatchCount, 1, "($|x)", "x");
+  // Matches found multiple times must only be counted once.
+  TEST(kMatchCount, 1, "(ab|cd)+e", "abeab");
+  TEST(kMatchCount, 2, "(ab|cd)+e", "_cdabe_abe");
+  // More matches than the count history holds.
+  TEST(kMatchCount, 10, "(ab|cd)+e", "abeabcdeabeabeabeababecdeabecdcdeabe");
+  TEST(kMatchCount, 11, "(^|$|[x])", "xxxxxxxxxx_x");
+  // No fast-forwarding is possible for this regexp.
+  TEST(kMatchCount, 3, "x*", "xx_xxx_");
+
   // Alternation.
   TEST_Full(1, "0123|abcd|efgh", "abcd");
   TEST_Full(1, "0123|abcd|efgh", "efgh");
@@ -337,6 +496,26 @@ int RunTest(struct arguments *arguments) {
   TEST_Full(1, "(ab.){3,}", "ab.ab.ab.ab.ab.");
   TEST_Full(1, "(ab.){3,}", "ab.ab.ab.ab.ab.ab.ab.ab.ab.ab.ab.ab.");
 
+  // More states than bits in a word of a packed state ring, and more positions
+  // than bits in a word for the bit-parallel tier.
+  TEST_Full(1, "(a|b){40,50}", x10("abab"));
+  TEST_Full(0, "(a|b){40,50}", x10("abab") "_");
+  TEST(kMatchAnywhere, 1, "x(a|b){40,50}_", "_x" x10("abab") "_");
+  TEST(kMatchAnywhere, 0, "x(a|b){40,50}_", "_x" x10("aba") "_");
+
+  // Large repetitions of single characters, matched with counters.
+  TEST_Full(0, "x{3,100}", "xx");
+  TEST_Full(1, "x{3,100}", "xxx");
+  TEST_Full(1, "x{3,100}", x100("x"));
+  TEST_Full(0, "x{3,100}", x100("x") "x");
+  TEST_Full(1, "a.{0,100}b", "a" x100("_") "b");
+  TEST_Full(0, "a.{0,100}b", "a" x100("_") "_b");
+  TEST_Full(1, "[0-9]{70,100}_[^_]{0,100}", x10("0123456") "_" x100("a"));
+  TEST_Multiple(2, "[0-9]{1,100}", "__" x100("1") "1_", 2, 102);
+  TEST_Multiple(1, "c{0,65}[^c]{1,71}.{2,70}", x10("ccccccc") "bxxx\n", 5, 74);
+  TEST_Multiple(2, "a{0,78}b+", "byb", 0, 1);
+  TEST_Multiple(4, "a{0,80}|a.a.", "acbb", 0, 1);
+
   TEST_Full(0, "(a.){2,3}{2,3}", "a.");
   TEST_Full(0, "(a.){2,3}{2,3}", "a.a.");
   TEST_Full(0, "(a.){2,3}{2,3}", "a.a.a.");
@@ -398,6 +577,16 @@ int RunTest(struct arguments *arguments) {
   TEST_Full(1, "_[0-9]*_", "_1234567890987654321_");
   TEST_Full(0, "_[0-9]*_", "_123456789_987654321_");
   TEST_Multiple_unbound(1, "[0-9]", "__________0__________", 10, 11);
+  // Brackets tested with a bitmap.
+  TEST_Full(1, "[A-Za-z0-9_.-]+", "Abc-123_x.Z");
+  TEST_Full(0, "[A-Za-z0-9_.-]+", "Abc-123 x.Z");
+  TEST_Full(1, "[^A-Za-z0-9_.-]+", " +=/\n");
+  TEST_Full(0, "[^A-Za-z0-9_.-]+", " +=/a");
+  TEST_Full(1, "x[abcdefg]y", "xey");
+  TEST_Full(0, "x[abcdefg]y", "xhy");
+  TEST_Full(1, "[\x80-\xff\x01" "a-c]*", "\xff\x80" "a\x01" "c");
+  TEST_Full(0, "[\x80-\xff\x01" "a-c]*", "\xff\x7f" "a");
+  TEST_Multiple_unbound(4, "[0-9a-fA-F]+", "__0x12ab__ff__CAFE__", 2, 3);
 
   TEST_Full(1, "^____$", "____");
   TEST(kMatchFirst, 1, "^____$", "xx\n____");
@@ -476,6 +665,10 @@ int RunTest(struct arguments *arguments) {
   TEST(kMatchAll, 5, "(^|$|[x])", "xxx_x_");
   TEST(kMatchAll, 5, "(^|$|[x])", "_xxx_x");
   TEST(kMatchAll, 4, "(^|$|[x])", "xxx_x");
+  // Matching backward from a fast-forward element must not look before the
+  // end of the previous match.
+  TEST(kMatchAll, 5, "(.+cab|_)", "__bacc___");
+  TEST(kMatchAll, 5, "(_|(a|[ab]+)|aba)", "\ncbccba\n_\nabab_");
   TEST_Multiple(1, "(.a|a)", "_a_", 0, 2);
   TEST_Multiple(1, "(a|.a)", "_a_", 0, 2);
   TEST_Multiple(1, "(a|.a.)", "_a_", 0, 3);
@@ -533,6 +726,155 @@ int RunTest(struct arguments *arguments) {
   TEST_Multiple(1, "(abcd|....efgh)", "abcdefgh", 0, 8);
   TEST_Multiple(1, "(abcd|_....efgh)", "_abcdefgh", 0, 9);
 
+  // More matches than the match buffer can hold.
+  TEST_Multiple(200, "x", x100("xx"), 0, 1);
+  TEST_Multiple(101, "x*", x100("_x"), 0, 0);
+  TEST_Multiple(100, "(ab|a)", x100("ab"), 0, 2);
+
+  // Long texts going through the SIMD fast-forward loops.
+  TEST_Multiple(1, "xyz", x100("_x_y") "xyz" x100("z__"), 400, 403);
+  TEST_Multiple(100, "z", x100("____________________z"), 20, 21);
+  TEST_Multiple(100, "abcdefghijk", x100("abcdefghij_abcdefghijk_"), 11, 22);
+  TEST_Multiple(300, "(ab|cd|ef)", x100("_a_c_e__ab_cd_ef_"), 8, 10);
+  TEST_Multiple(200, "(a0|b1|c2|d3|e4|f5|g6|h7|i8)", x100("__a1_b1__i8_h_"),
+                5, 7);
+  TEST_Multiple(1, "(a0|b1|c2|d3|e4|f5|g6|h7|i8)", x100("____") "h7", 400, 402);
+  TEST_Multiple(1, "[0-9]+ms", x100("__m_s_") "0ms" x10("_"), 600, 603);
+  TEST_Multiple(100, "\\d", x100("abcdefghijklmnopqrstuvwxyz1"), 26, 27);
+  TEST_Multiple(100, "[^a-z]", x100("abcdefghijklmnopqrstuvwxyz\n"), 26, 27);
+  TEST_Multiple(100, "[\x80-\xff]", x100("abcdefghijklmnopq\xe9"), 17, 18);
+  TEST_Multiple(1, "[xyz]", x100("______") "y", 600, 601);
+
+  // Regexps without fast-forward elements, matched with the lazy DFA.
+  TEST_Multiple(3, "(a|b)*", "ab_ba_", 0, 2);
+  TEST_Multiple(201, "(x|yz)*w?", x100("xyzw__"), 0, 4);
+  TEST_Multiple(101, "a?(bc)*", x100("_abcbc"), 0, 0);
+  TEST_MatchAllArray("(a|b)*", "ab_ba_ab");
+  // The state ring code splits the left-most longest match starting after
+  // "abc".
+  if (FLAG_use_dfa) {
+    TEST_Multiple(2, "[^a]|abc|((xy){0,2}[^a])*", "abcbb", 0, 3);
+    TEST_Multiple(3, "[^a]|abc|((xy){0,2}[^a])*", "abcxbbbca", 0, 3);
+  }
+
+  // Matching into an array.
+  TEST_MatchAllArray("x", "_x_xx__xxx_");
+  TEST_MatchAllArray("x*", "_x_xx__xxx_");
+  TEST_MatchAllArray("(ab)*", "abbcxb");
+  TEST_MatchAllArray("((x|ba)a)*", "_bbcxac__ax__aa");
+  TEST_MatchAllArray("(a|b)+c", "abc_bac_b_aabbc");
+
+  // Matches expressed as offsets.
+  TEST_MatchAllCompact("x", "_x_xx__xxx_");
+  TEST_MatchAllCompact("x*", "_x_xx__xxx_");
+  TEST_MatchAllCompact("(a|b)+c", "abc_bac_b_aabbc");
+  TEST_MatchAllCompact("$", "a\n\nb\n");
+  // More matches than fit in the buffer used by the generated code.
+  TEST_MatchAllCompact("(ab|a)", x100("aab_") x100("ab"));
+  TEST_MatchAllCompact("x*", x100("_x_xx__xxx_"));
+
+  // Groups, listed as the match followed by each group ('-' when unset).
+  TEST_Groups("(ab)c", "_abc_", "abc,ab");
+  TEST_Groups("(ab)*c", "_ababc_", "ababc,ab");
+  TEST_Groups("(ab){2}", "ababab", "abab,ab");
+  TEST_Groups("((a)b)+", "_abab", "abab,ab,a");
+  TEST_Groups("(a)|(b)", "_b_a", "b,-,b");
+  TEST_Groups("(a|ab)(c|bcd)", "abcd", "abcd,a,bcd");
+  TEST_Groups("([a-z]+)=([0-9]*)", "_ key=42 x=", "key=42,key,42");
+  TEST_Groups("a(b*)c", "_ac_abc", "ac,");
+  TEST_Groups("^(x+)$", "xy\nxx\n", "xx,xx");
+  TEST_Groups("(x)(y)?", "_x_xy", "x,x,-");
+  // Too large for the groups to be located. They are reported as unset.
+  TEST_Groups("(abcdefgh){1,9000}", "_" x10("abcdefgh") "_",
+              x10("abcdefgh") ",-");
+
+  // Case insensitive matching.
+  TEST_IgnoreCase(5, "error", "Error ERROR error eRRoR errors");
+  TEST_IgnoreCase(1, "a@b", "A`B a@B");
+  TEST_IgnoreCase(100, "caseinsensitivematching",
+                  x100("_CaseInsensitiveMatching_"));
+  TEST_IgnoreCase(300, "(foo|bar|baz)", x100("FOO_Bar_bAZ_fob "));
+  TEST_IgnoreCase(3, "[a-c]x", "Ax_bX_CX_dx");
+  TEST_IgnoreCase(2, "[^a]", "aAbB");
+  TEST_IgnoreCase(2, "(ab){2}c*", "ABabC_abAB");
+
+  // Cache of compiled regexps used by the high level helpers.
+  TEST_Cache();
+
+  // Executable memory shared by the generated code.
+  TEST_CodeArena();
+
+  // Compiling all match types from a single analysis of the regexp.
+  TEST_CompileAll("x", "_x_xx__xxx_");
+  TEST_CompileAll("(ab|cd)+e", "_abe_cdabe_ab_e");
+  TEST_CompileAll("(abcdef|xbcdey)", "_abcdef_xbcdey_abcdey");
+  TEST_CompileAll("^a.{2,4}$", "abc\na\naxxxx\nabcdef");
+  TEST_CompileAll("(a|b){3,}c*", "_aab_abbbcc_ba");
+
+  // Loading compiled code saved by another Regej.
+  TEST_Snapshot("x", "_x_xx__xxx_");
+  TEST_Snapshot("(ab|cd)+e", "_abe_cdabe_ab_e");
+  TEST_Snapshot("(abcdefghijkl|xbcdey)", "_abcdefghijkl_xbcdey_abcdey");
+  TEST_Snapshot("^a.{2,4}$", "abc\na\naxxxx\nabcdef");
+  TEST_Snapshot("(a|b){3,}c*", "_aab_abbbcc_ba");
+
+  // Matching in a text provided in chunks.
+  TEST_Stream("x", "_x_xx__xxx_");
+  TEST_Stream("abcd|bc", "_abcd_abc_bcd_ab");
+  TEST_Stream("x*", "_x_xx__xxx_");
+  TEST_Stream("x$", "x\n_x_\nxx\n");
+  TEST_Stream("^x+", "x\n_x_\nxx\nxxx");
+  TEST_Stream("a.*b", "ab_ab\na__b_\nb_a");
+  TEST_Stream("(a|\n)+", "_a\na__\n\na_");
+  TEST_Stream("^$", "\n\nx\n\n");
+
+  // Matching a set of regexps.
+  TEST_Set("_abc_", "abc", "b", "d", "bc_");
+  TEST_Set("xyz", "x", "y", "z", "w");
+  TEST_Set("_ab_cd_", "ab|cd", "(ab|cd)_", "a(x|y)", "b_c", "e+");
+  TEST_Set("0123456789", "[0-9]+", "^0", "9$", "^1", "8$", "35");
+  TEST_Set("foo\nbar\n", "^bar", "foo$", "o\nb", "^o", "ab");
+  TEST_Set("aaaa", "a*", "aaaa", "aaaaa", "a{2,3}", "b?");
+  TEST_Set("x" x100("_") "y", "x.*y", "x_*y", "x.{100}y", "x_{99}y", "x.+z");
+
+  // Matching with multiple threads.
+  TEST_MatchAllParallel("x{1,7}", "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx_");
+  TEST_MatchAllParallel("(ab|a)", "aababbaa_ab");
+  TEST_MatchAllParallel("x*", "xx_xxx_\n");
+  TEST_MatchAllParallel("^x+$", "xxx\nx_x\n\nxxxxxxx\n");
+  TEST_MatchAllParallel("a.*b", "a_b__ab\nb_a\n");
+  TEST_MatchAllParallel("$", "abc\n\n");
+  // Cannot be split.
+  TEST_MatchAllParallel("(a|\n)+", "a\n_aa\n\n_");
+
+  // A single Regej used by multiple threads.
+  TEST_SharedRegej("x{1,7}", "xxxxxxxxxx_");
+  TEST_SharedRegej("(ab|a)c", "aababcbaac_abc");
+  TEST_SharedRegej("a.*b", "a_b__ab\nb_a\n");
+  TEST_SharedRegej("(abcd|efgh)_", "__abcd_efgh__");
+
+  // A match context reused for every line and regexp.
+  TEST_Context("abc\nxabcx\n\nab" x10("c") "\nbcab\n" x50("ab") "\n",
+               "abc", "(ab|bc)+", "a.*c", "x[a-c]{2,4}", "(a|b){3,60}",
+               "^(ab)*$", "c$", "b" x10("c") "|" x10("ab") "c");
+
+  // Matching many texts, or the lines of a text, in one call.
+  TEST_Batch("x", "_x_\n\nxx\n___\nx");
+  TEST_Batch("x", "_\n_x\n\n");
+  TEST_Batch("^x+$", "xxx\nx_x\n\nxxxxxxx\n");
+  TEST_Batch("$", "abc\n\n");
+  TEST_Batch("x*", "_\n\nx\n");
+  TEST_Batch("a.*b", "a_b\nb_a\n\n__ab");
+  TEST_Batch("(a|\n)+", "a\n_aa\n\n_");
+  TEST_Batch("(abcd|efgh)_", x10("__abcd_efgh__\n") x10("\n") "efgh_");
+
+  // Line helpers.
+  TEST_Lines("");
+  TEST_Lines("\n\n");
+  TEST_Lines("abc\nde\n\nf");
+  TEST_Lines(x10("abcdefgh\n") "\n" x50("a\n") x10("abc") "\n");
+  TEST_Lines(x50(x10("\n") "a"));
+
   if (count_fail) {
     printf("FAIL: %d\tpass: %d\t(total: %d)\n", count_fail, count_pass, count_fail + count_pass);
   } else {
@@ -575,6 +917,9 @@ static unsigned DoTest(MatchType match_type,
       re.MatchAll(text, &matches);
       res = matches.size();
       break;
+    case kMatchCount:
+      res = re.MatchAllCount(text);
+      break;
 
     default:
       UNREACHABLE();
@@ -587,13 +932,10 @@ static TestStatus Test(MatchType match_type,
                        unsigned expected,
                        unsigned line,
                        int expected_start, int expected_end) {
-  ++test_id;
-  if (!ShouldTest(&arguments, line, test_id)) {
+  if (!StartTest(line)) {
     return TEST_SKIPPED;
   }
 
-  PrintTest(&arguments, line, test_id);
-
 
   bool exception = false;
   bool incorrect_limits = false;
@@ -620,17 +962,16 @@ static TestStatus Test(MatchType match_type,
       expected = !!expected;
       break;
     case kMatchAll:
+    case kMatchCount:
       break;
     default:
       break;
   }
 
-  if (exception || res != expected || incorrect_limits) {
-    cout << "--- FAILED line " << line << " test_id " << test_id
-         << " ------------------------------------------------------" << endl;
-    cout << "regexp:\n" << regexp << endl;
-    cout << "text:\n" << text << endl;
-    cout << "expected: " << expected << "  found: " << res << endl;
+  bool success = !exception && res == expected && !incorrect_limits;
+  if (!success) {
+    ReportFailure(line, regexp, text)
+      << "expected: " << expected << "  found: " << res << endl;
     if (expected_start != -1 || expected_end != -1) {
       cout << "      \texpected\tfound" << endl;
     }
@@ -654,12 +995,7 @@ static TestStatus Test(MatchType match_type,
     cout << "------------------------------------------------------------------------------------\n\n" << endl;
   }
 
-  int status = (exception || res != expected || incorrect_limits) ? TEST_FAILED
-                                                                  : TEST_PASSED;
-  if (arguments.break_on_fail) {
-    assert(status == TEST_PASSED);
-  }
-  return status;
+  return EndTest(success);
 }
 
 static TestStatus TestFull(const char* regexp, const string& text,
@@ -673,6 +1009,8 @@ static TestStatus TestFull(const char* regexp, const string& text,
       return rc;
     if ((rc |= Test(kMatchAll, regexp, text, expected, line)) == TEST_FAILED)
       return rc;
+    if ((rc |= Test(kMatchCount, regexp, text, expected, line)) == TEST_FAILED)
+      return rc;
   }
   return rc;
 }
@@ -709,12 +1047,728 @@ static int TestMultiple(const char* regexp, const string& text,
       return rc;
     if ((rc |= Test(kMatchAll, regexp, *str, expected, line)) == TEST_FAILED)
       return rc;
+    if ((rc |= Test(kMatchCount, regexp, *str, expected, line)) == TEST_FAILED)
+      return rc;
   }
 
   return rc;
 }
 
 
+// Check that matching into arrays of all sizes yields the same matches as
+// matching into a vector.
+static TestStatus TestMatchAllArray(const char* regexp, const string& text,
+                                    unsigned line) {
+  if (!StartTest(line)) {
+    return TEST_SKIPPED;
+  }
+
+  Regej re(regexp);
+  vector<Match> expected;
+  re.MatchAll(text, &expected);
+
+  bool success = true;
+  vector<Match> found(expected.size() + 1);
+  for (size_t capacity = 0; capacity <= found.size(); ++capacity) {
+    size_t n_found =
+      re.MatchAll(text.c_str(), text.size(), found.data(), capacity);
+    success &= n_found == min(capacity, expected.size());
+    for (size_t i = 0; success && i < n_found; ++i) {
+      success &= found[i].begin == expected[i].begin;
+      success &= found[i].end == expected[i].end;
+    }
+    if (!success) {
+      ReportFailure(line, regexp, text)
+        << "capacity: " << capacity << "  expected: "
+        << min(capacity, expected.size()) << "  found: " << n_found << endl;
+      break;
+    }
+  }
+
+  return EndTest(success);
+}
+
+
+static TestStatus TestMatchAllCompact(const char* regexp, const string& text,
+                                      unsigned line) {
+  if (!StartTest(line)) {
+    return TEST_SKIPPED;
+  }
+
+  vector<Match> expected;
+  Regej(regexp).MatchAll(text, &expected);
+
+  // The offsets are the same for a copy of the text.
+  string copy = text;
+  vector<CompactMatch> found;
+  Regej re(regexp);
+  bool success =
+    re.MatchAll(copy.c_str(), copy.size(), &found) == expected.size();
+  for (size_t i = 0; success && i < found.size(); ++i) {
+    success &= text.c_str() + found[i].begin == expected[i].begin;
+    success &= text.c_str() + found[i].end == expected[i].end;
+  }
+
+  if (!success) {
+    ReportFailure(line, regexp, text)
+      << "expected: " << expected.size() << "  found: " << found.size()
+      << endl;
+  }
+
+  return EndTest(success);
+}
+
+
+static string GroupsToString(const vector<Match>& groups) {
+  string result;
+  for (size_t i = 0; i < groups.size(); i++) {
+    if (i) {
+      result += ",";
+    }
+    if (groups[i].begin == NULL) {
+      result += "-";
+    } else {
+      result.append(groups[i].begin, groups[i].end - groups[i].begin);
+    }
+  }
+  return result;
+}
+
+
+static TestStatus TestGroups(const char* regexp, const string& text,
+                             const char* expected, unsigned line) {
+  if (!StartTest(line)) {
+    return TEST_SKIPPED;
+  }
+
+  Regej re(regexp);
+  vector<Match> groups;
+  re.MatchFirst(text, &groups);
+  string found = GroupsToString(groups);
+  bool success = found == expected;
+
+  // The matches are the same as without groups.
+  vector<Match> matches;
+  vector<vector<Match> > all_groups;
+  success &= re.MatchAll(text, &all_groups) == re.MatchAll(text, &matches);
+  for (size_t i = 0; success && i < matches.size(); i++) {
+    success &= all_groups[i][0].begin == matches[i].begin &&
+      all_groups[i][0].end == matches[i].end;
+  }
+  success &= !all_groups.empty() && GroupsToString(all_groups[0]) == found;
+
+  if (!success) {
+    ReportFailure(line, regexp, text)
+      << "expected: " << expected << "  found: " << found << endl;
+  }
+
+  return EndTest(success);
+}
+
+
+// Check that matching while ignoring the case gives the same results as
+// matching the lowercase regexp in the lowercase text.
+static TestStatus TestIgnoreCase(const char* regexp, const string& text,
+                                 unsigned expected, unsigned line) {
+  if (!StartTest(line)) {
+    return TEST_SKIPPED;
+  }
+
+  string lower_regexp = regexp;
+  string lower_text = text;
+  for (char& c : lower_regexp) {
+    c = tolower(c);
+  }
+  for (char& c : lower_text) {
+    c = tolower(c);
+  }
+  Regej re(regexp, kIgnoreCase);
+  Regej lower_re(lower_regexp);
+
+  vector<Match> matches, lower_matches;
+  bool success = re.MatchAll(text, &matches) == expected;
+  success &= lower_re.MatchAll(lower_text, &lower_matches) == matches.size();
+  for (size_t i = 0; success && i < matches.size(); i++) {
+    success &= matches[i].begin - text.c_str() ==
+      lower_matches[i].begin - lower_text.c_str();
+    success &= matches[i].end - text.c_str() ==
+      lower_matches[i].end - lower_text.c_str();
+  }
+  success &= re.MatchAllCount(text) == expected;
+  success &= re.MatchAnywhere(text) == (expected != 0);
+  success &= re.MatchFull(text) == lower_re.MatchFull(lower_text);
+  Match first;
+  success &= re.MatchFirst(text, &first) == (expected != 0);
+  success &= expected == 0 || (first.begin == matches[0].begin &&
+                               first.end == matches[0].end);
+
+  if (!success) {
+    ReportFailure(line, regexp, text)
+      << "expected: " << expected << "  found: " << matches.size() << endl;
+  }
+
+  return EndTest(success);
+}
+
+
+static TestStatus TestCache(unsigned line) {
+  if (!StartTest(line)) {
+    return TEST_SKIPPED;
+  }
+
+  size_t capacity = GetCacheStats().capacity;
+  ClearCache();
+  SetCacheCapacity(2);
+
+  bool success = true;
+  success &= MatchAllCount("x", "_x_x_") == 2;
+  success &= MatchAllCount("x", "xxx") == 3;
+  // Regexps are cached per match type.
+  success &= MatchFull("x", "x");
+  // Evicts the least recently used regexp.
+  success &= MatchAnywhere("y", "_y_");
+  success &= MatchAllCount("x", "x") == 1;
+  // Invalid regexps are not cached.
+  success &= !MatchFull("x{3,1}", "xx");
+
+  CacheStats stats = GetCacheStats();
+  success &= stats.hits == 1;
+  success &= stats.misses == 5;
+  success &= stats.evictions == 2;
+  success &= stats.size == 2;
+
+  SetCacheCapacity(0);
+  success &= MatchFull("x", "x");
+  success &= GetCacheStats().size == 0;
+
+  ClearCache();
+  SetCacheCapacity(capacity);
+
+  if (!success) {
+    ReportFailure(line)
+      << "hits: " << stats.hits << "  misses: " << stats.misses
+      << "  evictions: " << stats.evictions << "  size: " << stats.size
+      << endl;
+  }
+
+  return EndTest(success);
+}
+
+
+static TestStatus TestCodeArena(unsigned line) {
+  if (!StartTest(line)) {
+    return TEST_SKIPPED;
+  }
+
+  const int n_regexps = 200;
+  CodeArenaStats before = GetCodeArenaStats();
+  bool success = true;
+
+  vector<string> regexps;
+  for (int i = 0; i < n_regexps; i++) {
+    regexps.push_back("x" + to_string(i) + "(a|b)*");
+  }
+  vector<Regej*> res;
+  for (int i = 0; i < n_regexps; i++) {
+    Regej* re = new Regej(regexps[i].c_str());
+    success &= re->Compile(kMatchFirst);
+    res.push_back(re);
+  }
+  CodeArenaStats full = GetCodeArenaStats();
+  // Functions share regions.
+  success &= full.regions - before.regions < static_cast<size_t>(n_regexps);
+  success &= full.used > before.used;
+  for (int i = 0; i < n_regexps; i++) {
+    string text = "_x" + to_string(i) + "ab_";
+    Match match;
+    success &= res[i]->MatchFirst(text, &match);
+  }
+
+  // Free every other regexp and compile new ones in the holes.
+  for (int i = 0; i < n_regexps; i += 2) {
+    delete res[i];
+    res[i] = new Regej(regexps[i].c_str());
+    success &= res[i]->Compile(kMatchFirst);
+  }
+  success &= GetCodeArenaStats().committed == full.committed;
+
+  for (int i = 0; i < n_regexps; i++) {
+    delete res[i];
+  }
+  CodeArenaStats after = GetCodeArenaStats();
+  success &= after.used == before.used;
+  // Empty regions are released.
+  success &= after.regions <= max(before.regions, static_cast<size_t>(1));
+
+  if (!success) {
+    ReportFailure(line)
+      << "committed: " << after.committed << "  used: " << after.used
+      << "  regions: " << after.regions << endl;
+  }
+
+  return EndTest(success);
+}
+
+
+// Check that the match types compiled together yield the same results as when
+// compiled separately.
+static TestStatus TestCompileAll(const char* regexp, const string& text,
+                                 unsigned line) {
+  if (!StartTest(line)) {
+    return TEST_SKIPPED;
+  }
+
+  bool success = true;
+  Regej re(regexp);
+  success &= re.CompileAll();
+  // All match types are available without compiling more code.
+  CodeArenaStats compiled = GetCodeArenaStats();
+
+  Match match, expected_match;
+  vector<Match> matches, expected_matches;
+  success &= re.MatchFull(text) == Regej(regexp).MatchFull(text);
+  success &= re.MatchAnywhere(text) == Regej(regexp).MatchAnywhere(text);
+  CodeArenaStats matched = GetCodeArenaStats();
+  success &= re.MatchFirst(text, &match) ==
+    Regej(regexp).MatchFirst(text, &expected_match);
+  success &= match.begin == expected_match.begin &&
+    match.end == expected_match.end;
+  success &= re.MatchAll(text, &matches) ==
+    Regej(regexp).MatchAll(text, &expected_matches);
+  success &= matches.size() == expected_matches.size();
+  for (size_t i = 0; i < matches.size() && i < expected_matches.size(); i++) {
+    success &= matches[i].begin == expected_matches[i].begin &&
+      matches[i].end == expected_matches[i].end;
+  }
+  success &= re.MatchAllCount(text) == expected_matches.size();
+  success &= matched.used == compiled.used;
+
+  if (!success) {
+    ReportFailure(line, regexp, text);
+  }
+
+  return EndTest(success);
+}
+
+
+static TestStatus TestSnapshot(const char* regexp, const string& text,
+                               unsigned line) {
+  if (!StartTest(line)) {
+    return TEST_SKIPPED;
+  }
+
+  bool success = true;
+  string snapshot;
+  // The code emitted for debugging cannot be saved.
+  bool emit_debug_code = FLAG_emit_debug_code;
+  SET_FLAG(emit_debug_code, false);
+  {
+    Regej re(regexp);
+    success &= re.CompileAll();
+    success &= re.Serialize(&snapshot);
+  }
+
+  // The expected results are computed first, so that the code they compile
+  // does not affect the arena statistics below.
+  Match match, expected_match;
+  vector<Match> matches, expected_matches;
+  bool expected_full, expected_anywhere, expected_first;
+  size_t expected_all;
+  {
+    Regej expected(regexp);
+    expected_full = expected.MatchFull(text);
+    expected_anywhere = expected.MatchAnywhere(text);
+    expected_first = expected.MatchFirst(text, &expected_match);
+    expected_all = expected.MatchAll(text, &expected_matches);
+  }
+
+  Regej re(regexp);
+  success &= re.Deserialize(snapshot);
+  // No code is compiled when matching.
+  CodeArenaStats loaded = GetCodeArenaStats();
+  SET_FLAG(emit_debug_code, emit_debug_code);
+
+  success &= re.MatchFull(text) == expected_full;
+  success &= re.MatchAnywhere(text) == expected_anywhere;
+  success &= re.MatchFirst(text, &match) == expected_first;
+  success &= match.begin == expected_match.begin &&
+    match.end == expected_match.end;
+  success &= re.MatchAll(text, &matches) == expected_all;
+  success &= matches.size() == expected_matches.size();
+  for (size_t i = 0; i < matches.size() && i < expected_matches.size(); i++) {
+    success &= matches[i].begin == expected_matches[i].begin &&
+      matches[i].end == expected_matches[i].end;
+  }
+  success &= re.MatchAllCount(text) == expected_matches.size();
+  CodeArenaStats matched = GetCodeArenaStats();
+  success &= matched.used == loaded.used;
+
+  // Invalid snapshots are rejected.
+  success &= !Regej(regexp).Deserialize(snapshot.data(), snapshot.size() - 1);
+  success &= !Regej((string(regexp) + "_").c_str()).Deserialize(snapshot);
+  string corrupted = snapshot;
+  corrupted[0] ^= 1;
+  success &= !Regej(regexp).Deserialize(corrupted);
+
+  if (!success) {
+    ReportFailure(line, regexp, text);
+  }
+
+  return EndTest(success);
+}
+
+
+// Check that feeding the text to a stream in chunks of all sizes yields the
+// same matches as matching the whole text.
+static TestStatus TestStream(const char* regexp, const string& text,
+                             unsigned line) {
+  if (!StartTest(line)) {
+    return TEST_SKIPPED;
+  }
+
+  Regej re(regexp);
+  vector<Match> expected;
+  re.MatchAll(text, &expected);
+
+  bool success = true;
+  RegejStream stream(&re);
+  vector<StreamMatch> found;
+  for (size_t chunk_size = 1; chunk_size <= text.size(); ++chunk_size) {
+    found.clear();
+    for (size_t pos = 0; pos < text.size(); pos += chunk_size) {
+      stream.Feed(text.c_str() + pos, min(chunk_size, text.size() - pos),
+                  &found);
+    }
+    stream.Finish(&found);
+    success &= found.size() == expected.size();
+    for (size_t i = 0; success && i < found.size(); ++i) {
+      success &= found[i].begin ==
+        static_cast<size_t>(expected[i].begin - text.c_str());
+      success &= found[i].end ==
+        static_cast<size_t>(expected[i].end - text.c_str());
+    }
+    if (!success) {
+      ReportFailure(line, regexp, text)
+        << "chunk size: " << chunk_size << "  expected: "
+        << expected.size() << "  found: " << found.size() << endl;
+      break;
+    }
+  }
+
+  return EndTest(success);
+}
+
+
+// Check that a set of regexps reports the same matches as each of the
+// regexps.
+static TestStatus TestSet(const string& text, const vector<string>& regexps,
+                          unsigned line) {
+  if (!StartTest(line)) {
+    return TEST_SKIPPED;
+  }
+
+  RegejSet set(regexps);
+  vector<size_t> matched;
+  vector<SetMatch> set_matches;
+  set.Match(text, &matched);
+  set.MatchAll(text, &set_matches);
+
+  bool success = true;
+  vector<size_t> expected;
+  vector<SetMatch> expected_matches;
+  for (size_t i = 0; i < regexps.size(); i++) {
+    Regej re(regexps[i]);
+    vector<Match> matches;
+    if (re.MatchAnywhere(text)) {
+      expected.push_back(i);
+    }
+    re.MatchAll(text, &matches);
+    for (size_t j = 0; j < matches.size(); j++) {
+      SetMatch match = {i, matches[j]};
+      expected_matches.push_back(match);
+    }
+  }
+  success &= matched == expected;
+  success &= set_matches.size() == expected_matches.size();
+  for (size_t i = 0; success && i < set_matches.size(); i++) {
+    success &= set_matches[i].index == expected_matches[i].index;
+    success &= set_matches[i].match.begin == expected_matches[i].match.begin;
+    success &= set_matches[i].match.end == expected_matches[i].match.end;
+  }
+
+  if (!success) {
+    ReportFailure(line) << "regexps:" << endl;
+    for (size_t i = 0; i < regexps.size(); i++) {
+      cout << i << ": " << regexps[i] << endl;
+    }
+    cout << "text:\n" << text << endl;
+    cout << "expected:";
+    for (size_t i = 0; i < expected.size(); i++) {
+      cout << " " << expected[i];
+    }
+    cout << "\nfound:";
+    for (size_t i = 0; i < matched.size(); i++) {
+      cout << " " << matched[i];
+    }
+    cout << endl;
+  }
+
+  return EndTest(success);
+}
+
+
+// Check that matching with multiple threads yields the same matches as matching
+// with a single thread. The text is built by repeating the pattern, so that it
+// is big enough to be split.
+static TestStatus TestMatchAllParallel(const char* regexp, const string& pattern,
+                                       unsigned line) {
+  if (!StartTest(line)) {
+    return TEST_SKIPPED;
+  }
+
+  string text;
+  while (text.size() < (1 << 19)) {
+    text.append(pattern);
+  }
+
+  Regej re(regexp);
+  vector<Match> expected;
+  re.MatchAll(text, &expected);
+
+  bool success = true;
+  vector<Match> found;
+  unsigned n_threads;
+  for (n_threads = 2; n_threads <= 8; ++n_threads) {
+    found.clear();
+    re.MatchAll(text.c_str(), text.size(), &found, n_threads);
+    success &= found.size() == expected.size();
+    for (size_t i = 0; success && i < found.size(); ++i) {
+      success &= found[i].begin == expected[i].begin;
+      success &= found[i].end == expected[i].end;
+    }
+    success &= re.MatchAllCount(text.c_str(), text.size(), n_threads) ==
+      expected.size();
+    if (!success) {
+      break;
+    }
+  }
+
+  if (!success) {
+    ReportFailure(line) << "regexp:\n" << regexp << endl;
+    cout << "pattern:\n" << pattern << endl;
+    cout << "threads: " << n_threads << "  expected: " << expected.size()
+         << "  found: " << found.size() << endl;
+  }
+
+  return EndTest(success);
+}
+
+
+static TestStatus TestSharedRegej(const char* regexp, const string& pattern,
+                                  unsigned line) {
+  if (!StartTest(line)) {
+    return TEST_SKIPPED;
+  }
+
+  string text;
+  while (text.size() < (1 << 14)) {
+    text.append(pattern);
+  }
+
+  Match expected_first;
+  vector<Match> expected_all;
+  bool expected_full = Regej(regexp).MatchFull(text);
+  bool expected_anywhere = Regej(regexp).MatchAnywhere(text);
+  bool expected_found = Regej(regexp).MatchFirst(text, &expected_first);
+  Regej(regexp).MatchAll(text, &expected_all);
+
+  // The code is compiled on demand by the threads.
+  Regej re(regexp);
+  const unsigned n_threads = 8;
+  const unsigned n_iterations = 20;
+  vector<char> thread_success(n_threads, true);
+  rejit_status_string[0] = '\0';
+  auto match = [&](unsigned id) {
+    bool success = true;
+    for (unsigned i = 0; i < n_iterations; i++) {
+      // Start with different match types in each thread.
+      for (unsigned j = 0; j < 4; j++) {
+        switch ((id + j) % 4) {
+          case 0:
+            success &= re.MatchFull(text) == expected_full;
+            break;
+          case 1:
+            success &= re.MatchAnywhere(text) == expected_anywhere;
+            break;
+          case 2: {
+            Match first;
+            success &= re.MatchFirst(text, &first) == expected_found;
+            success &= !expected_found ||
+              (first.begin == expected_first.begin &&
+               first.end == expected_first.end);
+            break;
+          }
+          case 3: {
+            vector<Match> all;
+            success &= re.MatchAll(text, &all) == expected_all.size();
+            for (size_t k = 0; success && k < all.size(); k++) {
+              success &= all[k].begin == expected_all[k].begin &&
+                all[k].end == expected_all[k].end;
+            }
+            break;
+          }
+        }
+      }
+    }
+    // Errors are reported to the thread that caused them.
+    success &= Regej("a{3,2}").status() != RejitSuccess;
+    success &= rejit_status_string[0] != '\0';
+    thread_success[id] = success;
+  };
+
+  vector<thread> threads;
+  for (unsigned i = 0; i < n_threads; i++) {
+    threads.push_back(thread(match, i));
+  }
+  for (unsigned i = 0; i < n_threads; i++) {
+    threads[i].join();
+  }
+  bool success = rejit_status_string[0] == '\0';
+  for (unsigned i = 0; i < n_threads; i++) {
+    success &= thread_success[i];
+  }
+
+  if (!success) {
+    ReportFailure(line) << "regexp:\n" << regexp << endl;
+    cout << "pattern:\n" << pattern << endl;
+  }
+
+  return EndTest(success);
+}
+
+
+static TestStatus TestContext(const string& text, const vector<string>& regexps,
+                              unsigned line) {
+  if (!StartTest(line)) {
+    return TEST_SKIPPED;
+  }
+
+  vector<string> lines;
+  size_t begin = 0, end;
+  while ((end = text.find('\n', begin)) != string::npos) {
+    lines.push_back(text.substr(begin, end - begin));
+    begin = end + 1;
+  }
+
+  // The results with the shared context must be the same as with a new one.
+  vector<Regej*> regejs;
+  for (const string& regexp : regexps) {
+    regejs.push_back(new Regej(regexp));
+  }
+  MatchContext context;
+  bool success = true;
+  for (size_t i = 0; success && i < lines.size() * regejs.size(); i++) {
+    Regej* re = regejs[i % regejs.size()];
+    const string& l = lines[i / regejs.size()];
+    MatchContext new_context;
+    Match first, expected_first;
+    bool found = re->MatchFirst(l.data(), l.size(), &first, &context);
+    bool expected_found =
+      re->MatchFirst(l.data(), l.size(), &expected_first, &new_context);
+    success &= re->MatchFull(l.data(), l.size(), &context) ==
+      re->MatchFull(l.data(), l.size(), &new_context);
+    success &= re->MatchAnywhere(l.data(), l.size(), &context) ==
+      re->MatchAnywhere(l.data(), l.size(), &new_context);
+    success &= found == expected_found;
+    success &= !found || (first.begin == expected_first.begin &&
+                          first.end == expected_first.end);
+    success &= re->MatchAllCount(l.data(), l.size(), &context) ==
+      re->MatchAllCount(l.data(), l.size(), &new_context);
+    if (!success) {
+      ReportFailure(line) << "regexp:\n" << regexps[i % regejs.size()] << endl;
+      cout << "text:\n" << l << endl;
+    }
+  }
+  for (Regej* re : regejs) {
+    delete re;
+  }
+
+  return EndTest(success);
+}
+
+
+static TestStatus TestBatch(const char* regexp, const string& text,
+                            unsigned line) {
+  if (!StartTest(line)) {
+    return TEST_SKIPPED;
+  }
+
+  Regej re(regexp);
+  vector<bool> expected;
+  size_t begin = 0;
+  while (begin < text.size()) {
+    size_t end = text.find('\n', begin);
+    if (end == string::npos) {
+      end = text.size();
+    }
+    expected.push_back(re.MatchAnywhere(text.data() + begin, end - begin));
+    begin = end + 1;
+  }
+  size_t n_expected = count(expected.begin(), expected.end(), true);
+  vector<bool> matched_lines;
+  size_t n_matched_lines =
+    re.MatchAnywhereLines(text.data(), text.size(), &matched_lines);
+  bool success = n_matched_lines == n_expected && matched_lines == expected;
+
+  if (!success) {
+    ReportFailure(line, regexp, text) << "expected (" << n_expected << "):\n";
+    for (bool m : expected) cout << m;
+    cout << "\nlines (" << n_matched_lines << "):\n";
+    for (bool m : matched_lines) cout << m;
+    cout << endl;
+  }
+
+  return EndTest(success);
+}
+
+
+static TestStatus TestLines(const string& text, unsigned line) {
+  if (!StartTest(line)) {
+    return TEST_SKIPPED;
+  }
+
+  const char* begin = text.data();
+  const char* end = begin + text.size();
+  bool success = true;
+  for (const char* c = begin; c <= end && success; c++) {
+    size_t n_newlines = count(c, end, '\n');
+    success &= CountNewlines(c, end - c) == n_newlines;
+
+    // The line containing c, and the lines spanned by a match of one character
+    // at c.
+    const char* sol = c;
+    while (sol > begin && sol[-1] != '\n') sol--;
+    const char* eol = c;
+    while (eol < end && *eol != '\n') eol++;
+    Match empty = {c, c};
+    Match lines = EnclosingLines(begin, text.size(), empty);
+    success &= lines.begin == sol && lines.end == eol;
+    if (c < end) {
+      Match one = {c, c + 1};
+      lines = EnclosingLines(begin, text.size(), one);
+      success &= lines.begin == sol && lines.end == eol;
+    }
+    if (!success) {
+      ReportFailure(line) << "text:\n" << text << endl;
+      cout << "at offset " << c - begin << ", " << n_newlines
+           << " newlines after it" << endl;
+    }
+  }
+
+  return EndTest(success);
+}
+
+
 }  // namespace rejit
 
 